@@ -0,0 +1,37 @@
+# -------------------------------------------------
+# EMUtrix terminal frontend
+# -------------------------------------------------
+# Copyright 2010 Camilo Polymeris
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 3 as
+# published by the Free Software Foundation.
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+# ncurses, over the same SoundCard as the window, without QtGui.
+# Build with: make tui
+TARGET = emutrix-tui
+VERSION = 0.3
+TEMPLATE = app
+QT -= gui
+CONFIG += console
+# Objects of their own, they are built without QtGui
+OBJECTS_DIR = tui
+SOURCES += src/tui_main.cc \
+    src/terminalview.cc \
+    src/soundcard.cc \
+    src/elementschema.cc
+HEADERS += src/terminalview.h \
+    src/soundcard.h \
+    src/elementschema.h \
+    src/controlbindings.h \
+    src/matrix_visibility.h \
+    src/monotonic.h \
+    src/sanealsa.h
+LIBS += -lasound \
+    -lrt \
+    -lncurses
+DEFINES += APPLICATION_NAME=\\\"$(TARGET)\\\"
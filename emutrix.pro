@@ -17,17 +17,64 @@ TEMPLATE = app
 SOURCES += src/main.cc \
     src/mainwindow.cc \
     src/mainwindow_slots.cc \
-    src/soundcard.cc
+    src/soundcard.cc \
+    src/cardloader.cc \
+    src/elementschema.cc \
+    src/midicontrol.cc \
+    src/shmstate.cc \
+    src/journal.cc \
+    src/trace.cc \
+    src/verifier.cc \
+    src/controlthread.cc \
+    src/cuelist.cc \
+    src/cardgroup.cc \
+    src/alsastate.cc \
+    src/stresstest.cc \
+    src/analyzer.cc \
+    src/spectrumview.cc \
+    src/autosave.cc \
+    src/osccontrol.cc \
+    src/routetest.cc
 HEADERS += src/sanealsa.h \
     src/mainwindow.h \
     src/soundcard.h \
-    src/matrix_visibility.h
+    src/matrix_visibility.h \
+    src/cardloader.h \
+    src/elementschema.h \
+    src/midicontrol.h \
+    src/monotonic.h \
+    src/shmstate.h \
+    src/emutrix_shm.h \
+    src/journal.h \
+    src/trace.h \
+    src/verifier.h \
+    src/controlthread.h \
+    src/cuelist.h \
+    src/cardgroup.h \
+    src/alsastate.h \
+    src/controlbindings.h \
+    src/stresstest.h \
+    src/fft.h \
+    src/analyzer.h \
+    src/spectrumview.h \
+    src/autosave.h \
+    src/osccontrol.h \
+    src/correlator.h \
+    src/routetest.h
 FORMS += res/mainwindow.ui
 RESOURCES += res/emutrix.qrc
-LIBS += -lasound
+LIBS += -lasound \
+    -lrt
 DISTFILES += Makefile \
     README \
     COPYING \
+    emutrix-tui.pro \
+    src/terminalview.h \
+    src/terminalview.cc \
+    src/tui_main.cc \
+    libemutrix.pro \
+    src/emutrix.h \
+    src/libemutrix.cc \
     res/panic.png \
     res/session.png \
     res/link.png \
@@ -35,3 +82,24 @@ DISTFILES += Makefile \
     res/emutrix.png \
     res/mute.png
 DEFINES += APPLICATION_NAME=\\\"$(TARGET)\\\"
+# Number crunching is built optimized in any configuration (debug too), so
+# its inner loops get vectorized. To see which did:
+#   qmake "VECTORIZE += -fopt-info-vec" && make
+VECTORIZED_SOURCES = src/fft.cc \
+    src/correlator.cc
+VECTORIZE = -O3 -ftree-vectorize
+vectorized.input = VECTORIZED_SOURCES
+vectorized.output = ${QMAKE_VAR_OBJECTS_DIR}${QMAKE_FILE_BASE}$${first(QMAKE_EXT_OBJ)}
+vectorized.commands = $(CXX) -c $(CXXFLAGS) $$VECTORIZE $(INCPATH) -o ${QMAKE_FILE_OUT} ${QMAKE_FILE_IN}
+vectorized.dependency_type = TYPE_C
+vectorized.variable_out = OBJECTS
+QMAKE_EXTRA_COMPILERS += vectorized
+# Sanitizer builds, e.g. for long --stress runs: qmake CONFIG+=tsan (or asan)
+tsan {
+    QMAKE_CXXFLAGS += -g -fsanitize=thread
+    QMAKE_LFLAGS += -fsanitize=thread
+}
+asan {
+    QMAKE_CXXFLAGS += -g -fno-omit-frame-pointer -fsanitize=address,undefined
+    QMAKE_LFLAGS += -fsanitize=address,undefined
+}
@@ -0,0 +1,42 @@
+# -------------------------------------------------
+# libemutrix: the card core, with a C API (src/emutrix.h)
+# -------------------------------------------------
+# Copyright 2010 Camilo Polymeris
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License version 3 as
+# published by the Free Software Foundation.
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+# Build with: make lib
+TARGET = emutrix
+VERSION = 0.3.0
+TEMPLATE = lib
+QT -= gui
+# Optimized whatever the main build is, and only the C API is exported
+# (EMUTRIX_EXPORT in emutrix.h)
+CONFIG -= debug
+CONFIG += release
+QMAKE_CXXFLAGS += -fvisibility=hidden -fvisibility-inlines-hidden
+# Objects of their own, they are built without QtGui
+OBJECTS_DIR = core
+SOURCES += src/libemutrix.cc \
+    src/soundcard.cc \
+    src/elementschema.cc
+HEADERS += src/emutrix.h \
+    src/soundcard.h \
+    src/elementschema.h \
+    src/controlbindings.h \
+    src/monotonic.h \
+    src/sanealsa.h
+LIBS += -lasound \
+    -lrt
+DEFINES += APPLICATION_NAME=\\\"lib$(TARGET)\\\"
+target.path = /usr/lib
+headers.files = src/emutrix.h
+headers.path = /usr/include
+INSTALLS += target \
+    headers
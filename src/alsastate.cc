@@ -0,0 +1,493 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "alsastate.h"
+#include "monotonic.h"
+#include <QFile>
+#include <QList>
+#include <QDebug>
+
+/// Characters that end a word
+static bool isSpecial(int c)
+{
+    switch (c)
+    {
+    case ' ': case '\t': case '\n': case '\r': case '=': case ',': case ';':
+    case '#': case '{': case '}': case '[': case ']': case '\'': case '"':
+        return true;
+    }
+    return false;
+}
+
+/** Tokenizer for the alsa-lib configuration syntax, as written by alsactl.
+    Reads the file in large chunks; separators (whitespace, '=', ',', ';')
+    and comments are skipped.
+    */
+class StateReader
+{
+public:
+    enum Token { End, Word, String, Open, Close, OpenArray, CloseArray };
+
+    StateReader(QFile & file) : file(file), pos(0), len(0), line(1) {}
+
+    /// Reads the next token; words and strings go to text
+    Token next(QByteArray & text)
+    {
+        int c;
+        for (;;)
+        {
+            c = get();
+            if (c == '#')
+                while (c != '\n' && c != -1)
+                    c = get();
+            if (c == -1)
+                return End;
+            if (c != ' ' && c != '\t' && c != '\n' && c != '\r' && c != '=' && c != ',' && c != ';')
+                break;
+        }
+        switch (c)
+        {
+        case '{': return Open;
+        case '}': return Close;
+        case '[': return OpenArray;
+        case ']': return CloseArray;
+        case '\'':
+        case '"':
+            readString(c, text);
+            return String;
+        }
+        text.clear();
+        while (c != -1 && !isSpecial(c))
+        {
+            text.append((char)c);
+            c = get();
+        }
+        unget();
+        return Word;
+    }
+
+    /// Current line, for error messages
+    int lineNumber() const { return line; }
+
+private:
+    int get()
+    {
+        if (pos == len)
+        {
+            len = file.read(buffer, sizeof(buffer));
+            pos = 0;
+            if (len <= 0)
+            {
+                len = 0;
+                return -1;
+            }
+        }
+        char c = buffer[pos++];
+        if (c == '\n')
+            line++;
+        return (unsigned char)c;
+    }
+
+    /// Steps back one character, only after a successful get()
+    void unget()
+    {
+        if (pos > 0)
+        {
+            pos--;
+            if (buffer[pos] == '\n')
+                line--;
+        }
+    }
+
+    void readString(int quote, QByteArray & text)
+    {
+        text.clear();
+        int start = line;
+        for (;;)
+        {
+            int c = get();
+            if (c == -1)
+                throw QString("Unterminated string starting on line %1").arg(start);
+            if (c == quote)
+                return;
+            if (c == '\\')
+            {
+                c = get();
+                switch (c)
+                {
+                case 'n': c = '\n'; break;
+                case 't': c = '\t'; break;
+                case 'r': c = '\r'; break;
+                case -1:
+                    throw QString("Unterminated string starting on line %1").arg(start);
+                default:
+                    if (c >= '0' && c <= '7')
+                    {
+                        int v = c - '0';
+                        for (int i = 0; i < 2; i++)
+                        {
+                            c = get();
+                            if (c < '0' || c > '7')
+                            {
+                                unget();
+                                break;
+                            }
+                            v = v * 8 + c - '0';
+                        }
+                        c = v & 0xff;
+                    }
+                }
+            }
+            text.append((char)c);
+        }
+    }
+
+    QFile & file;
+    char buffer[65536];
+    qint64 pos;
+    qint64 len;
+    int line;
+};
+
+/// Appends s, quoted if alsactl would
+static void appendString(QByteArray & out, const QString & s)
+{
+    QByteArray bytes = s.toUtf8();
+    bool plain = !bytes.isEmpty();
+    for (int i = 0; plain && i < bytes.size(); i++)
+        plain = !isSpecial(bytes.at(i)) && bytes.at(i) != '.';
+    if (plain)
+    {
+        out.append(bytes);
+        return;
+    }
+    out.append('\'');
+    for (int i = 0; i < bytes.size(); i++)
+    {
+        if (bytes.at(i) == '\'' || bytes.at(i) == '\\')
+            out.append('\\');
+        out.append(bytes.at(i));
+    }
+    out.append('\'');
+}
+
+/// Parses a value as element id would take it; false if it makes no sense
+static bool parseValue(const ElementSchema & schema, int id, const QByteArray & text, long * v)
+{
+    bool ok;
+    *v = text.toLong(&ok);
+    switch (schema.type(id))
+    {
+    case SND_CTL_ELEM_TYPE_BOOLEAN:
+        if (text == "true" || text == "on" || text == "yes")
+            *v = 1;
+        else if (text == "false" || text == "off" || text == "no")
+            *v = 0;
+        else if (!ok)
+            return false;
+        return *v == 0 || *v == 1;
+    case SND_CTL_ELEM_TYPE_ENUMERATED:
+        if (!ok)
+            *v = schema.itemIndex(id, QString::fromUtf8(text.constData(), text.size()));
+        return schema.isValid(id, *v);
+    case SND_CTL_ELEM_TYPE_INTEGER:
+        return ok && schema.isValid(id, *v);
+    default:
+        return false;
+    }
+}
+
+AlsaState::AlsaState(SoundCard * card)
+    : index(0), card(card), ownSection(false), parsed(0), matched(0)
+{
+}
+
+void AlsaState::load(const QString & path)
+{
+    qint64 start = monotonicNs();
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly))
+        throw QString("Can't open state file %1: %2").arg(path).arg(file.errorString());
+    state = card->getCachedState();
+    cardId = card->getId();
+    writes.clear();
+    firstWrites.clear();
+    firstCard.clear();
+    controlNumber.clear();
+    ownSection = false;
+    parsed = matched = 0;
+
+    StateReader reader(file);
+    // Key components of the enclosing compounds, how many each opening
+    // brace added, and the next item number of arrays (-1 for compounds)
+    QList<QByteArray> scope;
+    QVector<int> frames;
+    QVector<int> items;
+    QByteArray text, key;
+    try
+    {
+        for (;;)
+        {
+            StateReader::Token t = reader.next(text);
+            if (t == StateReader::End)
+            {
+                if (!frames.isEmpty())
+                    throw QString("Unexpected end of file");
+                break;
+            }
+            if (t == StateReader::Close || t == StateReader::CloseArray)
+            {
+                if (frames.isEmpty())
+                    throw QString("Unbalanced '%1'").arg(t == StateReader::Close ? '}' : ']');
+                for (int i = frames.last(); i > 0; i--)
+                    scope.removeLast();
+                frames.pop_back();
+                items.pop_back();
+                if (!controlNumber.isEmpty() && scope.size() < 4)
+                    endControl();
+                continue;
+            }
+            QList<QByteArray> keys;
+            if (!items.isEmpty() && items.last() >= 0)
+            {
+                // Array items have no keys, they are numbered
+                keys.append(QByteArray::number(items.last()++));
+            }
+            else if (t == StateReader::Word)
+            {
+                keys = text.split('.');
+                t = reader.next(text);
+            }
+            else if (t == StateReader::String)
+            {
+                keys.append(text);
+                t = reader.next(text);
+            }
+            else
+                throw QString("Compound without a name");
+            if (t == StateReader::Open || t == StateReader::OpenArray)
+            {
+                scope.append(keys);
+                frames.append(keys.size());
+                items.append(t == StateReader::OpenArray ? 0 : -1);
+            }
+            else if (t == StateReader::Word || t == StateReader::String)
+            {
+                keys = scope + keys;
+                if (keys.size() < 5 || keys.at(0) != "state" || keys.at(2) != "control")
+                    continue;
+                if (keys.at(1) != controlCard || keys.at(3) != controlNumber)
+                {
+                    if (!controlNumber.isEmpty())
+                        endControl();
+                    beginControl(keys.at(1), keys.at(3));
+                }
+                setField(keys.mid(4), text);
+            }
+            else
+                throw QString("Missing value");
+        }
+    }
+    catch (QString err)
+    {
+        controlNumber.clear();
+        throw QString("%1:%2: %3").arg(path).arg(reader.lineNumber()).arg(err);
+    }
+    if (!controlNumber.isEmpty())
+        endControl();
+    if (!ownSection)
+    {
+        if (!firstCard.isEmpty())
+            qDebug() << "Warning: No settings for card " << cardId << " in " << path
+                     << ", using those of " << firstCard;
+        writes = firstWrites;
+    }
+    firstWrites.clear();
+    qDebug() << "State file " << path << ": " << parsed << " controls, " << matched << " known, "
+             << writes.size() << " differ; parsed in " << (monotonicNs() - start) / 1000 << " us";
+}
+
+bool AlsaState::apply()
+{
+    if (writes.isEmpty())
+        return true;
+    qint64 start = monotonicNs();
+    bool ok = card->writeBatch(writes, this);
+    qDebug() << "State applied: " << writes.size() << " elements in " << (monotonicNs() - start) / 1000 << " us";
+    return ok;
+}
+
+void AlsaState::beginControl(const QByteArray & cardId, const QByteArray & number)
+{
+    controlCard = cardId;
+    controlNumber = number;
+    iface.clear();
+    name.clear();
+    index = 0;
+    values.clear();
+}
+
+void AlsaState::setField(const QList<QByteArray> & key, const QByteArray & value)
+{
+    const QByteArray & field = key.at(0);
+    if (key.size() == 1 && field == "iface")
+        iface = value;
+    else if (key.size() == 1 && field == "name")
+        name = value;
+    else if (key.size() == 1 && field == "index")
+        index = value.toInt();
+    else if (field == "value" && key.size() <= 2)
+    {
+        bool ok = true;
+        int channel = key.size() == 2 ? key.at(1).toInt(&ok) : 0;
+        // Same limit as ALSA has for integer elements
+        if (!ok || channel < 0 || channel >= 128)
+            return;
+        if (channel >= values.size())
+            values.resize(channel + 1);
+        values[channel] = value;
+    }
+    // comment, device, subdevice: not needed
+}
+
+void AlsaState::endControl()
+{
+    QByteArray section = controlCard;
+    controlNumber.clear();
+    parsed++;
+    WriteBatch * batch;
+    if (section == cardId.toUtf8())
+    {
+        batch = &writes;
+        ownSection = true;
+    }
+    else if (!ownSection && (firstCard.isEmpty() || section == firstCard))
+    {
+        batch = &firstWrites;
+        firstCard = section;
+    }
+    else
+        return;
+    if (!iface.isEmpty() && iface != "MIXER")
+        return;
+    const ElementSchema & schema = card->getSchema();
+    int id = schema.id(QString::fromUtf8(name.constData(), name.size()), index);
+    // alsactl restore leaves read-only controls alone too
+    if (id < 0 || !(schema.access(id) & ElementSchema::Writable))
+        return;
+    matched++;
+    int offset = schema.offset(id);
+    unsigned int count = schema.count(id);
+    ElementWrite w;
+    w.id = id;
+    w.values.resize(count);
+    bool differs = false;
+    for (unsigned int i = 0; i < count; i++)
+    {
+        long v = state.at(offset + i);
+        if ((int)i < values.size() && !values.at(i).isNull()
+            && !parseValue(schema, id, values.at(i), &v))
+        {
+            qDebug() << "Warning: Bad value " << values.at(i) << " for " << schema.name(id) << ", skipped";
+            return;
+        }
+        w.values[i] = v;
+        differs = differs || v != state.at(offset + i);
+    }
+    if (differs)
+        batch->append(w);
+}
+
+void AlsaState::save(const QString & path)
+{
+    qint64 start = monotonicNs();
+    const ElementSchema & schema = card->getSchema();
+    QVector<long> values = card->getCachedState();
+    QByteArray out;
+    out.reserve(256 * schema.size());
+    out.append("state.");
+    appendString(out, card->getId());
+    out.append(" {\n");
+    int saved = 0;
+    for (int id = 0; id < schema.size(); id++)
+    {
+        snd_ctl_elem_type_t type = schema.type(id);
+        if (type != SND_CTL_ELEM_TYPE_INTEGER && type != SND_CTL_ELEM_TYPE_BOOLEAN
+            && type != SND_CTL_ELEM_TYPE_ENUMERATED)
+            continue;
+        // As alsactl store: the cache has nothing for these
+        if (!(schema.access(id) & ElementSchema::Readable))
+            continue;
+        out.append("\tcontrol.").append(QByteArray::number(schema.numid(id))).append(" {\n");
+        out.append("\t\tiface MIXER\n\t\tname ");
+        appendString(out, schema.name(id));
+        out.append('\n');
+        if (schema.index(id))
+            out.append("\t\tindex ").append(QByteArray::number(schema.index(id))).append('\n');
+        unsigned int count = schema.count(id);
+        for (unsigned int i = 0; i < count; i++)
+        {
+            out.append("\t\tvalue");
+            if (count > 1)
+                out.append('.').append(QByteArray::number(i));
+            out.append(' ');
+            long v = values.at(schema.offset(id) + i);
+            if (type == SND_CTL_ELEM_TYPE_BOOLEAN)
+                out.append(v ? "true" : "false");
+            else if (type == SND_CTL_ELEM_TYPE_ENUMERATED && schema.isValid(id, v))
+                appendString(out, schema.itemName(id, v));
+            else
+                out.append(QByteArray::number((qlonglong)v));
+            out.append('\n');
+        }
+        out.append("\t\tcomment {\n\t\t\ttype ");
+        switch (type)
+        {
+        case SND_CTL_ELEM_TYPE_BOOLEAN:
+            out.append("BOOLEAN");
+            break;
+        case SND_CTL_ELEM_TYPE_ENUMERATED:
+            out.append("ENUMERATED");
+            break;
+        default:
+            out.append("INTEGER");
+        }
+        out.append("\n\t\t\tcount ").append(QByteArray::number(count)).append('\n');
+        if (type == SND_CTL_ELEM_TYPE_INTEGER)
+        {
+            out.append("\t\t\trange '").append(QByteArray::number((qlonglong)schema.min(id)))
+               .append(" - ").append(QByteArray::number((qlonglong)schema.max(id)));
+            if (schema.step(id) > 1)
+                out.append(" (step ").append(QByteArray::number((qlonglong)schema.step(id))).append(')');
+            out.append("'\n");
+        }
+        for (unsigned int i = 0; i < schema.items(id); i++)
+        {
+            out.append("\t\t\titem.").append(QByteArray::number(i)).append(' ');
+            appendString(out, schema.itemName(id, i));
+            out.append('\n');
+        }
+        out.append("\t\t}\n\t}\n");
+        saved++;
+    }
+    out.append("}\n");
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate) || file.write(out) != out.size())
+        throw QString("Can't write state file %1: %2").arg(path).arg(file.errorString());
+    qDebug() << "State file " << path << ": " << saved << " elements exported in "
+             << (monotonicNs() - start) / 1000 << " us";
+}
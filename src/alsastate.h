@@ -0,0 +1,98 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef ALSASTATE_H
+#define ALSASTATE_H
+
+#include <QString>
+#include <QByteArray>
+#include <QVector>
+#include "soundcard.h"
+
+/** alsactl state files (asound.state).
+    Reads and writes the format of "alsactl store" and "alsactl restore",
+    restricted to the elements the card has (E-mu mixer elements, by name).
+    Anything else in the file, other cards included, is skipped.
+
+    Files are parsed as they are read, one control at a time. Each control
+    name and index is looked up in the schema once; values are compared to the card's
+    cached state, and only elements that differ end up in the batch, so an
+    import is a single writeBatch() (and a single undo step).
+
+    Export goes straight from the cached state, without reading the card.
+    As with alsactl, read-only controls aren't imported and write-only
+    ones aren't exported.
+    */
+class AlsaState
+{
+public:
+    AlsaState(SoundCard * card);
+
+    /** Reads a state file.
+        Prepares the writes for apply(). Unknown and unreadable controls
+        are skipped with a warning.
+        Throws QString if the file can't be read or doesn't parse.
+        @param path State file
+        */
+    void load(const QString & path);
+    /** Writes what load() found to differ from the card's state.
+        @return false if any write failed.
+        */
+    bool apply();
+    /** Writes the card's cached state to a state file.
+        Throws QString if the file can't be written.
+        @param path State file, overwritten
+        */
+    void save(const QString & path);
+
+    /// Controls read by the last load()
+    int controls() const { return parsed; }
+    /// Of which the card has
+    int known() const { return matched; }
+    /// Elements apply() will write
+    int changes() const { return writes.size(); }
+
+private:
+    /// Card id (state.ID) and control number (control.N) of the control being read
+    QByteArray controlCard;
+    QByteArray controlNumber;
+    /// Its fields, values by channel
+    QByteArray iface;
+    QByteArray name;
+    int index;
+    QVector<QByteArray> values;
+    /// Start reading a control
+    void beginControl(const QByteArray & cardId, const QByteArray & number);
+    /// Stores a field of the control being read
+    void setField(const QList<QByteArray> & key, const QByteArray & value);
+    /// Done reading a control: look it up and compare it to the state
+    void endControl();
+
+    SoundCard * card;
+    /// Card state when load() started
+    QVector<long> state;
+    QString cardId;
+    /// Changes of the card's own section, and of the first section
+    WriteBatch writes;
+    WriteBatch firstWrites;
+    QByteArray firstCard;
+    bool ownSection;
+    int parsed;
+    int matched;
+};
+
+#endif // ALSASTATE_H
@@ -0,0 +1,382 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "analyzer.h"
+#include "fft.h"
+#include "monotonic.h"
+#include <QFile>
+#include <QSettings>
+#include <QMutexLocker>
+#include <QDebug>
+#include <math.h>
+#include <string.h>
+
+/// Time between publications, in ns (30 per second)
+static const qint64 publishInterval = 33333333;
+/// Level of silence, in dB
+static const float floorDb = -120;
+/// Lower edge of the first band, in Hz
+static const float lowest = 20;
+
+/// Little endian integer of a WAV header
+static quint32 littleEndian(const char * p, int bytes)
+{
+    quint32 v = 0;
+    for (int i = bytes - 1; i >= 0; i--)
+        v = (v << 8) | (uchar)p[i];
+    return v;
+}
+
+Analyzer::Analyzer(QObject * parent)
+    : QThread(parent), source(Tone), cardIndex(0), channel(0), rate(48000), channels(1),
+      pcm(NULL), file(NULL), fileFloat(false), dataStart(0), dataSize(0), dataRead(0),
+      due(0), phase(0), fresh(false), stopping(0)
+{
+    QSettings settings;
+    size = settings.value("analyzer/size", 4096).toInt();
+    if (size < 256 || size > 16384 || (size & (size - 1)))
+    {
+        qDebug() << "Warning: Analyzer block size must be a power of two from 256 to 16384, using 4096";
+        size = 4096;
+    }
+    published.fill(floorDb, bands);
+    frequencies.fill(0, bands);
+}
+
+Analyzer::~Analyzer()
+{
+    stop();
+    wait();
+}
+
+void Analyzer::setCapture(int card, int ch)
+{
+    source = Capture;
+    cardIndex = card;
+    channel = ch;
+}
+
+void Analyzer::setFile(const QString & p, int ch)
+{
+    source = File;
+    path = p;
+    channel = ch;
+}
+
+void Analyzer::setTone()
+{
+    source = Tone;
+    channel = 0;
+}
+
+void Analyzer::stop()
+{
+    stopping = 1;
+}
+
+bool Analyzer::levels(QVector<float> & dB)
+{
+    dB.resize(bands);
+    QMutexLocker locker(&publishLock);
+    // Copied by value, so the thread never has to detach published
+    for (int b = 0; b < bands; b++)
+        dB[b] = published.at(b);
+    bool changed = fresh;
+    fresh = false;
+    return changed;
+}
+
+float Analyzer::bandFrequency(int band) const
+{
+    QMutexLocker locker(&publishLock);
+    return frequencies.at(band);
+}
+
+QString Analyzer::error() const
+{
+    QMutexLocker locker(&publishLock);
+    return failure;
+}
+
+void Analyzer::run()
+{
+    stopping = 0;
+    {
+        QMutexLocker locker(&publishLock);
+        failure.clear();
+        published.fill(floorDb);
+    }
+    try
+    {
+        openSource();
+        setBands();
+        // Everything the loop needs, allocated up front
+        Fft fft(size);
+        int hop = size / 2;
+        QVector<float> blockBuffer(size, 0);
+        QVector<float> powerBuffer(size / 2 + 1);
+        QVector<float> hold(bands, 0);
+        float * block = blockBuffer.data();
+        float * power = powerBuffer.data();
+        const int * first = bandFirst.constData();
+        const int * last = bandLast.constData();
+        qint64 next = monotonicNs();
+        due = next;
+        while (!stopping)
+        {
+            // Keep the newer half of the block, read a new one after it
+            memmove(block, block + hop, hop * sizeof(float));
+            read(block + hop, hop);
+            fft.power(block, power);
+            for (int b = 0; b < bands; b++)
+            {
+                float peak = 0;
+                for (int k = first[b]; k <= last[b]; k++)
+                    if (power[k] > peak)
+                        peak = power[k];
+                if (peak > hold[b])
+                    hold[b] = peak;
+            }
+            qint64 now = monotonicNs();
+            if (now < next)
+                continue;
+            QMutexLocker locker(&publishLock);
+            for (int b = 0; b < bands; b++)
+            {
+                published[b] = hold[b] > 1e-12f ? 10 * log10f(hold[b]) : floorDb;
+                hold[b] = 0;
+            }
+            fresh = true;
+            next = now + publishInterval;
+        }
+    }
+    catch (QString err)
+    {
+        qDebug() << "Warning: Analyzer: " << err;
+        QMutexLocker locker(&publishLock);
+        failure = err;
+    }
+    closeSource();
+}
+
+void Analyzer::setBands()
+{
+    QMutexLocker locker(&publishLock);
+    int top = size / 2;
+    float binHz = (float)rate / size;
+    float ratio = powf(rate / 2 / lowest, 1.0f / bands);
+    bandFirst.resize(bands);
+    bandLast.resize(bands);
+    for (int b = 0; b < bands; b++)
+    {
+        float low = lowest * powf(ratio, b);
+        float high = low * ratio;
+        frequencies[b] = low;
+        int first = (int)ceilf(low / binHz);
+        int last = qMin((int)ceilf(high / binHz) - 1, top);
+        // Low bands can be narrower than a bin: use the one nearest their center
+        if (last < first)
+            first = last = qBound(0, qRound(sqrtf(low * high) / binHz), top);
+        bandFirst[b] = first;
+        bandLast[b] = last;
+    }
+}
+
+void Analyzer::openSource()
+{
+    int hop = size / 2;
+    switch (source)
+    {
+    case Capture:
+    {
+        QSettings settings;
+        QString device = settings.value("analyzer/device", "hw:%1,2").toString().arg(cardIndex);
+        channels = settings.value("analyzer/channels", 16).toInt();
+        rate = 48000;
+        if (channel >= channels)
+            throw QString("No capture channel %1 on %2").arg(channel + 1).arg(device);
+        int err = snd_pcm_open(&pcm, device.toLatin1().constData(), SND_PCM_STREAM_CAPTURE, 0);
+        if (err < 0)
+        {
+            pcm = NULL;
+            throw QString("Can't open %1: %2").arg(device).arg(snd_strerror(err));
+        }
+        // Let ALSA pick a period; 100 ms of buffer rides out GUI hiccups
+        err = snd_pcm_set_params(pcm, SND_PCM_FORMAT_S32_LE, SND_PCM_ACCESS_RW_INTERLEAVED,
+                                 channels, rate, 1, 100000);
+        if (err < 0)
+            throw QString("Can't set up %1: %2").arg(device).arg(snd_strerror(err));
+        raw.resize(hop * channels * 4);
+        break;
+    }
+    case File:
+    {
+        file = new QFile(path);
+        if (!file->open(QIODevice::ReadOnly))
+            throw QString("Can't open %1").arg(path);
+        char header[40];
+        if (file->read(header, 12) != 12 || memcmp(header, "RIFF", 4) || memcmp(header + 8, "WAVE", 4))
+            throw QString("%1 is not a WAV file").arg(path);
+        int bits = 0, format = 0;
+        channels = 0;
+        // Chunks up to the samples
+        while (file->read(header, 8) == 8)
+        {
+            quint32 length = littleEndian(header + 4, 4);
+            if (!memcmp(header, "data", 4))
+            {
+                dataStart = file->pos();
+                dataSize = length;
+                break;
+            }
+            if (!memcmp(header, "fmt ", 4) && length >= 16)
+            {
+                int got = file->read(header, qMin(length, (quint32)sizeof(header)));
+                format = littleEndian(header, 2);
+                channels = littleEndian(header + 2, 2);
+                rate = littleEndian(header + 4, 4);
+                bits = littleEndian(header + 14, 2);
+                // WAVE_FORMAT_EXTENSIBLE: format is the start of the subformat GUID
+                if (format == 0xfffe && got >= 26)
+                    format = littleEndian(header + 24, 2);
+                length -= got;
+            }
+            // Chunks are padded to even sizes
+            file->seek(file->pos() + length + (length & 1));
+        }
+        if (!dataSize || !channels)
+            throw QString("%1 has no samples").arg(path);
+        if (!(format == 1 && bits == 16) && !(format == 3 && bits == 32))
+            throw QString("%1: only 16 bit integer and 32 bit float samples are supported").arg(path);
+        if (channel >= channels)
+            throw QString("%1 has no channel %2").arg(path).arg(channel + 1);
+        if (rate < 2 * lowest)
+            throw QString("%1: bad sample rate %2").arg(path).arg(rate);
+        fileFloat = format == 3;
+        dataRead = 0;
+        raw.resize(hop * channels * (bits / 8));
+        break;
+    }
+    case Tone:
+        rate = 48000;
+        channels = 1;
+        phase = 0;
+        break;
+    }
+}
+
+void Analyzer::closeSource()
+{
+    if (pcm)
+        snd_pcm_close(pcm);
+    pcm = NULL;
+    delete file;
+    file = NULL;
+}
+
+void Analyzer::read(float * to, int frames)
+{
+    switch (source)
+    {
+    case Capture:
+        // Paced by the card
+        readCapture(to, frames);
+        return;
+    case File:
+        readFile(to, frames);
+        break;
+    case Tone:
+        readTone(to, frames);
+        break;
+    }
+    // Others are paced to real time, so they look like a live source
+    due += (qint64)frames * 1000000000 / rate;
+    qint64 ahead = due - monotonicNs();
+    if (ahead > 0)
+        usleep(ahead / 1000);
+    else if (ahead < -publishInterval)
+        due = monotonicNs();
+}
+
+void Analyzer::readCapture(float * to, int frames)
+{
+    qint32 * samples = (qint32 *)raw.data();
+    int done = 0;
+    while (done < frames && !stopping)
+    {
+        snd_pcm_sframes_t got = snd_pcm_readi(pcm, samples, frames - done);
+        if (got < 0)
+        {
+            // Overruns happen if the machine is busy; start over
+            int err = snd_pcm_recover(pcm, got, 1);
+            if (err < 0)
+                throw QString("Capture failed: %1").arg(snd_strerror(err));
+            continue;
+        }
+        for (int i = 0; i < got; i++)
+            to[done + i] = samples[i * channels + channel] * (1.0f / 2147483648.0f);
+        done += got;
+    }
+    // Stopped half way: the block is thrown away anyway
+    for (; done < frames; done++)
+        to[done] = 0;
+}
+
+void Analyzer::readFile(float * to, int frames)
+{
+    int frameBytes = raw.size() / (size / 2);
+    int done = 0;
+    while (done < frames)
+    {
+        // Loop at the end
+        if (dataRead + frameBytes > dataSize)
+        {
+            file->seek(dataStart);
+            dataRead = 0;
+        }
+        int want = qMin((long)(frames - done), (dataSize - dataRead) / frameBytes);
+        qint64 got = file->read(raw.data(), want * frameBytes) / frameBytes;
+        if (got <= 0)
+            throw QString("Can't read %1").arg(path);
+        dataRead += got * frameBytes;
+        if (fileFloat)
+        {
+            const float * samples = (const float *)raw.constData();
+            for (int i = 0; i < got; i++)
+                to[done + i] = samples[i * channels + channel];
+        }
+        else
+        {
+            const qint16 * samples = (const qint16 *)raw.constData();
+            for (int i = 0; i < got; i++)
+                to[done + i] = samples[i * channels + channel] * (1.0f / 32768.0f);
+        }
+        done += got;
+    }
+}
+
+void Analyzer::readTone(float * to, int frames)
+{
+    double step = 2 * M_PI * 1000 / rate;
+    for (int i = 0; i < frames; i++)
+    {
+        to[i] = 0.1f * sin(phase);
+        phase += step;
+    }
+    // Keep the phase small, so it stays accurate
+    phase = fmod(phase, 2 * M_PI);
+}
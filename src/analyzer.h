@@ -0,0 +1,143 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef ANALYZER_H
+#define ANALYZER_H
+
+#include <QThread>
+#include <QMutex>
+#include <QAtomicInt>
+#include <QString>
+#include <QVector>
+#include "alsa/asoundlib.h"
+
+class QFile;
+
+/** Spectrum analyzer of one audio channel.
+    Reads blocks from the card's capture PCM, a WAV file or a test tone,
+    and reduces their power spectrum (see Fft) to log spaced bands, from
+    20 Hz to half the sample rate. Runs on its own thread. Blocks overlap
+    by half; bands hold their peak between publications, which happen at
+    display rate (about 30 per second), so the GUI copies only a few
+    dozen values per frame.
+    Block size comes from the "analyzer/size" setting (default 4096).
+    All buffers are allocated before the thread starts reading.
+    */
+class Analyzer : public QThread
+{
+    Q_OBJECT
+
+public:
+    enum Source
+    {
+        /// Card capture PCM (see setCapture())
+        Capture,
+        /// WAV file, played in real time and looped
+        File,
+        /// 1 kHz sine at -20 dB, for testing without a card
+        Tone
+    };
+    /// Number of bands published
+    static const int bands = 64;
+
+    Analyzer(QObject * parent = 0);
+    /** Destructor.
+        Stops the thread.
+        */
+    ~Analyzer();
+
+    /** Analyze a capture channel of a card.
+        The PCM device is the "analyzer/device" setting (default
+        "hw:%1,2", %1 being the card index), opened with "analyzer/channels"
+        channels (default 16) of 32 bit samples at 48 kHz.
+        Takes effect on next start().
+        */
+    void setCapture(int card, int channel);
+    /** Analyze a WAV file (16 bit or float, any channel count).
+        Takes effect on next start().
+        */
+    void setFile(const QString & path, int channel);
+    /// Analyze the test tone. Takes effect on next start().
+    void setTone();
+    /// Ask thread to finish.
+    void stop();
+
+    /** Latest band levels.
+        @param dB Filled with bands levels in dB (0 is full scale), from low to high
+        @return Whether they changed since the last call
+        */
+    bool levels(QVector<float> & dB);
+    /// Frequency of a band's lower edge, in Hz. Valid once running.
+    float bandFrequency(int band) const;
+    /// Error that stopped the thread, if any
+    QString error() const;
+
+protected:
+    void run();
+
+private:
+    /** Reads samples of the analyzed channel.
+        Sources other than the card are paced to real time.
+        Throws a QString on error.
+        */
+    void read(float * to, int frames);
+    /// Source specific parts of read()
+    void openSource();
+    void closeSource();
+    void readCapture(float * to, int frames);
+    void readFile(float * to, int frames);
+    void readTone(float * to, int frames);
+    /// Bins of each band, for the source's sample rate
+    void setBands();
+
+    Source source;
+    int cardIndex;
+    int channel;
+    QString path;
+    int size;
+    int rate;
+    /// Channels of the interleaved source
+    int channels;
+
+    snd_pcm_t * pcm;
+    /// Interleaved frames as read from the PCM or file
+    QVector<char> raw;
+    /// WAV file, its sample format and data chunk
+    QFile * file;
+    bool fileFloat;
+    long dataStart;
+    long dataSize;
+    long dataRead;
+    /// Time the next file hop is due, in ns (see monotonicNs())
+    qint64 due;
+    /// Test tone phase
+    double phase;
+
+    /// First and last bin of each band
+    QVector<int> bandFirst;
+    QVector<int> bandLast;
+    QVector<float> frequencies;
+
+    /// Levels published, guarded by publishLock
+    QVector<float> published;
+    bool fresh;
+    QString failure;
+    mutable QMutex publishLock;
+    QAtomicInt stopping;
+};
+
+#endif // ANALYZER_H
@@ -0,0 +1,373 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "autosave.h"
+#include <QSettings>
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QDataStream>
+#include <QMutexLocker>
+#include <QDebug>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+static const quint32 snapshotMagic = 0x454d5353; // "EMSS"
+static const quint32 logMagic = 0x454d5357; // "EMSW"
+static const quint32 version = 3;
+/// Queue size, in 32 bit words
+static const int queueSize = 16384;
+
+/// Appends v to a log buffer, big endian
+static void put(QByteArray & b, quint32 v, int bytes)
+{
+    for (int i = bytes - 1; i >= 0; i--)
+        b.append((char)(v >> (i * 8)));
+}
+
+/// Reads a big endian value of a log
+static quint32 get(const char * p, int bytes)
+{
+    quint32 v = 0;
+    for (int i = 0; i < bytes; i++)
+        v = (v << 8) | (uchar)p[i];
+    return v;
+}
+
+/// FNV-1a of a log record
+static quint32 checksum(const char * p, int size)
+{
+    quint32 h = 2166136261u;
+    for (int i = 0; i < size; i++)
+    {
+        h ^= (uchar)p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/// Makes a rename in dir durable
+static void syncDirectory(const QString & dir)
+{
+    int fd = ::open(QFile::encodeName(dir).constData(), O_RDONLY);
+    if (fd < 0)
+        return;
+    ::fsync(fd);
+    ::close(fd);
+}
+
+Autosave::Autosave(SoundCard * card, QObject * parent)
+    : QThread(parent), card(card), queued(0), overflow(false), held(true), resumed(false),
+      generation(0), logged(0), stopping(0)
+{
+    QSettings settings;
+    delay = qMax(settings.value("autosave/delay", 500).toInt(), 0);
+    compactAfter = qMax(settings.value("autosave/compact", 1000).toInt(), 1);
+    QString base = QFileInfo(settings.fileName()).absolutePath() + "/autosave-" + card->getId();
+    snapshotPath = base + ".snap";
+    logPath = base + ".wal";
+    queue.resize(queueSize);
+    card->addObserver(this);
+}
+
+Autosave::~Autosave()
+{
+    // No more changes, so the last drain gets them all
+    card->removeObserver(this);
+    stop();
+    wait();
+}
+
+void Autosave::stop()
+{
+    QMutexLocker locker(&mutex);
+    stopping = 1;
+    wake.wakeOne();
+}
+
+void Autosave::elementChanged(const SoundCard * c, const CardChange & change)
+{
+    const ElementSchema & schema = c->getSchema();
+    // Meters and other read-only elements can't be restored anyway
+    if (!(schema.access(change.id) & ElementSchema::Writable))
+        return;
+    int n = schema.count(change.id);
+    QMutexLocker locker(&mutex);
+    if (overflow)
+        return;
+    if (queued + 2 + n > queue.size())
+    {
+        // The next snapshot comes from the card
+        overflow = true;
+        queued = 0;
+        wake.wakeOne();
+        return;
+    }
+    if (!queued)
+        wake.wakeOne();
+    qint32 * to = queue.data() + queued;
+    to[0] = change.id;
+    to[1] = n;
+    for (int ch = 0; ch < n; ch++)
+        to[2 + ch] = change.values[ch];
+    queued += 2 + n;
+}
+
+bool Autosave::restore()
+{
+    WriteBatch batch;
+    {
+        QMutexLocker locker(&mutex);
+        batch = pending;
+    }
+    // Not under the mutex: the writes come back through elementChanged()
+    bool ok = card->writeBatch(batch, this);
+    resume();
+    return ok;
+}
+
+void Autosave::discard()
+{
+    resume();
+}
+
+void Autosave::resume()
+{
+    QMutexLocker locker(&mutex);
+    pending.clear();
+    held = false;
+    resumed = true;
+    wake.wakeOne();
+}
+
+void Autosave::run()
+{
+    WriteBatch changes;
+    try
+    {
+        changes = recover();
+    }
+    catch (QString err)
+    {
+        qDebug() << "Warning: Autosave: " << err;
+    }
+    // Changes from now on are queued, and applied on top of this
+    mirror = card->getCachedState();
+    {
+        QMutexLocker locker(&mutex);
+        pending = changes;
+        held = !changes.isEmpty();
+    }
+    if (!changes.isEmpty())
+        emit recovered(changes.size());
+    else
+        compact();
+    QVector<qint32> drained(queue.size());
+    QByteArray log;
+    bool last = false;
+    while (!last)
+    {
+        int size;
+        bool overflowed, holding, resuming;
+        {
+            QMutexLocker locker(&mutex);
+            if (!queued && !overflow && !resumed && !stopping)
+                wake.wait(&mutex);
+            // Let the burst complete, so it's written and synced once
+            if (queued && !stopping)
+                wake.wait(&mutex, delay);
+            size = queued;
+            memcpy(drained.data(), queue.constData(), size * sizeof(qint32));
+            queued = 0;
+            overflowed = overflow;
+            overflow = false;
+            holding = held;
+            resuming = resumed;
+            resumed = false;
+            last = stopping;
+        }
+        // Queued records are no older than the cache, so they can go on top
+        if (overflowed)
+            mirror = card->getCachedState();
+        log.resize(0);
+        bool snapshot = overflowed || resuming || logged >= compactAfter;
+        replay(drained.constData(), size, holding || snapshot ? NULL : &log);
+        if (holding)
+            continue;
+        if (snapshot)
+            compact();
+        else if (!log.isEmpty())
+            append(log);
+    }
+}
+
+void Autosave::replay(const qint32 * records, int size, QByteArray * log)
+{
+    const ElementSchema & schema = card->getSchema();
+    for (int pos = 0; pos < size; pos += 2 + records[pos + 1])
+    {
+        int id = records[pos];
+        int n = records[pos + 1];
+        long * to = mirror.data() + schema.offset(id);
+        for (int ch = 0; ch < n; ch++)
+            to[ch] = records[pos + 2 + ch];
+        if (!log)
+            continue;
+        int start = log->size();
+        put(*log, id, 2);
+        put(*log, n, 2);
+        for (int ch = 0; ch < n; ch++)
+            put(*log, records[pos + 2 + ch], 4);
+        put(*log, checksum(log->constData() + start, log->size() - start), 4);
+        logged++;
+    }
+}
+
+void Autosave::append(const QByteArray & log)
+{
+    QFile file(logPath);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Append)
+        || file.write(log) != log.size() || !file.flush() || fdatasync(file.handle()) < 0)
+        qDebug() << "Warning: Autosave: Can't write " << logPath;
+}
+
+void Autosave::compact()
+{
+    const ElementSchema & schema = card->getSchema();
+    QString dir = QFileInfo(snapshotPath).absolutePath();
+    QDir().mkpath(dir);
+    generation++;
+    // A crash half way leaves the old snapshot as it was
+    QString tmp = snapshotPath + ".tmp";
+    QFile file(tmp);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+    {
+        qDebug() << "Warning: Autosave: Can't write " << tmp;
+        return;
+    }
+    QDataStream out(&file);
+    out << snapshotMagic << version << generation << (quint32)schema.size();
+    for (int id = 0; id < schema.size(); id++)
+    {
+        // Read-only elements keep their number, without values
+        unsigned int n = schema.access(id) & ElementSchema::Writable ? schema.count(id) : 0;
+        out << schema.name(id) << (quint16)schema.index(id) << (quint16)n;
+        const long * values = mirror.constData() + schema.offset(id);
+        for (unsigned int ch = 0; ch < n; ch++)
+            out << (qint32)values[ch];
+    }
+    if (out.status() != QDataStream::Ok || !file.flush() || fdatasync(file.handle()) < 0)
+    {
+        qDebug() << "Warning: Autosave: Can't write " << tmp;
+        return;
+    }
+    file.close();
+    if (::rename(QFile::encodeName(tmp).constData(), QFile::encodeName(snapshotPath).constData()) < 0)
+    {
+        qDebug() << "Warning: Autosave: Can't replace " << snapshotPath;
+        return;
+    }
+    syncDirectory(dir);
+    // The old log has the old generation, so it's ignored if this doesn't make it
+    QFile wal(logPath);
+    QByteArray header;
+    put(header, logMagic, 4);
+    put(header, generation, 4);
+    if (!wal.open(QIODevice::WriteOnly | QIODevice::Truncate)
+        || wal.write(header) != header.size() || !wal.flush() || fdatasync(wal.handle()) < 0)
+        qDebug() << "Warning: Autosave: Can't write " << logPath;
+    logged = 0;
+}
+
+WriteBatch Autosave::recover()
+{
+    QFile file(snapshotPath);
+    if (!file.exists())
+        return WriteBatch();
+    if (!file.open(QIODevice::ReadOnly))
+        throw QString("Can't read %1").arg(snapshotPath);
+    QDataStream in(&file);
+    quint32 magic, v, count;
+    in >> magic >> v;
+    if (magic != snapshotMagic || v != version)
+        throw QString("%1 is not an autosave snapshot").arg(snapshotPath);
+    in >> generation >> count;
+    // Saved elements by snapshot number, with their ids on this card (-1 if gone)
+    const ElementSchema & schema = card->getSchema();
+    QVector<int> ids(count);
+    QVector<QVector<long> > saved(count);
+    for (quint32 i = 0; i < count && in.status() == QDataStream::Ok; i++)
+    {
+        QString name;
+        quint16 index;
+        quint16 n;
+        in >> name >> index >> n;
+        saved[i].resize(n);
+        for (int ch = 0; ch < n; ch++)
+        {
+            qint32 value;
+            in >> value;
+            saved[i][ch] = value;
+        }
+        ids[i] = schema.id(name, index);
+        if (ids.at(i) >= 0 && (schema.count(ids.at(i)) != n
+                               || !(schema.access(ids.at(i)) & ElementSchema::Writable)))
+            ids[i] = -1;
+    }
+    if (in.status() != QDataStream::Ok)
+        throw QString("%1 is truncated").arg(snapshotPath);
+    // Log records on top, up to the first torn one
+    int records = 0;
+    QFile wal(logPath);
+    if (wal.open(QIODevice::ReadOnly))
+    {
+        QByteArray data = wal.readAll();
+        const char * p = data.constData();
+        if (data.size() >= 8 && get(p, 4) == logMagic && get(p + 4, 4) == generation)
+        {
+            int pos = 8;
+            while (pos + 4 <= data.size())
+            {
+                quint32 i = get(p + pos, 2);
+                int n = get(p + pos + 2, 2);
+                int length = 4 + 4 * n;
+                if (pos + length + 4 > data.size() || get(p + pos + length, 4) != checksum(p + pos, length))
+                    break;
+                if (i < count && saved.at(i).size() == n)
+                    for (int ch = 0; ch < n; ch++)
+                        saved[i][ch] = (qint32)get(p + pos + 4 + 4 * ch, 4);
+                pos += length + 4;
+                records++;
+            }
+        }
+    }
+    WriteBatch changes;
+    for (quint32 i = 0; i < count; i++)
+    {
+        if (ids.at(i) < 0 || card->getCached(ids.at(i)) == saved.at(i))
+            continue;
+        ElementWrite w;
+        w.id = ids.at(i);
+        w.values = saved.at(i);
+        changes.append(w);
+    }
+    qDebug() << "Autosave: " << count << " elements and " << records << " log records read, "
+             << changes.size() << " differ from the card.";
+    return changes;
+}
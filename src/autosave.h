@@ -0,0 +1,128 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef AUTOSAVE_H
+#define AUTOSAVE_H
+
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QAtomicInt>
+#include <QVector>
+#include <QString>
+#include "soundcard.h"
+
+/** Crash-safe autosave of a card's state.
+    Every change to a writable element (written by emutrix or reported
+    by ALSA) is copied into a preallocated queue by the observer callback,
+    which never touches the disk. This thread drains the queue a short while after the first
+    change, so a burst (a fader sweep) is written as one append to a
+    write-ahead log, and synced to disk once.
+    Once the log holds enough records, the whole state is written to a
+    snapshot (to a temporary file, synced, then renamed over the old one)
+    and the log starts over.
+
+    Files are autosave-CARDID.snap and .wal next to the settings file.
+    The snapshot stores elements by name, and log records by the
+    snapshot's element numbers, each with a checksum, so a torn last
+    record is simply ignored. Both carry a generation number; a log
+    left over from before the last snapshot is not replayed.
+
+    When the thread starts, it reads what was saved last and compares it
+    with the card. If they differ, saving is held and recovered() is
+    emitted; restore() or discard() resume it.
+
+    Settings: "autosave/delay" (ms to wait for more changes before
+    writing, default 500) and "autosave/compact" (log records between
+    snapshots, default 1000).
+    */
+class Autosave : public QThread, public CardObserver
+{
+    Q_OBJECT
+
+public:
+    /** Registers with the card. Call start() to begin saving. */
+    Autosave(SoundCard * card, QObject * parent = 0);
+    /** Unregisters, writes what is left and stops the thread. */
+    ~Autosave();
+
+    /// Ask thread to finish
+    void stop();
+    /** Writes the saved state to the card, as one batch.
+        Only the elements that differ. Resumes saving.
+        @return false if any write failed.
+        */
+    bool restore();
+    /// Forgets the saved state and resumes saving (from the card's state).
+    void discard();
+
+    void elementChanged(const SoundCard * card, const CardChange & change);
+
+signals:
+    /** The saved state differs from the card's.
+        Saving is held until restore() or discard() is called.
+        @param changes Number of elements that differ
+        */
+    void recovered(int changes);
+
+protected:
+    void run();
+
+private:
+    /** Reads snapshot and log.
+        @return Changes that would bring the card back to the saved state.
+        */
+    WriteBatch recover();
+    /// Applies queued records to mirror, appending them to log if given
+    void replay(const qint32 * records, int size, QByteArray * log);
+    /// Appends records to the log and syncs it
+    void append(const QByteArray & log);
+    /// Writes mirror as a new snapshot and starts an empty log
+    void compact();
+    /// Resume saving after recovered()
+    void resume();
+
+    SoundCard * card;
+    QString snapshotPath;
+    QString logPath;
+    int delay;
+    int compactAfter;
+
+    /** Queued records: element id, value count, values.
+        Preallocated; on overflow the queue is dropped, and the next
+        snapshot is taken from the card instead.
+        */
+    QVector<qint32> queue;
+    int queued;
+    bool overflow;
+    /// Saving held until the recovered() offer is answered
+    bool held;
+    bool resumed;
+    /// Changes recover() found, for restore()
+    WriteBatch pending;
+    /// Protects the above
+    QMutex mutex;
+    QWaitCondition wake;
+
+    /// Card state as of the records written (I/O thread only)
+    QVector<long> mirror;
+    quint32 generation;
+    int logged;
+    QAtomicInt stopping;
+};
+
+#endif // AUTOSAVE_H
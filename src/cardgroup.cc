@@ -0,0 +1,230 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cardgroup.h"
+#include "soundcard.h"
+#include "monotonic.h"
+#include <QThread>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QWaitCondition>
+#include <QSettings>
+#include <QStringList>
+#include <QDebug>
+
+/** Works on one card of a group.
+    Waits for a job, does it, releases the group's semaphore.
+    */
+class GroupWorker : public QThread
+{
+public:
+    enum Job { None, Open, Apply, Rollback, Quit };
+
+    GroupWorker(SoundCard * card, int index, QSemaphore * done)
+        : card(card), index(index), ok(false), latency(0),
+          job(None), done(done)
+    {
+    }
+
+    ~GroupWorker()
+    {
+        post(Quit);
+        wait();
+        if (index >= 0)
+            delete card;
+    }
+
+    /// Hands a job to the thread
+    void post(Job j)
+    {
+        QMutexLocker locker(&mutex);
+        job = j;
+        wake.wakeOne();
+    }
+
+    SoundCard * card;
+    /// ALSA index of a card opened by the group, -1 for the primary
+    int index;
+    /// Batch to apply, and how to put it back
+    NamedBatch batch;
+    WriteBatch undo;
+    /// Result of the last job
+    bool ok;
+    /// How long the last job took (us)
+    int latency;
+
+protected:
+    void run()
+    {
+        for (;;)
+        {
+            Job j;
+            {
+                QMutexLocker locker(&mutex);
+                while (job == None)
+                    wake.wait(&mutex);
+                j = job;
+                job = None;
+            }
+            if (j == Quit)
+                return;
+            qint64 start = monotonicNs();
+            switch (j)
+            {
+            case Open:
+                try
+                {
+                    card = new SoundCard(index);
+                    ok = true;
+                }
+                catch (QString err)
+                {
+                    qDebug() << "Warning: Card #" << index << " left out of the group: " << err;
+                    ok = false;
+                }
+                break;
+            case Apply:
+                ok = card->writeBatch(resolve());
+                break;
+            case Rollback:
+                ok = card->writeBatch(undo);
+                break;
+            default:
+                break;
+            }
+            latency = (monotonicNs() - start) / 1000;
+            done->release();
+        }
+    }
+
+private:
+    /// Translates the batch to this card's ids, remembering the old values
+    WriteBatch resolve()
+    {
+        const ElementSchema & schema = card->getSchema();
+        WriteBatch writes;
+        undo.clear();
+        for (NamedBatch::const_iterator it = batch.begin(); it != batch.end(); ++it)
+        {
+            ElementWrite w;
+            w.id = schema.find(it->first);
+            if (w.id < 0)
+                continue;
+            w.values = it->second;
+            writes.append(w);
+            ElementWrite u;
+            u.id = w.id;
+            u.values = card->getCached(w.id);
+            undo.append(u);
+        }
+        return writes;
+    }
+
+    QMutex mutex;
+    QWaitCondition wake;
+    Job job;
+    QSemaphore * done;
+};
+
+CardGroup::CardGroup(SoundCard * primary)
+{
+    workers.append(new GroupWorker(primary, -1, &done));
+    workers.last()->start();
+}
+
+CardGroup::~CardGroup()
+{
+    finishOpening();
+    qDeleteAll(workers);
+}
+
+QList<int> CardGroup::linkedCards()
+{
+    QSettings settings;
+    QList<int> list;
+    QStringList cards = settings.value("group/cards").toString().split(',', QString::SkipEmptyParts);
+    for (QStringList::const_iterator it = cards.begin(); it != cards.end(); ++it)
+    {
+        bool ok;
+        int index = it->trimmed().toInt(&ok);
+        if (ok)
+            list.append(index);
+    }
+    return list;
+}
+
+int CardGroup::size()
+{
+    finishOpening();
+    return workers.size();
+}
+
+void CardGroup::open(const QList<int> & indices)
+{
+    for (QList<int>::const_iterator it = indices.begin(); it != indices.end(); ++it)
+    {
+        GroupWorker * w = new GroupWorker(NULL, *it, &done);
+        w->start();
+        w->post(GroupWorker::Open);
+        opening.append(w);
+    }
+}
+
+void CardGroup::finishOpening()
+{
+    if (opening.isEmpty())
+        return;
+    done.acquire(opening.size());
+    for (QList<GroupWorker *>::iterator it = opening.begin(); it != opening.end(); ++it)
+        if ((*it)->ok)
+        {
+            qDebug() << "Card #" << (*it)->index << " linked, opened in " << (*it)->latency << " us";
+            workers.append(*it);
+        }
+        else
+            delete *it;
+    opening.clear();
+}
+
+bool CardGroup::apply(const NamedBatch & batch)
+{
+    // The first write waits for cards still being opened
+    finishOpening();
+    qint64 start = monotonicNs();
+    for (QList<GroupWorker *>::iterator it = workers.begin(); it != workers.end(); ++it)
+    {
+        (*it)->batch = batch;
+        (*it)->post(GroupWorker::Apply);
+    }
+    done.acquire(workers.size());
+    int wall = (monotonicNs() - start) / 1000;
+    bool ok = true;
+    QString times;
+    for (QList<GroupWorker *>::const_iterator it = workers.begin(); it != workers.end(); ++it)
+    {
+        ok = ok && (*it)->ok;
+        times += QString(" %1: %2 us").arg((*it)->card->getName()).arg((*it)->latency);
+    }
+    qDebug() << "Group write" << times << ", total " << wall << " us";
+    if (ok)
+        return true;
+    // Put everything back as it was, failed cards included: some of their writes may have been done
+    qDebug() << "Warning: A card of the group failed, rolling back.";
+    for (QList<GroupWorker *>::iterator it = workers.begin(); it != workers.end(); ++it)
+        (*it)->post(GroupWorker::Rollback);
+    done.acquire(workers.size());
+    return false;
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CARDGROUP_H
+#define CARDGROUP_H
+
+#include <QList>
+#include <QPair>
+#include <QVector>
+#include <QString>
+#include <QSemaphore>
+
+class SoundCard;
+class GroupWorker;
+
+/// Writes by element name: cards of a group needn't share element ids
+typedef QList<QPair<QString, QVector<long> > > NamedBatch;
+
+/** Several cards that get the same changes.
+    Each card has a worker thread of its own, so a change is written to
+    all of them at the same time. If any card fails, the cards that did
+    take the change get their previous values back.
+
+    The cards to link with the current one are listed (as ALSA indices)
+    in the "group/cards" setting.
+    */
+class CardGroup
+{
+public:
+    /** Creates a group with one card.
+        @param primary Card the window shows; not owned by the group
+        */
+    CardGroup(SoundCard * primary);
+    /** Stops the workers and closes the cards the group opened. */
+    ~CardGroup();
+
+    /// ALSA indices of the cards to link, from the settings
+    static QList<int> linkedCards();
+
+    /** Opens more cards, all at once, in the background.
+        Returns right away; the cards join the group once they are open.
+        Cards that fail to open are left out, with a warning.
+        @param indices ALSA card indices
+        */
+    void open(const QList<int> & indices);
+    /// Number of cards. Waits for cards being opened.
+    int size();
+
+    /** Writes a batch to every card, concurrently.
+        Elements a card doesn't have are skipped. Blocks until all cards
+        are done, including cards still being opened; per card and total
+        times are logged.
+        @return false if a card failed, in which case the change was
+                rolled back on all of them.
+        */
+    bool apply(const NamedBatch & batch);
+
+private:
+    /// Waits for the cards open() started, keeps those that opened
+    void finishOpening();
+
+    QList<GroupWorker *> workers;
+    /// Workers still opening their card
+    QList<GroupWorker *> opening;
+    /// Released by workers when done
+    QSemaphore done;
+};
+
+#endif // CARDGROUP_H
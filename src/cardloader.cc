@@ -0,0 +1,108 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cardloader.h"
+#include "soundcard.h"
+#include <QDebug>
+#include <QMetaType>
+
+CardLoader::CardLoader(QObject * parent)
+    : QThread(parent), enumerateCards(false), index(-1), busy(false), pending(-1)
+{
+    // Needed to pass cards through queued connections
+    qRegisterMetaType<SoundCard *>("SoundCard*");
+}
+
+CardLoader::~CardLoader()
+{
+    wait();
+}
+
+/// Request for enumerate(), see pending
+static const int enumerateRequest = -2;
+
+void CardLoader::enumerate()
+{
+    request(enumerateRequest);
+}
+
+void CardLoader::open(int i)
+{
+    request(i);
+}
+
+void CardLoader::request(int i)
+{
+    QMutexLocker locker(&lock);
+    if (busy)
+    {
+        // The window already waits for this one (e.g. the user picked
+        // another card while loading); run() takes it next.
+        pending = i;
+        return;
+    }
+    busy = true;
+    enumerateCards = i == enumerateRequest;
+    index = i;
+    // The thread may still be returning from the previous request
+    wait();
+    start();
+}
+
+void CardLoader::run()
+{
+    for (;;)
+    {
+        SoundCard * card = NULL;
+        QString err;
+        try
+        {
+            if (enumerateCards)
+            {
+                emit progress(tr("Looking for cards..."));
+                QList<QPair<QString, int> > cards = SoundCard::getCardList();
+                for (QList<QPair<QString, int> >::iterator it = cards.begin();
+                    it != cards.end();
+                    ++it)
+                    emit cardFound(it->first, it->second);
+                if (cards.isEmpty())
+                    throw tr("Sorry! No EMU 1010 based cards found.");
+                index = cards.first().second;
+            }
+            emit progress(tr("Connecting to card #%1...").arg(index));
+            card = new SoundCard(index);
+        }
+        catch (QString e)
+        {
+            err = e;
+        }
+        QMutexLocker locker(&lock);
+        if (pending == -1)
+        {
+            busy = false;
+            if (card)
+                emit cardReady(card);
+            else
+                emit failed(err);
+            return;
+        }
+        // Superseded while loading: the latest request is what's awaited
+        delete card;
+        enumerateCards = pending == enumerateRequest;
+        index = pending;
+        pending = -1;
+    }
+}
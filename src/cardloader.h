@@ -0,0 +1,82 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CARDLOADER_H
+#define CARDLOADER_H
+
+#include <QThread>
+#include <QString>
+#include <QMutex>
+
+class SoundCard;
+
+/** Background card loader.
+    Enumerating cards and opening/loading the ALSA control interface can
+    take a while on some drivers. This thread does it away from the GUI,
+    so the window can be painted right away. Results are reported through
+    (queued) signals; the receiver takes ownership of the SoundCard.
+    */
+class CardLoader : public QThread
+{
+    Q_OBJECT
+
+public:
+    CardLoader(QObject * parent = 0);
+    /** Destructor.
+        Waits for a running load to finish.
+        */
+    ~CardLoader();
+
+    /** Look for compatible cards, then open the first one found.
+        Each card found is reported through cardFound().
+        */
+    void enumerate();
+    /** Open card with the given ALSA index.
+        If a load is in progress, this one follows it, and the card being
+        loaded is dropped: only the latest request is reported.
+        */
+    void open(int index);
+
+signals:
+    /// Human readable status message, for the status bar.
+    void progress(const QString & msg);
+    /// A compatible card was found during enumeration.
+    void cardFound(const QString & name, int index);
+    /// Card is open and loaded. Receiver takes ownership.
+    void cardReady(SoundCard * card);
+    /// Something went wrong. No card was opened.
+    void failed(const QString & err);
+
+protected:
+    void run();
+
+private:
+    /// Starts the thread for a request, or queues it if one is being loaded
+    void request(int index);
+
+    /// Enumerate before opening?
+    bool enumerateCards;
+    /// ALSA index of the card to open, if not enumerating
+    int index;
+    /// Guards busy and pending
+    QMutex lock;
+    /// A request is being loaded
+    bool busy;
+    /// Next request: ALSA index, enumerate (-2) or none (-1)
+    int pending;
+};
+
+#endif // CARDLOADER_H
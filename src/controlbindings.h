@@ -0,0 +1,141 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef CONTROLBINDINGS_H
+#define CONTROLBINDINGS_H
+
+#include <QString>
+
+/** A widget bound to a card element.
+    Both directions go through the table below: widget signals are written
+    to the element by MainWindow::writeBinding(), and element changes are
+    shown on the widget by MainWindow::showBinding().
+    */
+struct ControlBinding
+{
+    /// How values translate between element and widget
+    enum Kind
+    {
+        /// Enumeration on a matrix column (QButtonGroup), see SoundCard::matrixToAlsa()
+        Routing,
+        /// Switch on a checkable button
+        Switch,
+        /** Integer on a slider.
+            A QLabel named like the slider plus "db" (e.g. "masterdb")
+            shows the level, if the element has a dB scale.
+            */
+        Level,
+        /// Enumeration item on a combo box
+        Item
+    };
+    /// ALSA element name
+    const char * element;
+    /// Widget object name, as in mainwindow.ui
+    const char * widget;
+    Kind kind;
+    /** Offset to the row of the stereo partner, 0 if none.
+        Pairs are L/R for the fixed stereo outputs, and consecutive channels
+        (A/B, C/D, ADAT 0/1, ...) for the DSP capture and ADAT chains.
+        */
+    int partner;
+};
+
+/** Bound controls.
+    Rows whose element a card doesn't have are left alone, so other E-mu
+    models only need rows (and widgets) of their own.
+    */
+const ControlBinding controlBindings[] = {
+    { "Master Playback Volume",                   "master",   ControlBinding::Level,   0 },
+    { "Clock Internal Rate",                      "rate",     ControlBinding::Item,    0 },
+    // Output pads, labeled 14dB, when I think it's actually 12 (+4dBu/-10dBV)
+    { "DAC1 0202 14dB PAD Playback Switch",       "dacpad",   ControlBinding::Switch,  0 },
+    { "DAC1 Audio Dock 14dB PAD Playback Switch", "d1pad",    ControlBinding::Switch,  0 },
+    { "DAC2 Audio Dock 14dB PAD Playback Switch", "d2pad",    ControlBinding::Switch,  0 },
+    { "DAC3 Audio Dock 14dB PAD Playback Switch", "d3pad",    ControlBinding::Switch,  0 },
+    { "DAC4 Audio Dock 14dB PAD Playback Switch", "d4pad",    ControlBinding::Switch,  0 },
+    // Input pads
+    { "ADC1 14dB PAD 0202 Capture Switch",        "adcpadin", ControlBinding::Switch,  0 },
+    { "ADC1 14dB PAD Audio Dock Capture Switch",  "d1padin",  ControlBinding::Switch,  0 },
+    { "ADC2 14dB PAD Audio Dock Capture Switch",  "d2padin",  ControlBinding::Switch,  0 },
+    { "ADC3 14dB PAD Audio Dock Capture Switch",  "d3padin",  ControlBinding::Switch,  0 },
+    // Matrix columns (card outputs)
+    //  b11 - b16: Alsa capture channels
+    { "DSP A Capture Enum",                       "b11",      ControlBinding::Routing, 1 },
+    { "DSP B Capture Enum",                       "b12",      ControlBinding::Routing, -1 },
+    { "DSP C Capture Enum",                       "b13",      ControlBinding::Routing, 1 },
+    { "DSP D Capture Enum",                       "b14",      ControlBinding::Routing, -1 },
+    { "DSP E Capture Enum",                       "b15",      ControlBinding::Routing, 1 },
+    { "DSP F Capture Enum",                       "b16",      ControlBinding::Routing, -1 },
+    //  b0l, b0r: 0202 left & right DACs
+    { "0202 DAC Left Playback Enum",              "b0l",      ControlBinding::Routing, 1 },
+    { "0202 DAC Right Playback Enum",             "b0r",      ControlBinding::Routing, -1 },
+    //  ba0 - ba7: 1010 ADAT ouput channels
+    { "1010 ADAT 0 Playback Enum",                "ba0",      ControlBinding::Routing, 1 },
+    { "1010 ADAT 1 Playback Enum",                "ba1",      ControlBinding::Routing, -1 },
+    { "1010 ADAT 2 Playback Enum",                "ba2",      ControlBinding::Routing, 1 },
+    { "1010 ADAT 3 Playback Enum",                "ba3",      ControlBinding::Routing, -1 },
+    { "1010 ADAT 4 Playback Enum",                "ba4",      ControlBinding::Routing, 1 },
+    { "1010 ADAT 5 Playback Enum",                "ba5",      ControlBinding::Routing, -1 },
+    { "1010 ADAT 6 Playback Enum",                "ba6",      ControlBinding::Routing, 1 },
+    { "1010 ADAT 7 Playback Enum",                "ba7",      ControlBinding::Routing, -1 },
+    //  bsl, bsr: 1010 S/PDIF left & right
+    { "1010 SPDIF Left Playback Enum",            "bsl",      ControlBinding::Routing, 1 },
+    { "1010 SPDIF Right Playback Enum",           "bsr",      ControlBinding::Routing, -1 },
+    //  b1l, b1r - b4l, b4r: Dock DACs 1-4, left & right
+    { "Dock DAC1 Left Playback Enum",             "b1l",      ControlBinding::Routing, 1 },
+    { "Dock DAC1 Right Playback Enum",            "b1r",      ControlBinding::Routing, -1 },
+    { "Dock DAC2 Left Playback Enum",             "b2l",      ControlBinding::Routing, 1 },
+    { "Dock DAC2 Right Playback Enum",            "b2r",      ControlBinding::Routing, -1 },
+    { "Dock DAC3 Left Playback Enum",             "b3l",      ControlBinding::Routing, 1 },
+    { "Dock DAC3 Right Playback Enum",            "b3r",      ControlBinding::Routing, -1 },
+    { "Dock DAC4 Left Playback Enum",             "b4l",      ControlBinding::Routing, 1 },
+    { "Dock DAC4 Right Playback Enum",            "b4r",      ControlBinding::Routing, -1 },
+    //  bpl, bpr: Dock phones DAC, left & right
+    { "Dock Phones Left Playback Enum",           "bpl",      ControlBinding::Routing, 1 },
+    { "Dock Phones Right Playback Enum",          "bpr",      ControlBinding::Routing, -1 },
+    //  bdsl, bsdr: Dock S/PDIF outputs, left & right
+    { "Dock SPDIF Left Playback Enum",            "bdsl",     ControlBinding::Routing, 1 },
+    { "Dock SPDIF Right Playback Enum",           "bdsr",     ControlBinding::Routing, -1 },
+};
+
+const int controlBindingCount = sizeof(controlBindings) / sizeof(controlBindings[0]);
+
+/** Row bound to an element.
+    Linear search, meant for setup; look rows up by element id afterwards.
+    @return Row, -1 if the element has no widget.
+    */
+inline int controlBindingRow(const QString & element)
+{
+    for (int row = 0; row < controlBindingCount; row++)
+        if (element == controlBindings[row].element)
+            return row;
+    return -1;
+}
+
+/** Matrix row of the source linked to the one on row.
+    Sources come in L/R pairs, starting with Dock Mic A/B on rows 1 and 2,
+    so left ones are on odd rows. Mute (row 0) has no partner and links
+    to itself.
+    */
+inline int linkedSource(int row)
+{
+    if (row <= 0)
+        return row;
+    return (row % 2) ? row + 1 : row - 1;
+}
+
+#endif // CONTROLBINDINGS_H
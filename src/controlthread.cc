@@ -0,0 +1,171 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "controlthread.h"
+#include "soundcard.h"
+#include "monotonic.h"
+#include <QSettings>
+#include <QStringList>
+#include <QMutexLocker>
+#include <QDebug>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <string.h>
+#include <errno.h>
+
+/// How long to wait for events at a time (ms)
+static const int eventTimeout = 10;
+
+ControlThread::ControlThread(QObject * parent)
+    : QThread(parent), card(NULL), stopping(0), worst(0), totalLateness(0), wakeups(0)
+{
+    QSettings settings;
+    policy = settings.value("control/policy", "other").toString();
+    priority = settings.value("control/priority", 50).toInt();
+    QStringList list = settings.value("control/cpus").toString().split(',', QString::SkipEmptyParts);
+    for (QStringList::const_iterator it = list.begin(); it != list.end(); ++it)
+    {
+        bool ok;
+        int cpu = it->trimmed().toInt(&ok);
+        if (ok && cpu >= 0 && cpu < CPU_SETSIZE)
+            cpus.append(cpu);
+        else
+            qDebug() << "Warning: Ignoring CPU " << *it;
+    }
+    lockMemory = settings.value("control/mlock", false).toBool();
+}
+
+ControlThread::~ControlThread()
+{
+    stop();
+    wait();
+}
+
+bool ControlThread::enabled()
+{
+    QSettings settings;
+    return settings.value("control/thread", false).toBool();
+}
+
+void ControlThread::setCard(SoundCard * c)
+{
+    QMutexLocker locker(&cardLock);
+    card = c;
+}
+
+void ControlThread::stop()
+{
+    stopping = 1;
+}
+
+int ControlThread::worstLatency() const
+{
+    return worst;
+}
+
+void ControlThread::setupRealtime()
+{
+    int sched = policy == "fifo" ? SCHED_FIFO : policy == "rr" ? SCHED_RR : SCHED_OTHER;
+    if (sched != SCHED_OTHER)
+    {
+        struct sched_param param;
+        param.sched_priority = qBound(sched_get_priority_min(sched), priority,
+                                      sched_get_priority_max(sched));
+        int err = pthread_setschedparam(pthread_self(), sched, &param);
+        if (err)
+            qDebug() << "Warning: No real time scheduling for the control thread: " << strerror(err);
+        else
+            qDebug() << "Control thread: " << policy << " priority " << param.sched_priority;
+    }
+    if (!cpus.isEmpty())
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (QList<int>::const_iterator it = cpus.begin(); it != cpus.end(); ++it)
+            CPU_SET(*it, &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err)
+            qDebug() << "Warning: Couldn't pin the control thread: " << strerror(err);
+    }
+    // Page faults would undo all of the above
+    if (lockMemory && mlockall(MCL_CURRENT | MCL_FUTURE))
+        qDebug() << "Warning: Couldn't lock memory: " << strerror(errno);
+}
+
+void ControlThread::run()
+{
+    setupRealtime();
+    while (!stopping)
+    {
+        QMutexLocker locker(&cardLock);
+        if (!card)
+        {
+            locker.unlock();
+            msleep(eventTimeout);
+            continue;
+        }
+        qint64 start = monotonicNs();
+        int events;
+        try
+        {
+            events = card->processEvents(eventTimeout);
+        }
+        catch (QString err)
+        {
+            // Nobody up this thread to catch it: let go of the card, and
+            // let the window deal with it
+            card = NULL;
+            locker.unlock();
+            emit failed(err);
+            continue;
+        }
+        // Lateness only makes sense when nothing woke us up early
+        if (events)
+            continue;
+        int late = (monotonicNs() - start) / 1000 - eventTimeout * 1000;
+        if (late < 0)
+            continue;
+        totalLateness += late;
+        wakeups++;
+        if (late > worst)
+            worst = late;
+    }
+    qDebug() << "Control thread stopped. Wake up lateness: mean "
+             << (wakeups ? totalLateness / wakeups : 0) << " us, worst " << (int)worst << " us";
+}
+
+CpuHog::CpuHog(QObject * parent) : QThread(parent), stopping(0)
+{
+}
+
+CpuHog::~CpuHog()
+{
+    stop();
+    wait();
+}
+
+void CpuHog::stop()
+{
+    stopping = 1;
+}
+
+void CpuHog::run()
+{
+    volatile unsigned long spin = 0;
+    while (!stopping)
+        spin++;
+}
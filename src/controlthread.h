@@ -0,0 +1,115 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CONTROLTHREAD_H
+#define CONTROLTHREAD_H
+
+#include <QThread>
+#include <QMutex>
+#include <QAtomicInt>
+#include <QList>
+#include <QString>
+
+class SoundCard;
+
+/** Handles ALSA control events on a thread of its own.
+    By default, events are handled in the GUI thread, from the window's
+    timer, so they may wait for whatever the GUI is doing. With
+    "control/thread" set, this thread waits for events and reads changes
+    back (SoundCard::processEvents()); the window only applies them
+    (SoundCard::updateWindow()).
+
+    The thread may run with real time scheduling, pinned to some CPUs, and
+    with the process memory locked. Without the privileges for that, a
+    warning is printed and it runs as a normal thread. Settings:
+    - "control/policy": "other" (default), "fifo" or "rr"
+    - "control/priority": real time priority, default 50
+    - "control/cpus": CPUs to run on, e.g. "2,3"; default any
+    - "control/mlock": lock all memory (mlockall), default false
+
+    How late the thread wakes up is measured, to compare settings under load
+    (see CpuHog).
+    */
+class ControlThread : public QThread
+{
+    Q_OBJECT
+
+public:
+    ControlThread(QObject * parent = 0);
+    /** Destructor.
+        Stops the thread.
+        */
+    ~ControlThread();
+
+    /// True if settings ask for a control thread
+    static bool enabled();
+
+    /** Set card to handle events of.
+        Blocks until the card isn't in use, so the previous card can be
+        deleted afterwards. NULL detaches.
+        */
+    void setCard(SoundCard * card);
+    /// Ask thread to finish
+    void stop();
+    /// Worst wake up lateness, in microseconds.
+    int worstLatency() const;
+
+signals:
+    /** Handling the card's events failed (e.g. it was unplugged).
+        The thread lets go of the card; setCard() gives it another.
+        */
+    void failed(const QString & err);
+
+protected:
+    void run();
+
+private:
+    /// Applies scheduling, affinity and memory locking settings
+    void setupRealtime();
+
+    SoundCard * card;
+    /// Held while the card is being used
+    QMutex cardLock;
+    QAtomicInt stopping;
+    QAtomicInt worst;
+    /// For the mean lateness
+    qint64 totalLateness;
+    int wakeups;
+
+    QString policy;
+    int priority;
+    QList<int> cpus;
+    bool lockMemory;
+};
+
+/** Burns CPU, for latency benchmarks.
+    Started with --hog N, next to the control thread.
+    */
+class CpuHog : public QThread
+{
+public:
+    CpuHog(QObject * parent = 0);
+    ~CpuHog();
+    void stop();
+
+protected:
+    void run();
+
+private:
+    QAtomicInt stopping;
+};
+
+#endif // CONTROLTHREAD_H
@@ -0,0 +1,164 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "correlator.h"
+#include <QDebug>
+#include <QtGlobal>
+#include <cassert>
+#include <cmath>
+
+/// Partial sums of dot(), enough for 8 floats (AVX) at a time
+static const int lanes = 8;
+
+QVector<float> Correlator::mls(int order, float amplitude)
+{
+    assert(order >= 2 && order <= 24);
+    // Feedback taps of maximal length Fibonacci LFSRs, bit numbers from 1, 0 if unused
+    static const int taps[25][4] = {
+        {0, 0, 0, 0}, {0, 0, 0, 0}, {2, 1, 0, 0}, {3, 2, 0, 0}, {4, 3, 0, 0},
+        {5, 3, 0, 0}, {6, 5, 0, 0}, {7, 6, 0, 0}, {8, 6, 5, 4}, {9, 5, 0, 0},
+        {10, 7, 0, 0}, {11, 9, 0, 0}, {12, 6, 4, 1}, {13, 4, 3, 1}, {14, 5, 3, 1},
+        {15, 14, 0, 0}, {16, 15, 13, 4}, {17, 14, 0, 0}, {18, 11, 0, 0}, {19, 6, 2, 1},
+        {20, 17, 0, 0}, {21, 19, 0, 0}, {22, 21, 0, 0}, {23, 18, 0, 0}, {24, 23, 22, 17}
+    };
+    int length = (1 << order) - 1;
+    QVector<float> sequence(length);
+    quint32 state = 1;
+    for (int i = 0; i < length; i++)
+    {
+        sequence[i] = state & 1 ? amplitude : -amplitude;
+        quint32 bit = 0;
+        for (int t = 0; t < 4 && taps[order][t]; t++)
+            bit ^= state >> (taps[order][t] - 1);
+        state = ((state << 1) | (bit & 1)) & length;
+    }
+    return sequence;
+}
+
+Correlator::Correlator(const QVector<float> & reference, int maxLag)
+    : reference(reference), maxLag(maxLag), energy(0), amplitude(0), correlation(maxLag + 1)
+{
+    for (int i = 0; i < reference.size(); i++)
+    {
+        energy += (double)reference.at(i) * reference.at(i);
+        amplitude = qMax(amplitude, qAbs(reference.at(i)));
+    }
+}
+
+float Correlator::dot(const float * __restrict__ a, const float * __restrict__ b, int n)
+{
+    // Independent partial sums: without them the additions can't be reordered into vectors
+    float sum[lanes] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+    int blocks = n / lanes * lanes;
+    for (int i = 0; i < blocks; i += lanes)
+        for (int l = 0; l < lanes; l++)
+            sum[l] += a[i + l] * b[i + l];
+    float total = 0;
+    for (int l = 0; l < lanes; l++)
+        total += sum[l];
+    for (int i = blocks; i < n; i++)
+        total += a[i] * b[i];
+    return total;
+}
+
+bool Correlator::analyze(const float * recording, Result & result)
+{
+    const float * ref = reference.constData();
+    int n = reference.size();
+    for (int lag = 0; lag <= maxLag; lag++)
+        correlation[lag] = dot(ref, recording + lag, n);
+    // Recording energy in a window sliding along with the lag
+    double window = 0;
+    for (int i = 0; i < n; i++)
+        window += (double)recording[i] * recording[i];
+    result.lag = 0;
+    result.match = 0;
+    for (int lag = 0; lag <= maxLag; lag++)
+    {
+        if (lag > 0)
+            window += (double)recording[lag + n - 1] * recording[lag + n - 1]
+                      - (double)recording[lag - 1] * recording[lag - 1];
+        if (window <= 0)
+            continue;
+        float match = qAbs(correlation.at(lag)) / sqrt(energy * window);
+        if (match > result.match)
+        {
+            result.match = match;
+            result.lag = lag;
+        }
+    }
+    result.gain = correlation.at(result.lag) / energy;
+    // Sample by sample, against the scaled reference
+    const float * aligned = recording + result.lag;
+    float threshold = qAbs(result.gain) * amplitude / 2;
+    double error = 0;
+    result.corrupted = 0;
+    for (int i = 0; i < n; i++)
+    {
+        float e = aligned[i] - result.gain * ref[i];
+        error += (double)e * e;
+        if (qAbs(e) > threshold)
+            result.corrupted++;
+    }
+    double signal = result.gain * result.gain * energy;
+    result.snr = error > 0 ? 10 * log10(signal / error) : 200;
+    // Noise alone correlates around 1 / sqrt(n) at any lag
+    return result.match >= 8 / sqrt((double)n);
+}
+
+bool Correlator::selfTest()
+{
+    QVector<float> reference = mls(14, 0.5f);
+    int maxLag = 4800;
+    Correlator correlator(reference, maxLag);
+    QVector<float> recording(correlator.recordingSize());
+    qsrand(1);
+    bool ok = true;
+    // Delay, gain, noise amplitude, corrupted samples, whether the signal is there at all
+    const struct { int lag; float gain; float noise; int corrupt; bool present; } cases[] = {
+        { 0, 1.0f, 0.0f, 0, true },
+        { 1234, 0.7f, 0.01f, 0, true },
+        { 4800, -1.0f, 0.0f, 0, true },
+        { 96, 1.0f, 0.001f, 5, true },
+        { 500, 0.1f, 0.02f, 0, true },
+        { 0, 0.0f, 0.3f, 0, false }
+    };
+    for (unsigned int c = 0; c < sizeof(cases) / sizeof(cases[0]); c++)
+    {
+        for (int i = 0; i < recording.size(); i++)
+        {
+            float noise = cases[c].noise * ((float)qrand() / RAND_MAX * 2 - 1);
+            int r = i - cases[c].lag;
+            recording[i] = noise + (r >= 0 && r < reference.size() ? cases[c].gain * reference.at(r) : 0);
+        }
+        // Dropped samples, spread out
+        for (int k = 0; k < cases[c].corrupt; k++)
+            recording[cases[c].lag + 1000 + k * 997] = 0;
+        Result result;
+        bool found = correlator.analyze(recording.constData(), result);
+        bool right = found == cases[c].present
+                     && (!found || (result.lag == cases[c].lag && result.corrupted == cases[c].corrupt));
+        qDebug() << "Correlator: lag " << cases[c].lag << " gain " << cases[c].gain << " noise "
+                 << cases[c].noise << " corrupt " << cases[c].corrupt << " -> "
+                 << (found ? "found" : "not found") << " lag " << result.lag << " match " << result.match
+                 << " gain " << result.gain << " corrupted " << result.corrupted << " snr " << result.snr
+                 << (right ? "" : " WRONG");
+        ok = ok && right;
+    }
+    qDebug() << "Correlator self-test " << (ok ? "passed" : "FAILED");
+    return ok;
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef CORRELATOR_H
+#define CORRELATOR_H
+
+#include <QVector>
+
+/** Finds a known test signal in a recording.
+    Cross-correlates the recording with the reference at every lag up to a
+    maximum, and takes the lag where they match best (normalized, so loud
+    noise doesn't win). The aligned recording is then compared sample by
+    sample with the reference, scaled by the measured gain, to find
+    corrupted samples.
+    The inner products run over plain float arrays with several partial
+    sums, so the compiler vectorizes them (SSE, NEON); correlator.cc is
+    built with -O3 for that, even in debug builds.
+    Works on any buffers: a capture through the card, snd-aloop, or
+    synthetic ones (see selfTest()).
+    */
+class Correlator
+{
+public:
+    struct Result
+    {
+        /// Recording is the reference delayed by this many samples
+        int lag;
+        /// Normalized correlation at lag, 0-1 (1: perfect copy)
+        float match;
+        /// Recording / reference; negative if the polarity is inverted
+        float gain;
+        /// Samples off by more than half their expected amplitude
+        int corrupted;
+        /// Signal to error ratio of the aligned recording (dB)
+        float snr;
+    };
+
+    /** Maximum length sequence.
+        Pseudo random +-amplitude, 2^order - 1 samples long. Its
+        autocorrelation is a single peak, so the lag is unambiguous.
+        @param order 2 to 24
+        */
+    static QVector<float> mls(int order, float amplitude);
+
+    /** Allocates everything analyze() needs.
+        @param reference Test signal
+        @param maxLag Largest lag searched, in samples
+        */
+    Correlator(const QVector<float> & reference, int maxLag);
+
+    /// Samples analyze() needs: the reference plus the largest lag
+    int recordingSize() const { return reference.size() + maxLag; }
+    /** Finds the reference in a recording.
+        @param recording recordingSize() samples
+        @return false if the reference isn't there (match no better than
+        noise would give)
+        */
+    bool analyze(const float * recording, Result & result);
+
+    /** Checks analyze() on synthetic recordings: delayed, scaled, noisy
+        and corrupted copies of an MLS, and one without it. Prints the results.
+        @return false if any was misjudged
+        */
+    static bool selfTest();
+
+private:
+    /// Inner product of n samples
+    static float dot(const float * a, const float * b, int n);
+
+    QVector<float> reference;
+    int maxLag;
+    /// Reference energy and peak
+    double energy;
+    float amplitude;
+    /// Correlation at each lag
+    QVector<float> correlation;
+};
+
+#endif // CORRELATOR_H
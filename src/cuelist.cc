@@ -0,0 +1,162 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cuelist.h"
+#include "monotonic.h"
+#include <QFile>
+#include <QTextStream>
+#include <QStringList>
+#include <QtAlgorithms>
+#include <QDebug>
+#include <time.h>
+#include <errno.h>
+
+/// Longest single sleep, so stop() isn't kept waiting (ns)
+static const qint64 maxSleep = 100000000LL;
+
+/// Cues sort by time, keeping file order for equal times
+static bool cueBefore(const Cue & a, const Cue & b)
+{
+    return a.time < b.time;
+}
+
+CueList::CueList(SoundCard * card, QObject * parent)
+    : QThread(parent), card(card), stopping(0)
+{
+}
+
+CueList::~CueList()
+{
+    stop();
+    wait();
+}
+
+int CueList::size() const
+{
+    return cues.size();
+}
+
+void CueList::stop()
+{
+    stopping = 1;
+}
+
+long CueList::parseValue(int id, const QString & text, bool * ok) const
+{
+    const ElementSchema & schema = card->getSchema();
+    long v = text.toLong(ok);
+    if (*ok)
+        return v;
+    if (schema.type(id) == SND_CTL_ELEM_TYPE_BOOLEAN && (text == "on" || text == "off"))
+    {
+        *ok = true;
+        return text == "on";
+    }
+    v = schema.itemIndex(id, text);
+    *ok = v >= 0;
+    return v;
+}
+
+void CueList::load(const QString & path)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text))
+        throw QString("Can't open cue list %1: %2").arg(path).arg(file.errorString());
+    const ElementSchema & schema = card->getSchema();
+    QList<Cue> list;
+    QTextStream in(&file);
+    for (int line = 1; !in.atEnd(); line++)
+    {
+        QString text = in.readLine().trimmed();
+        if (text.isEmpty() || text.startsWith('#'))
+            continue;
+        QString where = QString("%1:%2: ").arg(path).arg(line);
+        int space = text.indexOf(' ');
+        int equals = text.indexOf('=');
+        if (space < 0 || equals < space)
+            throw where + "Expected <seconds> <element> = <values>";
+        bool ok;
+        double seconds = text.left(space).toDouble(&ok);
+        if (!ok || seconds < 0)
+            throw where + "Bad time " + text.left(space);
+        QString name = text.mid(space + 1, equals - space - 1).trimmed();
+        ElementWrite w;
+        w.id = schema.find(name);
+        if (w.id < 0)
+            throw where + "No element " + name;
+        QStringList values = text.mid(equals + 1).split(',');
+        for (QStringList::const_iterator it = values.begin(); it != values.end(); ++it)
+        {
+            w.values.append(parseValue(w.id, it->trimmed(), &ok));
+            if (!ok || !schema.isValid(w.id, w.values.last()))
+                throw where + "Bad value " + it->trimmed() + " for " + name;
+        }
+        qint64 time = (qint64)(seconds * 1e9 + 0.5);
+        if (!list.isEmpty() && list.last().time == time)
+            list.last().writes.append(w);
+        else
+        {
+            Cue cue;
+            cue.time = time;
+            cue.line = line;
+            cue.writes.append(w);
+            list.append(cue);
+        }
+    }
+    qStableSort(list.begin(), list.end(), cueBefore);
+    // Equal times apart in the file are still one cue
+    cues.clear();
+    for (QList<Cue>::const_iterator it = list.begin(); it != list.end(); ++it)
+        if (!cues.isEmpty() && cues.last().time == it->time)
+            cues.last().writes += it->writes;
+        else
+            cues.append(*it);
+    qDebug() << "Cue list " << path << ": " << cues.size() << " cues.";
+}
+
+void CueList::run()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    qint64 start = (qint64)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    qint64 total = 0;
+    int worst = 0;
+    int done = 0;
+    for (int c = 0; c < cues.size() && !stopping; c++)
+    {
+        qint64 deadline = start + cues.at(c).time;
+        // Absolute deadlines: time spent writing earlier cues doesn't shift later ones
+        for (qint64 now = monotonicNs(); now < deadline && !stopping; now = monotonicNs())
+        {
+            qint64 until = qMin(deadline, now + maxSleep);
+            ts.tv_sec = until / 1000000000LL;
+            ts.tv_nsec = until % 1000000000LL;
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+                ;
+        }
+        if (stopping)
+            break;
+        if (!card->writeBatch(cues.at(c).writes, this))
+            qDebug() << "Warning: Cue of line " << cues.at(c).line << " not completely written";
+        int late = (monotonicNs() - deadline) / 1000;
+        total += late;
+        worst = qMax(worst, late);
+        done++;
+        emit cueDone(c, late);
+    }
+    qDebug() << "Cue list " << (stopping ? "stopped" : "done") << ": " << done << " cues, lateness mean "
+             << (done ? total / done : 0) << " us, worst " << worst << " us";
+}
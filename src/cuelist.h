@@ -0,0 +1,94 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CUELIST_H
+#define CUELIST_H
+
+#include <QThread>
+#include <QAtomicInt>
+#include <QList>
+#include <QVector>
+#include <QString>
+#include "soundcard.h"
+
+/** A timed batch of writes. */
+struct Cue
+{
+    /// Time from the start of the list (ns)
+    qint64 time;
+    /// Writes, resolved to element ids
+    WriteBatch writes;
+    /// Line of the first write in the file, for failed writes
+    int line;
+};
+
+/** Runs a list of timed cues on a card.
+    Cue list files have one write per line:
+
+        <seconds> <element name>[[<index>]] = <value>[,<value>...]
+
+    The index picks one of a multichannel control's elements, which share
+    a name; it defaults to 0. Values are integers, or item names for
+    enumerations ("on"/"off" work for switches). Lines starting with #
+    are comments. Writes with the same time make up one cue, which is
+    written as one batch.
+
+    Everything is checked and resolved to element ids when the list is
+    loaded. The list runs on its own thread, sleeping with clock_nanosleep
+    until each cue's absolute deadline, so lateness doesn't add up. How
+    late each cue was written is reported.
+    */
+class CueList : public QThread
+{
+    Q_OBJECT
+
+public:
+    CueList(SoundCard * card, QObject * parent = 0);
+    /** Destructor.
+        Stops the list.
+        */
+    ~CueList();
+
+    /** Loads a cue list file.
+        Throws QString on errors, with file and line.
+        */
+    void load(const QString & path);
+    /// Number of cues
+    int size() const;
+    /// Ask thread to finish, skipping the remaining cues
+    void stop();
+
+signals:
+    /** A cue was written.
+        @param cue Cue index
+        @param lateness How long after its time the cue was completely
+               written, in microseconds
+        */
+    void cueDone(int cue, int lateness);
+
+protected:
+    void run();
+
+private:
+    /// Parses one value for element id
+    long parseValue(int id, const QString & text, bool * ok) const;
+
+    SoundCard * card;
+    QList<Cue> cues;
+    QAtomicInt stopping;
+};
+
+#endif // CUELIST_H
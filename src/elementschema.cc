@@ -0,0 +1,274 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "elementschema.h"
+#include <QMutex>
+#include <QMutexLocker>
+#include <QDebug>
+#include <QtAlgorithms>
+#include <cassert>
+
+/// Largest range that gets a dB table (values)
+static const long maxDbTable = 65536;
+
+/// Schemas built so far, by content key. Cards may be opened from the loader thread.
+static QHash<QByteArray, ElementSchema::Pointer> schemas;
+static QMutex schemasLock;
+
+ElementSchema::ElementSchema() : values(0)
+{
+}
+
+/// ElementSchema::Access flags of an element
+static int accessOf(snd_ctl_elem_info_t * info)
+{
+    return (snd_ctl_elem_info_is_readable(info) ? ElementSchema::Readable : 0)
+        | (snd_ctl_elem_info_is_writable(info) ? ElementSchema::Writable : 0);
+}
+
+ElementSchema::Pointer ElementSchema::fromCard(snd_hctl_t * hctl)
+{
+    // Reading the info is what it takes to tell layouts apart anyway
+    Pointer schema(new ElementSchema);
+    schema->load(hctl);
+    QByteArray key = schema->contentKey();
+    QMutexLocker locker(&schemasLock);
+    if (schemas.contains(key))
+    {
+        qDebug("Reusing element schema of identical card.");
+        return schemas.value(key);
+    }
+    schemas.insert(key, schema);
+    return schema;
+}
+
+QByteArray ElementSchema::contentKey() const
+{
+    QByteArray key;
+    {
+        QDataStream out(&key, QIODevice::WriteOnly);
+        save(out);
+    }
+    key.append((const char *)dbFirst.constData(), dbFirst.size() * sizeof(int));
+    key.append((const char *)dbValues.constData(), dbValues.size() * sizeof(long));
+    return key;
+}
+
+void ElementSchema::load(snd_hctl_t * hctl)
+{
+    snd_ctl_elem_info_t * info;
+    if (snd_ctl_elem_info_malloc(&info))
+        throw QString("Out of memory.");
+    for (snd_hctl_elem_t * el = snd_hctl_first_elem(hctl); el; el = snd_hctl_elem_next(el))
+    {
+        QString name = snd_hctl_elem_get_name(el);
+        int index = snd_hctl_elem_get_index(el);
+        unsigned int numid = snd_hctl_elem_get_numid(el);
+        if (snd_hctl_elem_info(el, info) < 0)
+        {
+            qDebug() << "Warning: No info for element " << name;
+            append(name, index, numid, SND_CTL_ELEM_TYPE_NONE, 0, 0, 0, 0, 0, QStringList());
+            continue;
+        }
+        snd_ctl_elem_type_t type = snd_ctl_elem_info_get_type(info);
+        QStringList items;
+        if (type == SND_CTL_ELEM_TYPE_ENUMERATED)
+        {
+            unsigned int n = snd_ctl_elem_info_get_items(info);
+            for (unsigned int i = 0; i < n; i++)
+            {
+                snd_ctl_elem_info_set_item(info, i);
+                if (snd_hctl_elem_info(el, info) < 0)
+                    items.append(QString());
+                else
+                    items.append(snd_ctl_elem_info_get_item_name(info));
+            }
+        }
+        if (type == SND_CTL_ELEM_TYPE_INTEGER)
+        {
+            append(name, index, numid, type, accessOf(info), snd_ctl_elem_info_get_count(info),
+                   snd_ctl_elem_info_get_min(info), snd_ctl_elem_info_get_max(info),
+                   snd_ctl_elem_info_get_step(info), items);
+            loadDb(names.size() - 1, el, info);
+        }
+        else
+            append(name, index, numid, type, accessOf(info), snd_ctl_elem_info_get_count(info),
+                   0, type == SND_CTL_ELEM_TYPE_BOOLEAN ? 1 : 0, 0, items);
+    }
+    snd_ctl_elem_info_free(info);
+    qDebug() << names.size() << " element descriptions read, "
+            << strings.size() << " distinct enumeration items, "
+            << dbValues.size() << " dB table entries.";
+}
+
+void ElementSchema::loadDb(int id, snd_hctl_elem_t * el, snd_ctl_elem_info_t * info)
+{
+    if (!snd_ctl_elem_info_is_tlv_readable(info) || max(id) - min(id) >= maxDbTable)
+        return;
+    unsigned int tlv[64];
+    if (snd_hctl_elem_tlv_read(el, tlv, sizeof(tlv)) < 0)
+        return;
+    // Converted once here, so faders never need ioctls (or TLV parsing)
+    int first = dbValues.size();
+    dbValues.reserve(first + max(id) - min(id) + 1);
+    for (long v = min(id); v <= max(id); v++)
+    {
+        long db;
+        if (snd_tlv_convert_to_dB(tlv, min(id), max(id), v, &db) < 0)
+        {
+            qDebug() << "Warning: Unknown dB scale of " << name(id);
+            dbValues.resize(first);
+            return;
+        }
+        dbValues.append(db);
+    }
+    dbFirst[id] = first;
+}
+
+long ElementSchema::fromDb(int id, long db) const
+{
+    // Levels grow with values, so the table is sorted
+    QVector<long>::const_iterator begin = dbValues.begin() + dbFirst.at(id);
+    QVector<long>::const_iterator end = begin + (max(id) - min(id) + 1);
+    QVector<long>::const_iterator it = qLowerBound(begin, end, db);
+    if (it == end)
+        return max(id);
+    // Closer to the one below?
+    if (it != begin && db - *(it - 1) < *it - db)
+        --it;
+    return min(id) + (it - begin);
+}
+
+void ElementSchema::append(const QString & name, int index, unsigned int numid, snd_ctl_elem_type_t type, int access,
+                           unsigned int count, long min, long max, long step, const QStringList & items)
+{
+    ids.insert(qMakePair(name, index), names.size());
+    names.append(name);
+    indices.append(index);
+    numids.append(numid);
+    types.append(type);
+    accesses.append(access);
+    counts.append(count);
+    offsets.append(values);
+    values += count;
+    mins.append(min);
+    maxs.append(max);
+    steps.append(step);
+    dbFirst.append(-1);
+    itemFirst.append(itemStrings.size());
+    itemCounts.append(items.size());
+    for (QStringList::const_iterator it = items.begin(); it != items.end(); ++it)
+        itemStrings.append(intern(*it));
+}
+
+ElementSchema::Pointer ElementSchema::fromStream(QDataStream & in)
+{
+    Pointer schema(new ElementSchema);
+    qint32 n;
+    in >> n;
+    for (qint32 id = 0; id < n && in.status() == QDataStream::Ok; id++)
+    {
+        QString name;
+        quint16 index;
+        quint32 numid;
+        quint8 type, access;
+        quint16 count;
+        qint64 min, max, step;
+        QStringList items;
+        in >> name >> index >> numid >> type >> access >> count >> min >> max >> step >> items;
+        schema->append(name, index, numid, (snd_ctl_elem_type_t)type, access, count, min, max, step, items);
+    }
+    if (n < 0 || in.status() != QDataStream::Ok)
+        throw QString("Bad element schema.");
+    return schema;
+}
+
+void ElementSchema::save(QDataStream & out) const
+{
+    out << (qint32)size();
+    for (int id = 0; id < size(); id++)
+    {
+        QStringList itemNames;
+        for (unsigned int i = 0; i < items(id); i++)
+            itemNames.append(itemName(id, i));
+        out << name(id) << indices.at(id) << numids.at(id) << types.at(id) << accesses.at(id) << counts.at(id)
+            << (qint64)min(id) << (qint64)max(id) << (qint64)step(id) << itemNames;
+    }
+}
+
+int ElementSchema::intern(const QString & s)
+{
+    QHash<QString, int>::const_iterator it = stringIds.constFind(s);
+    if (it != stringIds.constEnd())
+        return it.value();
+    stringIds.insert(s, strings.size());
+    strings.append(s);
+    return strings.size() - 1;
+}
+
+int ElementSchema::find(const QString & text) const
+{
+    // "name[index]", unless the name itself ends like that
+    int open = text.lastIndexOf('[');
+    if (text.endsWith(']') && open > 0 && id(text) < 0)
+    {
+        bool ok;
+        int index = text.mid(open + 1, text.size() - open - 2).toInt(&ok);
+        if (ok)
+            return id(text.left(open), index);
+    }
+    return id(text);
+}
+
+const QString & ElementSchema::itemName(int id, unsigned int item) const
+{
+    assert(item < items(id));
+    return strings.at(itemStrings.at(itemFirst.at(id) + item));
+}
+
+int ElementSchema::itemIndex(int id, const QString & item) const
+{
+    int s = stringIds.value(item, -1);
+    if (s < 0)
+        return -1;
+    for (unsigned int i = 0; i < items(id); i++)
+        if (itemStrings.at(itemFirst.at(id) + i) == s)
+            return i;
+    return -1;
+}
+
+bool ElementSchema::isValid(int id, long v) const
+{
+    switch (type(id))
+    {
+    case SND_CTL_ELEM_TYPE_ENUMERATED:
+        return v >= 0 && (unsigned long)v < items(id);
+    case SND_CTL_ELEM_TYPE_BOOLEAN:
+    case SND_CTL_ELEM_TYPE_INTEGER:
+        return v >= min(id) && v <= max(id);
+    default:
+        return false;
+    }
+}
+
+long ElementSchema::clamp(int id, long v) const
+{
+    if (v < min(id))
+        return min(id);
+    if (v > max(id))
+        return max(id);
+    return v;
+}
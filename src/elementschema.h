@@ -0,0 +1,174 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ELEMENTSCHEMA_H
+#define ELEMENTSCHEMA_H
+
+#include <QString>
+#include <QStringList>
+#include <QHash>
+#include <QPair>
+#include <QVector>
+#include <QByteArray>
+#include <QSharedData>
+#include <QExplicitlySharedDataPointer>
+#include <QDataStream>
+#include "alsa/asoundlib.h"
+
+/** Static description of a card's ALSA elements.
+    Read once through snd_hctl_elem_info when a card is loaded: type,
+    value count, integer range and enumeration item names. Elements are
+    numbered (element id) in hctl order, so arrays below are indexed by id.
+    Stored as parallel arrays (struct of arrays), item names are interned.
+
+    Cards with identical element layouts (same elements in the same order,
+    with the same info) share one schema, built once and kept for good;
+    use ElementSchema::fromCard() to get it.
+    */
+class ElementSchema : public QSharedData
+{
+public:
+    typedef QExplicitlySharedDataPointer<ElementSchema> Pointer;
+    /// Access flags, see access()
+    enum Access { Readable = 1, Writable = 2 };
+
+    /** Returns the schema for a loaded card.
+        Reads element info from ALSA, then returns a previously built
+        schema instead if it has the same contents.
+        @param hctl Loaded ALSA high level control handle
+        */
+    static Pointer fromCard(snd_hctl_t * hctl);
+    /** Reads a schema written by save().
+        Used for cards that aren't there (e.g. replaying a trace).
+        Throws QString if the data doesn't make sense.
+        */
+    static Pointer fromStream(QDataStream & in);
+    /// Writes the whole schema, see fromStream().
+    void save(QDataStream & out) const;
+
+    /// Number of elements.
+    int size() const { return names.size(); }
+    /** Element id by name and index, -1 if not available.
+        Multichannel controls are several elements with the same name,
+        told apart by their ALSA index.
+        */
+    int id(const QString & name, int index = 0) const { return ids.value(qMakePair(name, index), -1); }
+    /** Element id by name, with an optional index: "name" or "name[index]".
+        As written in cue lists. -1 if not available.
+        */
+    int find(const QString & text) const;
+    /// Element name by id.
+    const QString & name(int id) const { return names.at(id); }
+    /// ALSA index of element id, 0 unless there are several with its name.
+    int index(int id) const { return indices.at(id); }
+    /** ALSA numid of element id (as in alsactl's control.N).
+        Not the id plus one: hctl sorts elements, numids follow the driver.
+        */
+    unsigned int numid(int id) const { return numids.at(id); }
+
+    snd_ctl_elem_type_t type(int id) const { return (snd_ctl_elem_type_t)types.at(id); }
+    /// Readable and/or Writable, 0 if the element had no info.
+    int access(int id) const { return accesses.at(id); }
+    /// Number of values (channels).
+    unsigned int count(int id) const { return counts.at(id); }
+    /// Integer range. Meaningless for other types.
+    long min(int id) const { return mins.at(id); }
+    long max(int id) const { return maxs.at(id); }
+    long step(int id) const { return steps.at(id); }
+    /** Position of the element's first value in a flat array holding the
+        values of all elements (channels are consecutive).
+        */
+    int offset(int id) const { return offsets.at(id); }
+    /// Size of such a flat value array.
+    int valueCount() const { return values; }
+    /// Number of enumeration items, 0 for non enumerated elements.
+    unsigned int items(int id) const { return itemCounts.at(id); }
+    /// Name of enumeration item.
+    const QString & itemName(int id, unsigned int item) const;
+    /// Index of enumeration item by name, -1 if not found.
+    int itemIndex(int id, const QString & item) const;
+
+    /** True if integer element id has a dB scale.
+        Read once from the element's TLV data when the card was loaded.
+        Not kept by save(), so virtual cards have none.
+        */
+    bool hasDb(int id) const { return dbFirst.at(id) >= 0; }
+    /** Level of an integer value, by table lookup.
+        @param id Element id, with a dB scale
+        @param v Value, clamped to the element's range
+        @return 1/100 dB, SND_CTL_TLV_DB_GAIN_MUTE if v mutes.
+        */
+    long toDb(int id, long v) const { return dbValues.at(dbFirst.at(id) + clamp(id, v) - min(id)); }
+    /** Value closest to a level, by binary search in the table.
+        @param id Element id, with a dB scale
+        @param db 1/100 dB
+        */
+    long fromDb(int id, long db) const;
+
+    /** Checks that v is a sensible value for element id.
+        Enumerations: index in range. Integers: inside [min, max].
+        */
+    bool isValid(int id, long v) const;
+    /// Clamp integer value to the element's range.
+    long clamp(int id, long v) const;
+
+private:
+    ElementSchema();
+    /// Reads all element info from ALSA.
+    void load(snd_hctl_t * hctl);
+    /// Adds an element to the arrays.
+    void append(const QString & name, int index, unsigned int numid, snd_ctl_elem_type_t type, int access,
+                unsigned int count, long min, long max, long step, const QStringList & items);
+    /// Reads the dB scale of integer element id, if it has one
+    void loadDb(int id, snd_hctl_elem_t * el, snd_ctl_elem_info_t * info);
+    /// Interns an item name, returns its string index
+    int intern(const QString & s);
+    /// Key used to find identical schemas: save() plus the dB tables.
+    QByteArray contentKey() const;
+
+    /// Element names, by id
+    QStringList names;
+    /// ALSA element index, by id
+    QVector<quint16> indices;
+    /// ALSA numid, by id
+    QVector<quint32> numids;
+    /// Name and index to id
+    QHash<QPair<QString, int>, int> ids;
+    /// snd_ctl_elem_type_t, by id
+    QVector<quint8> types;
+    /// Access flags, by id
+    QVector<quint8> accesses;
+    QVector<quint16> counts;
+    QVector<int> offsets;
+    int values;
+    QVector<long> mins;
+    QVector<long> maxs;
+    QVector<long> steps;
+    /// First item of each enumeration in itemStrings, by id
+    QVector<int> itemFirst;
+    QVector<quint16> itemCounts;
+    /// Index into strings, for all enumeration items of all elements
+    QVector<int> itemStrings;
+    /// First value of each element in dbValues, by id (-1 without dB scale)
+    QVector<int> dbFirst;
+    /// Level (1/100 dB) of every value from min to max, for all elements with a dB scale
+    QVector<long> dbValues;
+    /// Interned item names
+    QStringList strings;
+    QHash<QString, int> stringIds;
+};
+
+#endif // ELEMENTSCHEMA_H
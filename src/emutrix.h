@@ -0,0 +1,148 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* libemutrix: the emutrix card core, for other programs.
+   Plain C, so tools (and FFIs) can open an E-mu card in-process and
+   control it with no GUI: the same SoundCard the window and the terminal
+   frontend use, with its state cache, batched writes and change events.
+
+   Errors are negative errno values; emutrix_last_error() describes the
+   last one of the calling thread. Functions may be called from any thread.
+   Element ids, types and value layout are those of the card's ALSA
+   elements, see amixer or emutrix_shm.h. */
+
+#ifndef EMUTRIX_H
+#define EMUTRIX_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Only these functions are exported from the library */
+#if defined(__GNUC__) && __GNUC__ >= 4
+#define EMUTRIX_EXPORT __attribute__((visibility("default")))
+#else
+#define EMUTRIX_EXPORT
+#endif
+
+/* Bumped on incompatible changes */
+#define EMUTRIX_API_VERSION 1
+
+/* Element types, same values as snd_ctl_elem_type_t */
+#define EMUTRIX_BOOLEAN 1
+#define EMUTRIX_INTEGER 2
+#define EMUTRIX_ENUMERATED 3
+
+/* emutrix_open() flags: set the start defaults the window sets (zeroed
+   master and analog mixer levels, see sanealsa.h) */
+#define EMUTRIX_OPEN_DEFAULTS 1
+/* After a clock rate change (by anyone), put back the routes and pads
+   the firmware resets, as the window does. Done by
+   emutrix_handle_events(), as one batch subscribers see. */
+#define EMUTRIX_OPEN_RESYNC 2
+
+/* An open card */
+typedef struct emutrix_card emutrix_card;
+
+/* One write of a batch. Values are one per channel; if there are less,
+   the last one is repeated. Integers are clamped to the element range,
+   invalid enumeration indices are skipped. */
+typedef struct emutrix_element_write
+{
+    int id;
+    int count;
+    const long * values;
+} emutrix_element_write;
+
+/* Element change. Called for every value written through the library
+   (written = 1) or reported by ALSA (written = 0), from the thread that
+   caused it, with the card locked: be quick. values holds one value per
+   channel. Callbacks mustn't call back into the library; use
+   emutrix_event_fd() to react to changes with writes. */
+typedef void (*emutrix_change_callback)(emutrix_card * card, int id, const long * values,
+                                        int count, int written, void * data);
+
+/* EMUTRIX_API_VERSION the library was built with */
+EMUTRIX_EXPORT int emutrix_api_version(void);
+/* Description of the last error of the calling thread */
+EMUTRIX_EXPORT const char * emutrix_last_error(void);
+
+/* Opens card with ALSA index index, or the first E-mu card found if
+   index is -1. Every element's value is read once. */
+EMUTRIX_EXPORT int emutrix_open(emutrix_card ** card, int index, int flags);
+/* Closes the card. Subscriptions go with it. */
+EMUTRIX_EXPORT int emutrix_close(emutrix_card * card);
+/* Card name, e.g. "E-mu 1010 PCI" */
+EMUTRIX_EXPORT const char * emutrix_card_name(emutrix_card * card);
+
+/* Number of elements; ids go from 0 to this - 1 */
+EMUTRIX_EXPORT int emutrix_elements(emutrix_card * card);
+/* Element id by name and ALSA index, -ENOENT if the card hasn't got it.
+   Multichannel controls are several elements with the same name; the
+   index tells them apart, and is 0 for everything else. */
+EMUTRIX_EXPORT int emutrix_element_id(emutrix_card * card, const char * name, int index);
+EMUTRIX_EXPORT const char * emutrix_element_name(emutrix_card * card, int id);
+EMUTRIX_EXPORT int emutrix_element_index(emutrix_card * card, int id);
+/* EMUTRIX_BOOLEAN, ... */
+EMUTRIX_EXPORT int emutrix_element_type(emutrix_card * card, int id);
+/* Number of values (channels) */
+EMUTRIX_EXPORT int emutrix_element_channels(emutrix_card * card, int id);
+/* Integer range */
+EMUTRIX_EXPORT int emutrix_element_range(emutrix_card * card, int id, long * min, long * max);
+/* Number of enumeration items, 0 for other types */
+EMUTRIX_EXPORT int emutrix_element_items(emutrix_card * card, int id);
+EMUTRIX_EXPORT const char * emutrix_item_name(emutrix_card * card, int id, int item);
+
+/* Writes elements as one batch: nothing else is written to the card in
+   between, and subscribers see the changes together. Returns -EIO if any
+   write failed (the others are still done). */
+EMUTRIX_EXPORT int emutrix_write(emutrix_card * card, const emutrix_element_write * writes, int count);
+
+/* Snapshots: the last known values of all elements, as a flat array.
+   Element id's values start at emutrix_element_offset(), channels are
+   consecutive. Taken from the cache, so they cost no ioctl. */
+EMUTRIX_EXPORT int emutrix_snapshot_size(emutrix_card * card);
+EMUTRIX_EXPORT int emutrix_element_offset(emutrix_card * card, int id);
+/* Copies the snapshot to values, which holds size longs.
+   Returns the number of values copied. */
+EMUTRIX_EXPORT int emutrix_snapshot(emutrix_card * card, long * values, int size);
+/* Writes back, as one batch, the elements whose values differ from a
+   snapshot of the same card. Returns the number of elements written. */
+EMUTRIX_EXPORT int emutrix_restore(emutrix_card * card, const long * values, int size);
+
+/* Handles ALSA events (other programs changing the card), waiting up to
+   timeout ms for them. Changes are read back and reported to
+   subscribers. Call it in a loop, from one thread at a time.
+   Returns the number of events handled. */
+EMUTRIX_EXPORT int emutrix_handle_events(emutrix_card * card, int timeout);
+
+/* Calls callback on every change. Returns a subscription number. */
+EMUTRIX_EXPORT int emutrix_subscribe(emutrix_card * card, emutrix_change_callback callback, void * data);
+EMUTRIX_EXPORT int emutrix_unsubscribe(emutrix_card * card, int subscription);
+/* Descriptor that becomes readable when elements changed, for poll().
+   Changed ids are queued (each once) from the first call on; get them
+   with emutrix_read_changes(). Owned by the card. */
+EMUTRIX_EXPORT int emutrix_event_fd(emutrix_card * card);
+/* Takes up to max changed element ids from the queue, oldest first.
+   Returns how many, -EINVAL if max is negative or ids NULL. The descriptor stays readable while any are left. */
+EMUTRIX_EXPORT int emutrix_read_changes(emutrix_card * card, int * ids, int max);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* EMUTRIX_H */
@@ -0,0 +1,188 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* Layout of the emutrix shared memory state segment, and a small reader.
+   Plain C, so other programs (monitoring agents, session scripts through
+   an FFI) can use it without linking emutrix. Readers need no syscalls
+   after emutrix_shm_open(); consistency is guaranteed by a sequence lock.
+   Only real cards are published, virtual ones (traces) have no segment.
+
+   Segment "/emutrix.<card index>" holds:
+     struct emutrix_shm_header
+     struct emutrix_shm_element[header.elements]
+     int32_t values[header.values]
+   Element values are stored consecutively, starting at element.offset.
+   Routing and the clock rate are enumeration indices, see item names
+   with amixer or in emutrix. */
+
+#ifndef EMUTRIX_SHM_H
+#define EMUTRIX_SHM_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define EMUTRIX_SHM_MAGIC 0x58544d45u /* "EMTX" */
+#define EMUTRIX_SHM_VERSION 2
+#define EMUTRIX_SHM_NAME_LEN 44
+/* Spins emutrix_shm_snapshot() waits for the writer before giving up */
+#define EMUTRIX_SHM_RETRIES 1000000
+
+/* Element types, same values as snd_ctl_elem_type_t */
+#define EMUTRIX_SHM_BOOLEAN 1
+#define EMUTRIX_SHM_INTEGER 2
+#define EMUTRIX_SHM_ENUMERATED 3
+
+struct emutrix_shm_header
+{
+    uint32_t magic;
+    uint32_t version;
+    /* Sequence lock. Odd while emutrix is writing. */
+    volatile uint32_t seq;
+    /* Number of elements and values */
+    uint32_t elements;
+    uint32_t values;
+    /* ALSA card index and name */
+    int32_t card;
+    char card_name[64];
+};
+
+struct emutrix_shm_element
+{
+    char name[EMUTRIX_SHM_NAME_LEN];
+    /* ALSA index; multichannel controls share a name */
+    uint16_t index;
+    uint16_t count;
+    uint32_t offset;
+    int32_t min;
+    int32_t max;
+    uint8_t type;
+    uint8_t reserved[3];
+};
+
+/* A mapped segment, from emutrix_shm_open() */
+struct emutrix_shm
+{
+    struct emutrix_shm_header * header;
+    /* Size actually mapped */
+    size_t size;
+};
+
+/* Total segment size */
+static inline size_t emutrix_shm_size(uint32_t elements, uint32_t values)
+{
+    return sizeof(struct emutrix_shm_header)
+        + elements * sizeof(struct emutrix_shm_element)
+        + values * sizeof(int32_t);
+}
+
+static inline struct emutrix_shm_element * emutrix_shm_elements(struct emutrix_shm_header * h)
+{
+    return (struct emutrix_shm_element *)(h + 1);
+}
+
+static inline int32_t * emutrix_shm_values(struct emutrix_shm_header * h)
+{
+    return (int32_t *)(emutrix_shm_elements(h) + h->elements);
+}
+
+/* Map the segment of card index read-only. Returns NULL if emutrix isn't
+   publishing that card. Release with emutrix_shm_close(). */
+static inline struct emutrix_shm * emutrix_shm_open(int card)
+{
+    char name[32];
+    struct stat st;
+    struct emutrix_shm_header * h;
+    struct emutrix_shm * s;
+    int fd;
+    snprintf(name, sizeof(name), "/emutrix.%d", card);
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct emutrix_shm_header))
+    {
+        close(fd);
+        return NULL;
+    }
+    h = (struct emutrix_shm_header *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED)
+        return NULL;
+    if (h->magic != EMUTRIX_SHM_MAGIC || h->version != EMUTRIX_SHM_VERSION
+        || (size_t)st.st_size < emutrix_shm_size(h->elements, h->values))
+    {
+        munmap(h, st.st_size);
+        return NULL;
+    }
+    s = (struct emutrix_shm *)malloc(sizeof(struct emutrix_shm));
+    if (!s)
+    {
+        munmap(h, st.st_size);
+        return NULL;
+    }
+    s->header = h;
+    s->size = st.st_size;
+    return s;
+}
+
+static inline void emutrix_shm_close(struct emutrix_shm * s)
+{
+    munmap(s->header, s->size);
+    free(s);
+}
+
+/* Element number by name and ALSA index, -1 if not found. */
+static inline int emutrix_shm_find(struct emutrix_shm_header * h, const char * name, int index)
+{
+    uint32_t i;
+    for (i = 0; i < h->elements; i++)
+        if (!strncmp(emutrix_shm_elements(h)[i].name, name, EMUTRIX_SHM_NAME_LEN)
+            && emutrix_shm_elements(h)[i].index == index)
+            return i;
+    return -1;
+}
+
+/* Consistent copy of all values into out (header.values entries).
+   Retries while emutrix is writing; never blocks it. Returns 0, or
+   EAGAIN after EMUTRIX_SHM_RETRIES spins without a consistent copy (the
+   writer died or stalled half way through an update); out is garbage
+   then. */
+static inline int emutrix_shm_snapshot(struct emutrix_shm_header * h, int32_t * out)
+{
+    uint32_t seq;
+    long spins = 0;
+    do
+    {
+        while ((seq = h->seq) & 1)
+            if (++spins >= EMUTRIX_SHM_RETRIES)
+                return EAGAIN;
+        __sync_synchronize();
+        memcpy(out, emutrix_shm_values(h), h->values * sizeof(int32_t));
+        __sync_synchronize();
+        if (++spins >= EMUTRIX_SHM_RETRIES)
+            return EAGAIN;
+    } while (h->seq != seq);
+    return 0;
+}
+
+#endif /* EMUTRIX_SHM_H */
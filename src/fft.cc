@@ -0,0 +1,148 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "fft.h"
+#include "monotonic.h"
+#include <QDebug>
+#include <cassert>
+#include <cmath>
+
+Fft::Fft(int size)
+    : n(size), m(size / 2), window(size), scale(0), reversed(size / 2), re(size / 2), im(size / 2)
+{
+    assert(size >= 4 && (size & (size - 1)) == 0);
+    // Hann window
+    double sum = 0;
+    for (int i = 0; i < n; i++)
+    {
+        window[i] = 0.5 - 0.5 * cos(2 * M_PI * i / (n - 1));
+        sum += window[i];
+    }
+    // Single sided: amplitude is 2|X| / sum(window)
+    scale = 4 / (sum * sum);
+    int bits = 0;
+    while ((1 << bits) < m)
+        bits++;
+    for (int i = 0; i < m; i++)
+    {
+        int r = 0;
+        for (int b = 0; b < bits; b++)
+            if (i & (1 << b))
+                r |= 1 << (bits - 1 - b);
+        reversed[i] = r;
+    }
+    for (int len = 2; len <= m; len <<= 1)
+        for (int j = 0; j < len / 2; j++)
+        {
+            twiddleRe.append(cos(-2 * M_PI * j / len));
+            twiddleIm.append(sin(-2 * M_PI * j / len));
+        }
+    for (int k = 0; k <= m; k++)
+    {
+        splitRe.append(cos(-2 * M_PI * k / n));
+        splitIm.append(sin(-2 * M_PI * k / n));
+    }
+}
+
+/** One stage's butterflies of one block: a += w b, b = a - w b.
+    The loop the vectorizer cares about. GCC only trusts __restrict__ on
+    parameters, so it gets a function of its own.
+    */
+static void butterflies(float * __restrict__ ar, float * __restrict__ ai,
+                        float * __restrict__ br, float * __restrict__ bi,
+                        const float * __restrict__ wr, const float * __restrict__ wi, int half)
+{
+    for (int j = 0; j < half; j++)
+    {
+        float tr = br[j] * wr[j] - bi[j] * wi[j];
+        float ti = br[j] * wi[j] + bi[j] * wr[j];
+        br[j] = ar[j] - tr;
+        bi[j] = ai[j] - ti;
+        ar[j] += tr;
+        ai[j] += ti;
+    }
+}
+
+void Fft::transform()
+{
+    float * re = this->re.data();
+    float * im = this->im.data();
+    const float * wr = twiddleRe.constData();
+    const float * wi = twiddleIm.constData();
+    for (int len = 2; len <= m; len <<= 1)
+    {
+        int half = len / 2;
+        for (int start = 0; start < m; start += len)
+            butterflies(re + start, im + start, re + start + half, im + start + half, wr, wi, half);
+        wr += half;
+        wi += half;
+    }
+}
+
+void Fft::power(const float * in, float * power)
+{
+    float * re = this->re.data();
+    float * im = this->im.data();
+    const float * w = window.constData();
+    const int * r = reversed.constData();
+    // Even samples as real, odd as imaginary parts, windowed and in bit reversed order
+    for (int i = 0; i < m; i++)
+    {
+        re[r[i]] = in[2 * i] * w[2 * i];
+        im[r[i]] = in[2 * i + 1] * w[2 * i + 1];
+    }
+    transform();
+    // Split into the spectrum of the real block: X[k] = E[k] + W^k O[k]
+    const float * sr = splitRe.constData();
+    const float * si = splitIm.constData();
+    for (int k = 0; k <= m; k++)
+    {
+        int a = k % m;
+        int b = (m - k) % m;
+        float zr = re[a], zi = im[a];
+        float cr = re[b], ci = -im[b];
+        float er = (zr + cr) / 2, ei = (zi + ci) / 2;
+        // (Z - conj) / 2i
+        float or_ = (zi - ci) / 2, oi = -(zr - cr) / 2;
+        float xr = er + sr[k] * or_ - si[k] * oi;
+        float xi = ei + sr[k] * oi + si[k] * or_;
+        power[k] = (xr * xr + xi * xi) * scale;
+    }
+    // DC and Nyquist are not doubled
+    power[0] /= 4;
+    power[m] /= 4;
+}
+
+void Fft::benchmark()
+{
+    for (int size = 256; size <= 16384; size *= 2)
+    {
+        Fft fft(size);
+        QVector<float> in(size), out(size / 2 + 1);
+        for (int i = 0; i < size; i++)
+            in[i] = sin(i * 0.1) * 0.5;
+        // Enough runs for ~ 0.2 s each
+        int runs = qMax(10, 50000000 / (size * 20));
+        qint64 start = monotonicNs();
+        for (int r = 0; r < runs; r++)
+            fft.power(in.constData(), out.data());
+        qint64 ns = monotonicNs() - start;
+        double us = ns / 1000.0 / runs;
+        qDebug() << "FFT " << size << ": " << us << " us per block, "
+                 << size / us << " Msamples/s, " << (1e6 / us) << " blocks/s";
+    }
+}
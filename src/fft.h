@@ -0,0 +1,73 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef FFT_H
+#define FFT_H
+
+#include <QVector>
+
+/** Power spectrum of real blocks.
+    Windowed (Hann) real FFT, done as a complex radix-2 FFT of half the size.
+    All tables (window, twiddles per stage, bit reversal) and work buffers are
+    built by the constructor, so power() doesn't allocate. Real and imaginary
+    parts are kept in separate arrays, and each stage's twiddles are
+    contiguous, so the compiler vectorizes the butterfly loops (SSE, NEON).
+    fft.cc is built with -O3 for that, even in debug builds.
+    */
+class Fft
+{
+public:
+    /** Builds the tables.
+        @param size Block size, a power of two, at least 4
+        */
+    Fft(int size);
+
+    int size() const { return n; }
+    /** Power spectrum of a block.
+        Scaled so a full scale sine reads 1 (0 dB) in its bin.
+        @param in size() samples, full scale is 1
+        @param power size() / 2 + 1 bins, from DC to half the sample rate
+        */
+    void power(const float * in, float * power);
+
+    /** Prints transform times of block sizes 256 to 16384.
+        */
+    static void benchmark();
+
+private:
+    /// In place complex FFT of re/im, input in bit reversed order
+    void transform();
+
+    int n;
+    /// Half the size, that of the complex FFT
+    int m;
+    QVector<float> window;
+    /// Power scale, see power()
+    float scale;
+    /// Twiddles of all stages, one after the other
+    QVector<float> twiddleRe;
+    QVector<float> twiddleIm;
+    /// Twiddles of the real FFT split
+    QVector<float> splitRe;
+    QVector<float> splitIm;
+    /// Bit reversed index of each complex input
+    QVector<int> reversed;
+    QVector<float> re;
+    QVector<float> im;
+};
+
+#endif // FFT_H
@@ -0,0 +1,218 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "journal.h"
+#include <QMutexLocker>
+#include <QHash>
+#include <QDebug>
+#include "monotonic.h"
+
+/// Moves of the same fader closer than this are one undo step (ns)
+static const qint64 coalesceTime = 1000000000LL;
+
+Journal::Journal(SoundCard * card, int capacity)
+    : card(card), ring(capacity), first(0), cursor(0), end(0), stepStart(-1),
+      batch(0), newStep(true), lastId(-1), lastTime(0)
+{
+    card->addObserver(this);
+}
+
+Journal::~Journal()
+{
+    card->removeObserver(this);
+}
+
+bool Journal::canUndo()
+{
+    QMutexLocker locker(&mutex);
+    return cursor > first;
+}
+
+bool Journal::canRedo()
+{
+    QMutexLocker locker(&mutex);
+    return end > cursor;
+}
+
+Journal::Delta Journal::makeDelta(int id, unsigned int channel, long old, long now)
+{
+    Delta d;
+    d.id = (quint16)id;
+    d.channel = (quint8)channel;
+    d.flags = 0;
+    d.old = (qint32)old;
+    d.now = (qint32)now;
+    return d;
+}
+
+qint64 Journal::stepBefore(qint64 pos) const
+{
+    do
+        pos--;
+    while (pos > first && !(at(pos).flags & StepStart));
+    return pos;
+}
+
+void Journal::append(const Delta & d)
+{
+    if (end - first == ring.size())
+    {
+        // Room is made by whole steps, but never from the step being recorded
+        if (first == stepStart)
+        {
+            qDebug() << "Warning: Step too big for the undo journal, truncated";
+            return;
+        }
+        do
+            first++;
+        while (first < end && !(at(first).flags & StepStart));
+        if (cursor < first)
+            cursor = first;
+    }
+    at(end++) = d;
+}
+
+void Journal::batchStarted(const SoundCard *)
+{
+    QMutexLocker locker(&mutex);
+    if (batch++ == 0)
+        newStep = true;
+}
+
+void Journal::batchFinished(const SoundCard *)
+{
+    QMutexLocker locker(&mutex);
+    batch--;
+    // Nothing from a batch gets coalesced with what follows
+    lastId = -1;
+}
+
+void Journal::elementChanged(const SoundCard * c, const CardChange & change)
+{
+    // Only our own writes; undo/redo writes move the cursor instead
+    if (!change.written || change.origin == this)
+        return;
+    const ElementSchema & schema = c->getSchema();
+    unsigned int n = qMin(schema.count(change.id), 256u);
+    QMutexLocker locker(&mutex);
+    qint64 now = monotonicNs();
+    bool fader = schema.type(change.id) == SND_CTL_ELEM_TYPE_INTEGER;
+    if (!batch && fader && change.id == lastId && stepStart >= first && cursor == end
+        && now - lastTime < coalesceTime)
+    {
+        // Same fader again: update the last step
+        lastTime = now;
+        for (unsigned int i = 0; i < n; i++)
+        {
+            if (change.values[i] == change.old[i])
+                continue;
+            qint64 pos;
+            for (pos = stepStart; pos < end && at(pos).channel != i; pos++)
+                ;
+            if (pos < end)
+                at(pos).now = change.values[i];
+            else
+            {
+                append(makeDelta(change.id, i, change.old[i], change.values[i]));
+            }
+        }
+        return;
+    }
+    if (!batch)
+        newStep = true;
+    bool recorded = false;
+    for (unsigned int i = 0; i < n; i++)
+    {
+        if (change.values[i] == change.old[i])
+            continue;
+        Delta d = makeDelta(change.id, i, change.old[i], change.values[i]);
+        if (newStep)
+        {
+            // Recording drops whatever could be redone
+            end = cursor;
+            d.flags = StepStart;
+            stepStart = end;
+            newStep = false;
+        }
+        append(d);
+        recorded = true;
+    }
+    if (!batch)
+    {
+        lastId = recorded ? change.id : -1;
+        lastTime = now;
+    }
+}
+
+void Journal::apply(const Step & step, bool undoing)
+{
+    // Unchanged channels are written with their cached values
+    WriteBatch writes;
+    QHash<int, int> index;
+    for (int i = 0; i < step.size(); i++)
+    {
+        // Undo walks the step backwards, so the oldest value wins
+        const Delta & d = step[undoing ? step.size() - 1 - i : i];
+        if (!index.contains(d.id))
+        {
+            ElementWrite w;
+            w.id = d.id;
+            w.values = card->getCached(d.id);
+            index.insert(d.id, writes.size());
+            writes.append(w);
+        }
+        ElementWrite & w = writes[index.value(d.id)];
+        if (d.channel < w.values.size())
+            w.values[d.channel] = undoing ? d.old : d.now;
+    }
+    card->writeBatch(writes, this);
+}
+
+bool Journal::undo()
+{
+    Step step;
+    {
+        QMutexLocker locker(&mutex);
+        if (cursor == first)
+            return false;
+        qint64 start = stepBefore(cursor);
+        for (qint64 pos = start; pos < cursor; pos++)
+            step.append(at(pos));
+        cursor = start;
+        lastId = -1;
+    }
+    // Not holding our lock: the card calls us back with its own lock held
+    apply(step, true);
+    return true;
+}
+
+bool Journal::redo()
+{
+    Step step;
+    {
+        QMutexLocker locker(&mutex);
+        if (cursor == end)
+            return false;
+        qint64 pos = cursor;
+        do
+            step.append(at(pos++));
+        while (pos < end && !(at(pos).flags & StepStart));
+        cursor = pos;
+        lastId = -1;
+    }
+    apply(step, false);
+    return true;
+}
@@ -0,0 +1,103 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <QVector>
+#include <QMutex>
+#include "soundcard.h"
+
+/** Undo/redo journal for a card.
+    Records the writes done by emutrix (not changes from other ALSA clients)
+    as deltas: element, channel, old and new value. Deltas are kept in a
+    fixed size ring buffer; when it is full, the oldest steps are dropped.
+    A batch (e.g. a stereo pair, a preset) is a single step, and is undone
+    in one batch. Consecutive moves of the same fader are coalesced into a
+    single step, so a fader sweep doesn't flood the journal.
+    */
+class Journal : public CardObserver
+{
+public:
+    /** Registers with the card.
+        @param card Card to follow
+        @param capacity Number of deltas to keep
+        */
+    Journal(SoundCard * card, int capacity = 4096);
+    /** Unregisters from the card. */
+    ~Journal();
+
+    bool canUndo();
+    bool canRedo();
+    /** Reverts the last step.
+        @return false if there was nothing to undo.
+        */
+    bool undo();
+    /** Applies again the last undone step.
+        @return false if there was nothing to redo.
+        */
+    bool redo();
+
+    void elementChanged(const SoundCard * card, const CardChange & change);
+    void batchStarted(const SoundCard * card);
+    void batchFinished(const SoundCard * card);
+
+private:
+    /// One channel of one element changed
+    struct Delta
+    {
+        quint16 id;
+        quint8 channel;
+        /// StepStart on the first delta of each step
+        quint8 flags;
+        qint32 old;
+        qint32 now;
+    };
+    enum { StepStart = 1 };
+
+    /// Deltas of one step, copied out of the ring
+    typedef QVector<Delta> Step;
+
+    static Delta makeDelta(int id, unsigned int channel, long old, long now);
+    /// Append a delta, dropping the oldest steps if there is no room
+    void append(const Delta & d);
+    /// Find the start of the step that ends before pos
+    qint64 stepBefore(qint64 pos) const;
+    /// Write step values to the card as one batch
+    void apply(const Step & step, bool undoing);
+    Delta & at(qint64 pos) { return ring[pos % ring.size()]; }
+    const Delta & at(qint64 pos) const { return ring[pos % ring.size()]; }
+
+    SoundCard * card;
+    QVector<Delta> ring;
+    /** Positions in the ring, ever increasing.
+        [first, cursor) can be undone, [cursor, end) can be redone.
+        */
+    qint64 first, cursor, end;
+    /// Start of the step being recorded or last recorded, -1 if none
+    qint64 stepStart;
+    /// Nesting level of batches
+    int batch;
+    /// A new step must start with the next delta
+    bool newStep;
+    /// Element of the last single-write step, to coalesce fader moves
+    int lastId;
+    /// When the last single-write step was recorded (ns)
+    qint64 lastTime;
+    QMutex mutex;
+};
+
+#endif // JOURNAL_H
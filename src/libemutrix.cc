@@ -0,0 +1,424 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "emutrix.h"
+#include "soundcard.h"
+#include <QByteArray>
+#include <QList>
+#include <QPair>
+#include <QVector>
+#include <QBitArray>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QThreadStorage>
+#include <QtAlgorithms>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+/// Last error of each thread, see emutrix_last_error()
+static QThreadStorage<QByteArray *> lastError;
+
+/// Remembers an error for emutrix_last_error(). @return err
+static int fail(int err, const QString & msg)
+{
+    if (!lastError.hasLocalData())
+        lastError.setLocalData(new QByteArray);
+    *lastError.localData() = msg.toLocal8Bit();
+    return err;
+}
+
+/// A subscription: calls back on every change
+class CallbackObserver : public CardObserver
+{
+public:
+    CallbackObserver(emutrix_card * handle, emutrix_change_callback callback, void * data)
+        : handle(handle), callback(callback), data(data) {}
+
+    void elementChanged(const SoundCard * card, const CardChange & change)
+    {
+        callback(handle, change.id, change.values, card->getSchema().count(change.id),
+                 change.written, data);
+    }
+
+private:
+    emutrix_card * handle;
+    emutrix_change_callback callback;
+    void * data;
+};
+
+/** Changed element ids, for emutrix_read_changes().
+    Each id is queued once until read; the eventfd is readable while the
+    queue isn't empty.
+    */
+class QueueObserver : public CardObserver
+{
+public:
+    QueueObserver(int elements)
+        : fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+    {
+        queued.resize(elements);
+        ids.reserve(elements);
+    }
+    ~QueueObserver()
+    {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    void elementChanged(const SoundCard *, const CardChange & change)
+    {
+        QMutexLocker locker(&lock);
+        if (queued.testBit(change.id))
+            return;
+        queued.setBit(change.id);
+        ids.append(change.id);
+        // Readable from the first change on
+        if (ids.size() == 1)
+        {
+            uint64_t one = 1;
+            if (write(fd, &one, sizeof(one)) < 0)
+                qDebug("Warning: Couldn't signal element changes");
+        }
+    }
+
+    /// Takes up to max ids. @return How many.
+    int take(int * out, int max)
+    {
+        QMutexLocker locker(&lock);
+        int n = qMin(max, ids.size());
+        for (int i = 0; i < n; i++)
+        {
+            out[i] = ids.at(i);
+            queued.clearBit(out[i]);
+        }
+        ids.remove(0, n);
+        // Not readable until the next change
+        if (n && ids.isEmpty())
+        {
+            uint64_t count;
+            if (read(fd, &count, sizeof(count)) < 0)
+                qDebug("Warning: Couldn't reset element change descriptor");
+        }
+        return n;
+    }
+
+    const int fd;
+
+private:
+    QMutex lock;
+    QBitArray queued;
+    QVector<int> ids;
+};
+
+struct emutrix_card
+{
+    SoundCard * card;
+    QByteArray name;
+    /// Element and item names, as C strings
+    QList<QByteArray> names;
+    QList<QByteArray> items;
+    /// Position of each element's first item in items
+    QVector<int> firstItem;
+    /// By subscription number, NULL once unsubscribed
+    QList<CallbackObserver *> subscriptions;
+    /// Created by emutrix_event_fd()
+    QueueObserver * queue;
+    /// Guards subscriptions and queue
+    QMutex lock;
+};
+
+/// Checks an element id. @return false (and remembers why) if not valid
+static bool validId(emutrix_card * c, int id)
+{
+    if (id >= 0 && id < c->names.size())
+        return true;
+    fail(-EINVAL, QString("No element %1").arg(id));
+    return false;
+}
+
+int emutrix_api_version(void)
+{
+    return EMUTRIX_API_VERSION;
+}
+
+const char * emutrix_last_error(void)
+{
+    return lastError.hasLocalData() ? lastError.localData()->constData() : "";
+}
+
+int emutrix_open(emutrix_card ** card, int index, int flags)
+{
+    *card = NULL;
+    SoundCard * c = NULL;
+    try
+    {
+        if (index < 0)
+        {
+            QList<QPair<QString, int> > cards = SoundCard::getCardList();
+            if (cards.isEmpty())
+                return fail(-ENODEV, "No E-mu card found.");
+            index = cards.first().second;
+        }
+        c = new SoundCard(index, flags & EMUTRIX_OPEN_DEFAULTS);
+        // No view, just ALSA callbacks, for every element
+        c->setupCallbacks(NULL);
+        c->watchAll();
+        c->setRateResync(flags & EMUTRIX_OPEN_RESYNC);
+    }
+    catch(QString err)
+    {
+        delete c;
+        return fail(-EIO, err);
+    }
+    emutrix_card * h = new emutrix_card;
+    h->card = c;
+    h->name = c->getName().toLocal8Bit();
+    h->queue = NULL;
+    const ElementSchema & schema = c->getSchema();
+    h->firstItem.reserve(schema.size());
+    for (int id = 0; id < schema.size(); id++)
+    {
+        h->names.append(schema.name(id).toLocal8Bit());
+        h->firstItem.append(h->items.size());
+        for (unsigned int i = 0; i < schema.items(id); i++)
+            h->items.append(schema.itemName(id, i).toLocal8Bit());
+    }
+    *card = h;
+    return 0;
+}
+
+int emutrix_close(emutrix_card * card)
+{
+    for (QList<CallbackObserver *>::iterator it = card->subscriptions.begin(); it != card->subscriptions.end(); ++it)
+        if (*it)
+        {
+            card->card->removeObserver(*it);
+            delete *it;
+        }
+    if (card->queue)
+        card->card->removeObserver(card->queue);
+    delete card->queue;
+    delete card->card;
+    delete card;
+    return 0;
+}
+
+const char * emutrix_card_name(emutrix_card * card)
+{
+    return card->name.constData();
+}
+
+int emutrix_elements(emutrix_card * card)
+{
+    return card->names.size();
+}
+
+int emutrix_element_id(emutrix_card * card, const char * name, int index)
+{
+    int id = card->card->getSchema().id(QString::fromLocal8Bit(name), index);
+    return id >= 0 ? id : fail(-ENOENT, QString("No element %1[%2]").arg(name).arg(index));
+}
+
+const char * emutrix_element_name(emutrix_card * card, int id)
+{
+    return validId(card, id) ? card->names.at(id).constData() : NULL;
+}
+
+int emutrix_element_index(emutrix_card * card, int id)
+{
+    return validId(card, id) ? card->card->getSchema().index(id) : -EINVAL;
+}
+
+int emutrix_element_type(emutrix_card * card, int id)
+{
+    return validId(card, id) ? (int)card->card->getSchema().type(id) : -EINVAL;
+}
+
+int emutrix_element_channels(emutrix_card * card, int id)
+{
+    return validId(card, id) ? (int)card->card->getSchema().count(id) : -EINVAL;
+}
+
+int emutrix_element_range(emutrix_card * card, int id, long * min, long * max)
+{
+    if (!validId(card, id))
+        return -EINVAL;
+    *min = card->card->getSchema().min(id);
+    *max = card->card->getSchema().max(id);
+    return 0;
+}
+
+int emutrix_element_items(emutrix_card * card, int id)
+{
+    return validId(card, id) ? (int)card->card->getSchema().items(id) : -EINVAL;
+}
+
+const char * emutrix_item_name(emutrix_card * card, int id, int item)
+{
+    if (!validId(card, id))
+        return NULL;
+    if (item < 0 || item >= (int)card->card->getSchema().items(id))
+    {
+        fail(-EINVAL, QString("No item %1").arg(item));
+        return NULL;
+    }
+    return card->items.at(card->firstItem.at(id) + item).constData();
+}
+
+int emutrix_write(emutrix_card * card, const emutrix_element_write * writes, int count)
+{
+    WriteBatch batch;
+    for (int i = 0; i < count; i++)
+    {
+        if (!validId(card, writes[i].id))
+            return -EINVAL;
+        if (writes[i].count <= 0 || !writes[i].values)
+            return fail(-EINVAL, "No values to write");
+        ElementWrite w;
+        w.id = writes[i].id;
+        w.values.resize(writes[i].count);
+        qCopy(writes[i].values, writes[i].values + writes[i].count, w.values.begin());
+        batch.append(w);
+    }
+    try
+    {
+        if (!card->card->writeBatch(batch))
+            return fail(-EIO, "ALSA refused a write");
+    }
+    catch(QString err)
+    {
+        return fail(-EIO, err);
+    }
+    return 0;
+}
+
+int emutrix_snapshot_size(emutrix_card * card)
+{
+    return card->card->getSchema().valueCount();
+}
+
+int emutrix_element_offset(emutrix_card * card, int id)
+{
+    return validId(card, id) ? card->card->getSchema().offset(id) : -EINVAL;
+}
+
+int emutrix_snapshot(emutrix_card * card, long * values, int size)
+{
+    QVector<long> state = card->card->getCachedState();
+    int n = qBound(0, size, state.size());
+    qCopy(state.constBegin(), state.constBegin() + n, values);
+    return n;
+}
+
+int emutrix_restore(emutrix_card * card, const long * values, int size)
+{
+    const ElementSchema & schema = card->card->getSchema();
+    if (size != schema.valueCount())
+        return fail(-EINVAL, "Snapshot doesn't match the card");
+    QVector<long> state = card->card->getCachedState();
+    WriteBatch batch;
+    for (int id = 0; id < schema.size(); id++)
+    {
+        const long * v = values + schema.offset(id);
+        if (qEqual(v, v + schema.count(id), state.constBegin() + schema.offset(id)))
+            continue;
+        ElementWrite w;
+        w.id = id;
+        w.values.resize(schema.count(id));
+        qCopy(v, v + schema.count(id), w.values.begin());
+        batch.append(w);
+    }
+    try
+    {
+        if (!card->card->writeBatch(batch))
+            return fail(-EIO, "ALSA refused a write");
+    }
+    catch(QString err)
+    {
+        return fail(-EIO, err);
+    }
+    return batch.size();
+}
+
+int emutrix_handle_events(emutrix_card * card, int timeout)
+{
+    try
+    {
+        int events = card->card->processEvents(timeout);
+        // No view to update, but the changes are done with
+        card->card->updateWindow();
+        return events;
+    }
+    catch(QString err)
+    {
+        return fail(-EIO, err);
+    }
+}
+
+int emutrix_subscribe(emutrix_card * card, emutrix_change_callback callback, void * data)
+{
+    CallbackObserver * o = new CallbackObserver(card, callback, data);
+    // Not under card->lock: the card takes its own lock, which callbacks
+    // are called with
+    card->card->addObserver(o);
+    QMutexLocker locker(&card->lock);
+    card->subscriptions.append(o);
+    return card->subscriptions.size() - 1;
+}
+
+int emutrix_unsubscribe(emutrix_card * card, int subscription)
+{
+    QMutexLocker locker(&card->lock);
+    if (subscription < 0 || subscription >= card->subscriptions.size() || !card->subscriptions.at(subscription))
+        return fail(-EINVAL, QString("No subscription %1").arg(subscription));
+    CallbackObserver * o = card->subscriptions.at(subscription);
+    card->subscriptions[subscription] = NULL;
+    locker.unlock();
+    // Once removed, it isn't being called either
+    card->card->removeObserver(o);
+    delete o;
+    return 0;
+}
+
+int emutrix_event_fd(emutrix_card * card)
+{
+    QMutexLocker locker(&card->lock);
+    if (card->queue)
+        return card->queue->fd;
+    QueueObserver * q = new QueueObserver(card->names.size());
+    if (q->fd < 0)
+    {
+        delete q;
+        return fail(-errno, "Couldn't create an eventfd");
+    }
+    card->queue = q;
+    locker.unlock();
+    card->card->addObserver(q);
+    return q->fd;
+}
+
+int emutrix_read_changes(emutrix_card * card, int * ids, int max)
+{
+    if (max < 0 || (max > 0 && !ids))
+        return fail(-EINVAL, "Bad change buffer");
+    QMutexLocker locker(&card->lock);
+    if (!card->queue)
+        return fail(-EINVAL, "No event descriptor, see emutrix_event_fd()");
+    return card->queue->take(ids, max);
+}
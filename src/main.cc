@@ -16,14 +16,96 @@
 
 #include <QtGui/QApplication>
 #include <QtDebug>
+#include <QStringList>
+#include <QTimer>
+#include <time.h>
+#include "controlthread.h"
+#include "fft.h"
+#include "correlator.h"
+#include "shmstate.h"
 #include "mainwindow.h"
 
 int main(int argc, char *argv[])
 {
     QApplication a(argc, argv);
     a.setApplicationName(APPLICATION_NAME);
+    // Settings go to ~/.config/emutrix/emutrix.conf
+    a.setOrganizationName(APPLICATION_NAME);
     qDebug() << "Starting " << APPLICATION_NAME << "...";
+    // --fft-bench: print analyzer FFT throughput per block size and quit
+    if (a.arguments().contains("--fft-bench"))
+    {
+        Fft::benchmark();
+        return 0;
+    }
+    // --correlator-test: check the route test's signal detection on synthetic recordings
+    if (a.arguments().contains("--correlator-test"))
+        return Correlator::selfTest() ? 0 : 1;
+    // --shm-bench CARD: compare shared memory snapshots of a running emutrix with amixer
+    int shmBench = a.arguments().indexOf("--shm-bench");
+    if (shmBench > 0 && shmBench + 1 < a.arguments().size())
+        return ShmState::benchmark(a.arguments().at(shmBench + 1).toInt()) ? 0 : 1;
     MainWindow w;
+    // --link-test: count the writes of linked matrix clicks on a virtual card
+    if (a.arguments().contains("--link-test"))
+        return w.linkTest() ? 0 : 1;
+    // --record FILE: trace card events and writes
+    // --replay FILE [--fast]: play a trace on a virtual card
+    // --cues FILE: run a cue list on the card
+    // --import FILE: restore an alsactl state file (parse/apply times are printed)
+    // --write-latency US: make writes to virtual cards take a while
+    // --hog N: keep N threads busy; --bench SECONDS: quit after a while
+    // --stress SECONDS [--seed N]: stress test on a virtual card, see StressTest
+    // --analyze FILE: show the analyzer on a WAV file
+    // --route-test: round trip test of a route once the card is ready, see RouteTest
+    // --osc-load SECONDS [--osc-bundle N]: OSC throughput and latency test, see OscControl
+    // (control thread latency is printed on exit)
+    QStringList args = a.arguments();
+    int hog = args.indexOf("--hog");
+    if (hog > 0 && hog + 1 < args.size())
+        for (int i = 0; i < args.at(hog + 1).toInt(); i++)
+            (new CpuHog(&a))->start(QThread::LowPriority);
+    int cues = args.indexOf("--cues");
+    if (cues > 0 && cues + 1 < args.size())
+        w.runCues(args.at(cues + 1));
+    int import = args.indexOf("--import");
+    if (import > 0 && import + 1 < args.size())
+        w.importAlsaState(args.at(import + 1));
+    int analyze = args.indexOf("--analyze");
+    if (analyze > 0 && analyze + 1 < args.size())
+        w.analyzeFile(args.at(analyze + 1));
+    int osc = args.indexOf("--osc-load");
+    int bundle = args.indexOf("--osc-bundle");
+    if (osc > 0 && osc + 1 < args.size())
+        w.oscLoad(args.at(osc + 1).toInt(), bundle > 0 && bundle + 1 < args.size() ? args.at(bundle + 1).toInt() : 8);
+    if (args.contains("--route-test"))
+        w.routeTestWhenReady();
+    int latency = args.indexOf("--write-latency");
+    if (latency > 0 && latency + 1 < args.size())
+        w.simulateLatency(args.at(latency + 1).toInt());
+    int bench = args.indexOf("--bench");
+    if (bench > 0 && bench + 1 < args.size())
+        QTimer::singleShot(args.at(bench + 1).toInt() * 1000, &a, SLOT(quit()));
+    int record = args.indexOf("--record");
+    int replay = args.indexOf("--replay");
+    if (record > 0 && record + 1 < args.size())
+        w.record(args.at(record + 1));
+    int stress = args.indexOf("--stress");
+    int seed = args.indexOf("--seed");
+    if (stress > 0 && stress + 1 < args.size())
+        w.stressTest(args.at(stress + 1).toInt(),
+                     seed > 0 && seed + 1 < args.size() ? args.at(seed + 1).toUInt() : (uint)time(NULL));
+    else if (replay > 0 && replay + 1 < args.size())
+        w.replay(args.at(replay + 1), args.contains("--fast"));
+    else
+        w.openCards();
+    // Control surfaces are for people at the mixer, not for test runs
+    bool testing = args.contains("--route-test") || stress > 0 || replay > 0 || bench > 0;
+    if (!testing)
+    {
+        w.startMidi();
+        w.startOsc();
+    }
     try
     {
         w.show();
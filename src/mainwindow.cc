@@ -20,47 +20,226 @@
 #include <QErrorMessage>
 #include <QDebug>
 #include "soundcard.h"
+#include "cardloader.h"
+#include "midicontrol.h"
+#include "osccontrol.h"
+#include "shmstate.h"
+#include "journal.h"
+#include "trace.h"
+#include "verifier.h"
+#include "autosave.h"
+#include "controlthread.h"
+#include "cuelist.h"
+#include "cardgroup.h"
+#include "alsastate.h"
+#include "controlbindings.h"
+#include "stresstest.h"
+#include "spectrumview.h"
+#include "routetest.h"
+#include <QAction>
+#include <QDockWidget>
+#include <QFileDialog>
+#include <QMessageBox>
 
 MainWindow::MainWindow(QWidget *parent)
-    : QMainWindow(parent), ui(new Ui::MainWindow), card(NULL)
+    : QMainWindow(parent), ui(new Ui::MainWindow), card(NULL), loader(new CardLoader(this)), group(NULL),
+      midi(new MidiControl(this)), osc(new OscControl(this)),
+      oscLoadSeconds(0), oscLoadBundle(0), control(NULL), shm(NULL), journal(NULL), verifier(NULL),
+      autosave(NULL),
+      cues(NULL), latency(0),
+      recorder(NULL), player(NULL), replayFast(false), stress(NULL),
+      spectrum(NULL), routeTester(NULL), routeTestPending(false)
 {
     qDebug("Setting up UI...");
     // Qt creator magic
     ui->setupUi(this);
-    QComboBox * cardsBox = this->findChild<QComboBox*>("card");
     // Hide "setup" (that is, extended settings, frame)
     this->findChild<QWidget*>("setupWidget")->setVisible(false);
 
-    try
+    // Cards are enumerated and opened in the background. Until one is
+    // ready, the matrix is shown, but disabled.
+    connect(loader, SIGNAL(progress(QString)), this, SLOT(loaderProgress(QString)));
+    connect(loader, SIGNAL(cardFound(QString,int)), this, SLOT(loaderCardFound(QString,int)));
+    connect(loader, SIGNAL(cardReady(SoundCard*)), this, SLOT(loaderCardReady(SoundCard*)));
+    connect(loader, SIGNAL(failed(QString)), this, SLOT(loaderFailed(QString)));
+    // Bound widgets all go through the same slots, see controlbindings.h
+    bindingWidgets.fill(NULL, controlBindingCount);
+    levelLabels.fill(NULL, controlBindingCount);
+    for (int row = 0; row < controlBindingCount; row++)
     {
-        QList<QPair<QString, int> > cards = SoundCard::getCardList();
-        for (QList<QPair<QString, int> >::iterator it = cards.begin();
-            it != cards.end();
-            ++it)
-            cardsBox->addItem(it->first, it->second);
-
-        if (cardsBox->count() == 0)
+        QObject * widget = findChild<QObject *>(controlBindings[row].widget);
+        if (!widget)
         {
-            throw tr("Sorry! No EMU 1010 based cards found.");
-            return;
+            qDebug() << "Warning: No widget " << controlBindings[row].widget
+                     << " for " << controlBindings[row].element;
+            continue;
+        }
+        bindingWidgets[row] = widget;
+        bindingRows.insert(widget, row);
+        switch (controlBindings[row].kind)
+        {
+        case ControlBinding::Routing:
+            connect(widget, SIGNAL(buttonClicked(int)), this, SLOT(bindingChanged(int)));
+            break;
+        case ControlBinding::Switch:
+            connect(widget, SIGNAL(toggled(bool)), this, SLOT(bindingToggled(bool)));
+            break;
+        case ControlBinding::Level:
+            connect(widget, SIGNAL(valueChanged(int)), this, SLOT(bindingChanged(int)));
+            levelLabels[row] = findChild<QLabel *>(QString(controlBindings[row].widget) + "db");
+            break;
+        case ControlBinding::Item:
+            connect(widget, SIGNAL(currentIndexChanged(int)), this, SLOT(bindingChanged(int)));
+            break;
         }
     }
-    catch (QString err)
+    // No menus, so undo/redo are window wide shortcuts
+    QAction * undo = new QAction(tr("Undo"), this);
+    undo->setShortcuts(QKeySequence::Undo);
+    connect(undo, SIGNAL(triggered()), this, SLOT(undo()));
+    addAction(undo);
+    QAction * redo = new QAction(tr("Redo"), this);
+    redo->setShortcuts(QKeySequence::Redo);
+    connect(redo, SIGNAL(triggered()), this, SLOT(redo()));
+    addAction(redo);
+    QAction * import = new QAction(tr("Import state"), this);
+    import->setShortcuts(QKeySequence::Open);
+    connect(import, SIGNAL(triggered()), this, SLOT(importState()));
+    addAction(import);
+    QAction * save = new QAction(tr("Export state"), this);
+    save->setShortcuts(QKeySequence::Save);
+    connect(save, SIGNAL(triggered()), this, SLOT(exportState()));
+    addAction(save);
+    // Analyzer, hidden until needed; it only runs while visible
+    spectrum = new SpectrumView(this);
+    QDockWidget * dock = new QDockWidget(tr("Analyzer"), this);
+    dock->setObjectName("analyzer");
+    dock->setWidget(spectrum);
+    addDockWidget(Qt::BottomDockWidgetArea, dock);
+    dock->hide();
+    connect(dock, SIGNAL(visibilityChanged(bool)), spectrum, SLOT(setActive(bool)));
+    QAction * analyzer = dock->toggleViewAction();
+    analyzer->setShortcut(Qt::Key_F8);
+    addAction(analyzer);
+    QAction * selfTest = new QAction(tr("Route self-test"), this);
+    selfTest->setShortcut(Qt::Key_F9);
+    connect(selfTest, SIGNAL(triggered()), this, SLOT(routeTest()));
+    addAction(selfTest);
+    setConnecting(true);
+    if (ControlThread::enabled())
     {
-        showError(err);
+        control = new ControlThread(this);
+        connect(control, SIGNAL(failed(QString)), this, SLOT(controlFailed(QString)));
+        control->start();
     }
-    cardsBox->setCurrentIndex(0); // Calls code to initialize first card.
-    startTimer(0);
+    // Without a control thread, the timer waits for ALSA events
+    startTimer(control ? 10 : 0);
 }
 
 MainWindow::~MainWindow()
 {
     qDebug("Cleaning up...");
-    if (card)
-        delete card;
+    // Let a pending load and MIDI writes finish before the card is freed
+    loader->wait();
+    midi->stop();
+    midi->wait();
+    osc->stop();
+    osc->wait();
+    if (control)
+    {
+        control->stop();
+        control->wait();
+    }
+    // Its client thread writes to the card
+    delete stress;
+    stress = NULL;
+    closeCard();
     delete ui;
 }
 
+void MainWindow::openCards()
+{
+    loader->enumerate();
+}
+
+void MainWindow::record(const QString & path)
+{
+    recordPath = path;
+}
+
+void MainWindow::replay(const QString & path, bool fast)
+{
+    try
+    {
+        player = new TracePlayer(path);
+    }
+    catch (QString err)
+    {
+        showError(err);
+        return;
+    }
+    replayFast = fast;
+    loaderCardReady(player->createCard());
+}
+
+void MainWindow::useCard(SoundCard * c)
+{
+    closeCard();
+    loaderCardReady(c);
+}
+
+void MainWindow::stressTest(int seconds, uint seed)
+{
+    stress = new StressTest(this, seconds, seed);
+    loaderCardReady(stress->createCard());
+    stress->start(card);
+}
+
+void MainWindow::routeTestWhenReady()
+{
+    routeTestPending = true;
+}
+
+void MainWindow::startMidi()
+{
+    midi->start();
+}
+
+void MainWindow::startOsc()
+{
+    if (!osc->isRunning() && !osc->isFinished())
+        osc->start();
+}
+
+void MainWindow::oscLoad(int seconds, int bundle)
+{
+    // The load goes through the listening socket
+    startOsc();
+    oscLoadSeconds = seconds;
+    oscLoadBundle = bundle;
+}
+
+void MainWindow::analyzeFile(const QString & path)
+{
+    spectrum->setFile(path);
+    spectrum->parentWidget()->show();
+}
+
+void MainWindow::runCues(const QString & path)
+{
+    cuePath = path;
+}
+
+void MainWindow::importAlsaState(const QString & path)
+{
+    importPath = path;
+}
+
+void MainWindow::simulateLatency(int us)
+{
+    latency = us;
+}
+
 ////////// ERROR HANDLING
 void MainWindow::showError(const QString & msg)
 {
@@ -94,39 +273,288 @@ void MainWindow::matrixSetVisible(const int rows[], const int cols[], bool visib
         }
 }
 
-//// HELPER FUNCTIONS
+void MainWindow::closeCard()
+{
+    midi->setCard(NULL);
+    osc->setCard(NULL);
+    if (control)
+        control->setCard(NULL);
+    delete cues;
+    cues = NULL;
+    delete group;
+    group = NULL;
+    // Waits for a test in progress, which restores the routing
+    delete routeTester;
+    routeTester = NULL;
+    delete verifier;
+    verifier = NULL;
+    delete autosave;
+    autosave = NULL;
+    delete player;
+    player = NULL;
+    delete recorder;
+    recorder = NULL;
+    delete journal;
+    journal = NULL;
+    delete shm;
+    shm = NULL;
+    delete card;
+    card = NULL;
+}
 
-void MainWindow::timerEvent(QTimerEvent *)
+void MainWindow::writeLinked(const QList<QPair<QString, QVector<long> > > & batch)
 {
-    card->updateCallbacks();
+    if (!group)
+    {
+        WriteBatch writes;
+        const ElementSchema & schema = card->getSchema();
+        for (QList<QPair<QString, QVector<long> > >::const_iterator it = batch.begin(); it != batch.end(); ++it)
+        {
+            ElementWrite w;
+            w.id = schema.find(it->first);
+            w.values = it->second;
+            writes.append(w);
+        }
+        card->writeBatch(writes);
+    }
+    else if (!group->apply(batch))
+        ui->statusBar->showMessage(tr("A linked card failed, change undone on all cards"), 5000);
 }
 
-void MainWindow::checkLinked(QButtonGroup * bg, QButtonGroup * linked, QButtonGroup * linkedr)
+void MainWindow::loadAlsaState(const QString & path)
 {
-    // L-R link enabled?
-    if (!ui->link->isChecked())
+    AlsaState state(card);
+    try
+    {
+        state.load(path);
+    }
+    catch (QString err)
+    {
+        showError(err);
         return;
-    int ix = bg->checkedId();
+    }
+    if (!state.apply())
+        ui->statusBar->showMessage(tr("Some elements of %1 couldn't be restored").arg(path), 5000);
+    else
+        ui->statusBar->showMessage(tr("Restored %1: %2 of %3 elements changed")
+                                   .arg(path).arg(state.changes()).arg(state.known()), 5000);
+}
+
+void MainWindow::setConnecting(bool connecting)
+{
+    ui->matrix->setEnabled(!connecting);
+    ui->master->setEnabled(!connecting);
+    ui->panic->setEnabled(!connecting);
+    ui->rate->setEnabled(!connecting);
+    ui->card->setEnabled(!connecting);
+    ui->groupBox->setEnabled(!connecting);
+    ui->groupBox_2->setEnabled(!connecting);
+}
+
+//// CARD LOADER SLOTS
+
+void MainWindow::loaderProgress(const QString & msg)
+{
+    ui->statusBar->showMessage(msg);
+}
 
-    if (ix == -2);
-    else if (linked && linked->objectName().endsWith('l'))
-        ix++;
-    else if(linked && linked->objectName().endsWith('r'))
-        ix--;
-    /// make this work for input channels. -- not quite sure if this is the right behavior
-    else if (-ix >= 5 && -ix <= 14 && -ix % 2 == 0) // checked an even id => right channel
+void MainWindow::loaderCardFound(const QString & name, int index)
+{
+    // Card is opened by the loader itself, so don't fire currentIndexChanged
+    ui->card->blockSignals(true);
+    ui->card->addItem(name, index);
+    ui->card->blockSignals(false);
+}
+
+void MainWindow::loaderCardReady(SoundCard * c)
+{
+    card = c;
+    levelSetScales();
+    rateSetItems();
+    card->setupCallbacks(this);
+    matrixSetSources();
+    midi->setCard(card);
+    osc->setCard(card);
+    if (routeTestPending)
+    {
+        routeTestPending = false;
+        routeTest();
+    }
+    if (oscLoadSeconds > 0)
+    {
+        osc->generateLoad(oscLoadSeconds, oscLoadBundle);
+        oscLoadSeconds = 0;
+    }
+    spectrum->setCard(card->isVirtual() ? -1 : card->getIndex());
+    if (control)
+        control->setCard(card);
+    shm = new ShmState(card);
+    journal = new Journal(card);
+    verifier = new DriftVerifier(card, this);
+    verifier->start(QThread::LowestPriority);
+    if (!card->isVirtual())
+    {
+        autosave = new Autosave(card, this);
+        connect(autosave, SIGNAL(recovered(int)), this, SLOT(autosaveRecovered(int)));
+        autosave->start(QThread::LowPriority);
+    }
+    if (!recordPath.isEmpty())
+        recorder = new TraceRecorder(card, recordPath);
+    if (card->isVirtual())
+        card->setSimulatedLatency(latency);
+    QList<int> linked = CardGroup::linkedCards();
+    linked.removeAll(card->getIndex());
+    if (!linked.isEmpty() && !card->isVirtual())
+    {
+        // Opened on the group's threads; the window is usable meanwhile
+        group = new CardGroup(card);
+        group->open(linked);
+    }
+    if (!cuePath.isEmpty())
+    {
+        cues = new CueList(card, this);
+        try
+        {
+            cues->load(cuePath);
+            connect(cues, SIGNAL(cueDone(int,int)), this, SLOT(cueDone(int,int)));
+            cues->start(QThread::HighPriority);
+        }
+        catch (QString err)
+        {
+            delete cues;
+            cues = NULL;
+            showError(err);
+        }
+    }
+    setConnecting(false);
+    ui->statusBar->showMessage(tr("Connected to %1").arg(card->getName()), 2000);
+    if (!importPath.isEmpty())
+    {
+        loadAlsaState(importPath);
+        importPath.clear();
+    }
+}
+
+void MainWindow::loaderFailed(const QString & err)
+{
+    ui->statusBar->clearMessage();
+    // Let the user pick another card, if there is any
+    ui->card->setEnabled(ui->card->count() > 1);
+    showError(err);
+}
+
+void MainWindow::controlFailed(const QString & err)
+{
+    // The card stays on screen, but nothing follows it any more
+    ui->statusBar->showMessage(tr("Lost track of the card"));
+    showError(err);
+}
+
+void MainWindow::cueDone(int cue, int lateness)
+{
+    if (cues)
+        ui->statusBar->showMessage(tr("Cue %1 of %2 (%3 us late)")
+                                   .arg(cue + 1).arg(cues->size()).arg(lateness));
+}
+
+void MainWindow::autosaveRecovered(int changes)
+{
+    // The card may have been switched since
+    if (!autosave || sender() != autosave)
+        return;
+    QMessageBox::StandardButton answer = QMessageBox::question(this, tr("Restore state"),
+        tr("%1 differs from its last saved state in %2 elements, e.g. after a power cycle.\n"
+           "Restore the saved state?").arg(card->getName()).arg(changes),
+        QMessageBox::Yes | QMessageBox::No, QMessageBox::Yes);
+    if (answer != QMessageBox::Yes || !autosave)
     {
-        ix++; // change left
-        linked = linkedr;
+        if (autosave)
+            autosave->discard();
+        return;
     }
-    else if (-ix >= 5 && -ix <= 14 && -ix % 2 == 1) // checked an odd id => left channel
-        ix--; // change right
+    if (!autosave->restore())
+        ui->statusBar->showMessage(tr("Some elements couldn't be restored"), 5000);
     else
+        ui->statusBar->showMessage(tr("Restored %1 elements").arg(changes), 5000);
+}
+
+void MainWindow::routeTest()
+{
+    if (!card || (routeTester && routeTester->isRunning()))
         return;
+    delete routeTester;
+    routeTester = new RouteTest(card, this);
+    connect(routeTester, SIGNAL(done(bool,QString)), this, SLOT(routeTestDone(bool,QString)));
+    ui->statusBar->showMessage(tr("Testing route..."));
+    routeTester->start();
+}
 
-    if (!linked)
+void MainWindow::routeTestDone(bool ok, const QString & report)
+{
+    if (sender() != routeTester)
         return;
-    if (linked->checkedId() != ix)
-        // Using click() because it fires the appropiate signals
-        linked->button(ix)->click();
+    ui->statusBar->showMessage(report, ok ? 10000 : 0);
+}
+
+void MainWindow::undo()
+{
+    if (journal && !journal->undo())
+        ui->statusBar->showMessage(tr("Nothing to undo"), 2000);
+}
+
+void MainWindow::redo()
+{
+    if (journal && !journal->redo())
+        ui->statusBar->showMessage(tr("Nothing to redo"), 2000);
+}
+
+void MainWindow::importState()
+{
+    if (!card)
+        return;
+    QString path = QFileDialog::getOpenFileName(this, tr("Import state"), QString(),
+                                                tr("ALSA state files (*.state);;All files (*)"));
+    if (!path.isEmpty())
+        loadAlsaState(path);
+}
+
+void MainWindow::exportState()
+{
+    if (!card)
+        return;
+    QString path = QFileDialog::getSaveFileName(this, tr("Export state"), "asound.state",
+                                                tr("ALSA state files (*.state);;All files (*)"));
+    if (path.isEmpty())
+        return;
+    try
+    {
+        AlsaState(card).save(path);
+        ui->statusBar->showMessage(tr("Saved %1").arg(path), 2000);
+    }
+    catch (QString err)
+    {
+        showError(err);
+    }
+}
+
+//// HELPER FUNCTIONS
+
+void MainWindow::timerEvent(QTimerEvent *)
+{
+    if (player && !player->play(card, replayFast))
+    {
+        double ms = player->elapsed() / 1e6;
+        QString msg = tr("Replayed %1 records in %2 ms (%3 records/s)")
+                      .arg(player->played()).arg(ms, 0, 'f', 1)
+                      .arg(ms > 0 ? player->played() * 1000 / ms : 0, 0, 'f', 0);
+        qDebug() << msg;
+        ui->statusBar->showMessage(msg);
+        delete player;
+        player = NULL;
+    }
+    // No card until the loader is done
+    if (card && control)
+        card->updateWindow();
+    else if (card)
+        card->updateCallbacks();
 }
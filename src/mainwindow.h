@@ -21,9 +21,27 @@
 #include <QTimer>
 #include <QButtonGroup>
 #include <QMap>
+#include <QHash>
+#include <QVector>
+#include "soundcard.h"
 
 
-class SoundCard;
+class QLabel;
+class CardLoader;
+class MidiControl;
+class OscControl;
+class ShmState;
+class Journal;
+class DriftVerifier;
+class Autosave;
+class ControlThread;
+class CueList;
+class CardGroup;
+class TraceRecorder;
+class TracePlayer;
+class StressTest;
+class SpectrumView;
+class RouteTest;
 
 namespace Ui
 {
@@ -38,7 +56,7 @@ namespace Ui
     Building the ui is handled by the ui element, defined in a file
     generated by qmake from mainwindow.ui
     */
-class MainWindow : public QMainWindow
+class MainWindow : public QMainWindow, public CardView
 {
     /// This macro provides for Qt meta object handling and permits defining slots and signals
     Q_OBJECT
@@ -59,26 +77,209 @@ public:
     */
     void showError(const QString & msg);
 
+    /** Looks for cards and opens the first one.
+        Done in the background.
+        */
+    void openCards();
+    /** Records events and writes of every card opened to a trace file.
+        Call before opening cards.
+        @param path Trace file, overwritten
+        */
+    void record(const QString & path);
+    /** Replays a trace on a virtual card instead of opening cards.
+        When done, throughput is shown in the status bar.
+        @param path Trace file
+        @param fast Ignore recorded times, play as fast as possible
+        */
+    void replay(const QString & path, bool fast);
+    /** Runs a cue list on every card opened, once it's ready.
+        @param path Cue list file, see CueList
+        */
+    void runCues(const QString & path);
+    /** Restores an alsactl state file on the first card opened.
+        @param path State file, see AlsaState
+        */
+    void importAlsaState(const QString & path);
+    /** Makes writes to virtual cards slow.
+        @param us Time each element write takes, in microseconds
+        */
+    void simulateLatency(int us);
+    /** Shows an element value on its widget.
+        Called by the card when a bound element changes. Doesn't write back.
+        @param row Binding table row (see controlbindings.h)
+        @param v Value of the element's first channel
+        */
+    void showBinding(int row, long v);
+    /// Holds repaints while the card shows many changes
+    void holdUpdates(bool hold);
+    /** Value a bound widget shows, in element terms.
+        Routing: ALSA index of the checked source. -1 if nothing is shown.
+        @param row Binding table row (see controlbindings.h)
+        */
+    long bindingValue(int row) const;
+    /** Closes the current card and uses another one instead.
+        Takes ownership.
+        */
+    void useCard(SoundCard * c);
+    /** Runs a stress test on a virtual card instead of opening cards.
+        The application quits when it's done, see StressTest.
+        @param seconds How long to run
+        @param seed Random seed
+        */
+    void stressTest(int seconds, uint seed);
+    /** Shows the analyzer panel with a WAV file as source.
+        @param path WAV file, see Analyzer
+        */
+    void analyzeFile(const QString & path);
+    /** Starts listening to MIDI control surfaces.
+        Left out by the test modes, whose results shouldn't depend on
+        what is plugged in.
+        */
+    void startMidi();
+    /** Starts listening for OSC messages.
+        Left out by the test modes, like startMidi().
+        */
+    void startOsc();
+    /** Runs an OSC load test once a card is ready.
+        See OscControl::generateLoad(). Starts OSC for it.
+        */
+    void oscLoad(int seconds, int bundle);
+    /// Runs the route self-test (F9) once a card is ready, see RouteTest
+    void routeTestWhenReady();
+    /** Checks that linked matrix clicks write one batch of at most two routes.
+        Clicks every button of the linked columns on a virtual card, counting
+        writes with an observer.
+        @return false if any click wrote more (or less) than expected.
+        */
+    bool linkTest();
+
     /** Contains actual UI widgets.
         It is no neccesary to interacte directly with this.
         */
     Ui::MainWindow * ui;
 
+signals:
+    /// A bound widget was updated by showBinding()
+    void bindingShown(int row, long value);
+
 private:
     /** Soundcard object.
       Wrapper around ALSA functions. Takes care of card initialization, reading and writing.
       Callbacks modify this window's widgets.
       */
     SoundCard * card;
+    /** Opens cards in the background.
+      Keeps the GUI responsive while ALSA is busy.
+      */
+    CardLoader * loader;
+    /** Cards linked with the current one ("group/cards" setting).
+      NULL if there are none; changes then go to card alone.
+      */
+    CardGroup * group;
+    /** MIDI control surface input.
+      Writes to the card from its own thread.
+      */
+    MidiControl * midi;
+    /** OSC input.
+      Writes to the card from its own thread.
+      */
+    OscControl * osc;
+    /// OSC load test to run once a card is ready (0 for none)
+    int oscLoadSeconds;
+    int oscLoadBundle;
+    /** ALSA event handling thread.
+      NULL if events are handled in the GUI thread.
+      */
+    ControlThread * control;
+    /** Card state published in shared memory.
+      Exists while a card is open.
+      */
+    ShmState * shm;
+    /** Undo/redo history of the current card.
+      Exists while a card is open.
+      */
+    Journal * journal;
+    /** Checks the current card for unreported changes.
+      Exists while a card is open.
+      */
+    DriftVerifier * verifier;
+    /** Saves the state of the current card as it changes.
+      Exists while a real card is open.
+      */
+    Autosave * autosave;
+    /// Widgets of the binding table by row (NULL if missing), and rows by widget
+    QVector<QObject *> bindingWidgets;
+    QHash<QObject *, int> bindingRows;
+    /// Level labels of faders by row (NULL if none)
+    QVector<QLabel *> levelLabels;
+    /// Cue list running on the current card, if any
+    CueList * cues;
+    QString cuePath;
+    /// State file to restore once a card is ready
+    QString importPath;
+    /// Write latency of virtual cards (us)
+    int latency;
+    /// Trace recorder of the current card, if recording
+    TraceRecorder * recorder;
+    QString recordPath;
+    /// Trace being replayed, if any
+    TracePlayer * player;
+    bool replayFast;
+    /// Stress test, if running
+    StressTest * stress;
+    /// Analyzer panel, in a dock widget toggled with F8
+    SpectrumView * spectrum;
+    /// Route self-test, if one ran on the current card
+    RouteTest * routeTester;
+    /// Run it once a card is ready
+    bool routeTestPending;
+
+    /// Detach everything from the current card and close it
+    void closeCard();
+    /** Writes a change to the card, or to all cards of the group.
+      @param batch Element names and values
+      */
+    void writeLinked(const QList<QPair<QString, QVector<long> > > & batch);
+    /** Restores an alsactl state file on the card.
+      Errors are shown, the result goes to the status bar.
+      */
+    void loadAlsaState(const QString & path);
 
     ///// GUI METHODS
+    /// Enable or disable card controls while a card is being opened
+    void setConnecting(bool connecting);
     /// Show or hide button groups (matrix columns & rows)
     void matrixSetVisible(const int rows[], const int cols[], bool visible);
-    /** Check linked l/r button
-      @param bg The group in which a button was clicked
-      @param linked Linked QButtonGroup
+    /** Writes a bound widget's value to its element.
+      @param row Binding table row (see controlbindings.h)
+      @param v Widget value: button id, checked state, slider position or combo index
+      */
+    void writeBinding(int row, int v);
+    /** Handle a click on the matrix.
+      Writes the routing for the clicked column and, if L-R link is enabled,
+      for its stereo partner too, as a single batch.
+      @param row Binding table row of the clicked column
+      @param i Id of the clicked button
       */
-    void checkLinked(QButtonGroup * bg, QButtonGroup * linked, QButtonGroup * linkedr = NULL);
+    void matrixClicked(int row, int i);
+    /** Set fader ranges from the card's elements.
+      Before the card shows values on them.
+      */
+    void levelSetScales();
+    /** Offer the clock rates the card knows about.
+      Before the card shows values on the rate combo.
+      */
+    void rateSetItems();
+    /** Shows a fader's level on its label and tooltip.
+      In dB if the element has a scale, raw value otherwise.
+      @param row Binding table row of the fader
+      @param v Fader value
+      */
+    void levelShow(int row, long v);
+    /** Label matrix buttons with the card's source names.
+      Buttons for sources the card doesn't offer are disabled.
+      */
+    void matrixSetSources();
 
     /** Timer event
         Timer event for this class. Set to timeout when GUI stuff is idle. Updates
@@ -88,6 +289,31 @@ private:
     void timerEvent(QTimerEvent *);
 
 private slots:
+    /// Signaled by the card loader
+    void loaderProgress(const QString & msg);
+    void loaderCardFound(const QString & name, int index);
+    void loaderCardReady(SoundCard * c);
+    void loaderFailed(const QString & err);
+
+    /// Signaled by the control thread: the card's events can't be handled
+    void controlFailed(const QString & err);
+
+    /// Signaled by autosave: offer to restore the state saved last time
+    void autosaveRecovered(int changes);
+
+    /// Signaled by the cue list
+    void cueDone(int cue, int lateness);
+
+    /// Undo/redo shortcuts
+    void undo();
+    void redo();
+    /// Route self-test shortcut, and its result
+    void routeTest();
+    void routeTestDone(bool ok, const QString & report);
+    /// alsactl state file import/export shortcuts
+    void importState();
+    void exportState();
+
     /// Set visible connectors and matrix boxes
     void on_concapture_valueChanged(int);
     void on_conplay_valueChanged(int);
@@ -95,64 +321,13 @@ private slots:
     void on_con1010_toggled(bool checked);
     void on_condock_toggled(bool checked);
 
-    /// Signaled by pad togglebuttons
-    void on_dacpad_toggled(bool checked);
-    void on_d1pad_toggled(bool checked);
-    void on_d2pad_toggled(bool checked);
-    void on_d3pad_toggled(bool checked);
-    void on_d4pad_toggled(bool checked);
-    void on_adcpadin_toggled(bool checked);
-    void on_d1padin_toggled(bool checked);
-    void on_d2padin_toggled(bool checked);
-    void on_d3padin_toggled(bool checked);
-    /// Signals from various widgets:
-    /// Clock rate ComboBox
-    void on_rate_currentIndexChanged(int index);
-    /// Master fader
-    void on_master_valueChanged(int value);
+    /// Signaled by bound widgets (see controlbindings.h)
+    void bindingChanged(int value);
+    void bindingToggled(bool checked);
     /// Card switcher ComboBox
     void on_card_currentIndexChanged(int index);
     /// Panic button
     void on_panic_pressed();
-
-    /// These are signaled by clicks on the matrix, each for one column (output)
-    ///  b11 - b16: Alsa capture channels
-    void on_b11_buttonClicked(int);
-    void on_b12_buttonClicked(int);
-    void on_b13_buttonClicked(int);
-    void on_b14_buttonClicked(int);
-    void on_b15_buttonClicked(int);
-    void on_b16_buttonClicked(int);
-    /// b0l, b0r: 0202 left & right DACs
-    void on_b0l_buttonClicked(int);
-    void on_b0r_buttonClicked(int);
-    /// ba0 - ba7: 1010 ADAT ouput channels
-    void on_ba0_buttonClicked(int);
-    void on_ba1_buttonClicked(int);
-    void on_ba2_buttonClicked(int);
-    void on_ba3_buttonClicked(int);
-    void on_ba4_buttonClicked(int);
-    void on_ba5_buttonClicked(int);
-    void on_ba6_buttonClicked(int);
-    void on_ba7_buttonClicked(int);
-    /// bsl, bsr: 1010 S/PDIF left & right
-    void on_bsl_buttonClicked(int);
-    void on_bsr_buttonClicked(int);
-    /// b1l, b1r - b4l, b4r: Dock DACs 1-4, left & right
-    void on_b1l_buttonClicked(int);
-    void on_b1r_buttonClicked(int);
-    void on_b2l_buttonClicked(int);
-    void on_b2r_buttonClicked(int);
-    void on_b3l_buttonClicked(int);
-    void on_b3r_buttonClicked(int);
-    void on_b4l_buttonClicked(int);
-    void on_b4r_buttonClicked(int);
-    /// bpl, bpr: Dock phones DAC, left & right
-    void on_bpl_buttonClicked(int);
-    void on_bpr_buttonClicked(int);
-    /// bdsl, bsdr: Dock S/PDIF outputs, left & right
-    void on_bdsl_buttonClicked(int);
-    void on_bdsr_buttonClicked(int);
 };
 
 #endif // MAINWINDOW_H
@@ -19,8 +19,13 @@
 #include <QDebug>
 #include <QSlider>
 #include <QComboBox>
+#include <QAbstractSlider>
+#include <QLabel>
 #include "soundcard.h"
+#include "cardloader.h"
 #include "matrix_visibility.h"
+#include "controlbindings.h"
+#include "stresstest.h"
 
 //// GENERAL SIGNALS
 void MainWindow::on_panic_pressed()
@@ -34,70 +39,10 @@ void MainWindow::on_card_currentIndexChanged(int index)
     int aix = findChild<QComboBox*>("card")->itemData(index).toInt();
     qDebug() << "Selecting card #" << aix;
     // ALSA control handles
-    if (card)
-      delete card;
-    // Initialize card .. TODO ALSA index isn't necessarly equal to cb index, if
-    // user has non-emu cards! fixed -- works now?
-    card = new SoundCard(aix);
-    card->setupCallbacks(this);
-}
-
-void MainWindow::on_master_valueChanged(int v)
-{
-    card->writeStereoInt("Master Playback Volume", v);
-}
-
-void MainWindow::on_rate_currentIndexChanged(int index)
-{
-    card->writeEnum("Clock Internal Rate", index);
-}
-
-//// PAD SIGNALS
-// Output Pad switches, labeled 14dB, when I think it's actually 12 (+4dBu/-10dBV)
-void MainWindow::on_dacpad_toggled(bool checked)
-{
-    card->writeBool("DAC1 0202 14dB PAD Playback Switch", checked);
-}
-
-void MainWindow::on_d1pad_toggled(bool checked)
-{
-    card->writeBool("DAC1 Audio Dock 14dB PAD Playback Switch", checked);
-}
-
-void MainWindow::on_d2pad_toggled(bool checked)
-{
-    card->writeBool("DAC2 Audio Dock 14dB PAD Playback Switch", checked);
-}
-
-void MainWindow::on_d3pad_toggled(bool checked)
-{
-    card->writeBool("DAC3 Audio Dock 14dB PAD Playback Switch", checked);
-}
-
-void MainWindow::on_d4pad_toggled(bool checked)
-{
-    card->writeBool("DAC4 Audio Dock 14dB PAD Playback Switch", checked);
-}
-
-// TODO The input switches don't work, but crash the app, not sure why.
-void MainWindow::on_adcpadin_toggled(bool checked)
-{
-    card->writeBool("ADC1 14dB PAD 0202 Capture Switch", checked);
-}
-
-void MainWindow::on_d1padin_toggled(bool checked)
-{
-    card->writeBool("ADC1 14dB PAD Audio Dock Capture Switch", checked);
-}
-
-void MainWindow::on_d2padin_toggled(bool checked)
-{
-    card->writeBool("ADC2 14dB PAD Audio Dock Capture Switch", checked);
-}
-
-void MainWindow::on_d3padin_toggled(bool checked)
-{
-    card->writeBool("ADC3 14dB PAD Audio Dock Capture Switch", checked);
+    closeCard();
+    // Initialize card in the background; loaderCardReady() takes it from there.
+    setConnecting(true);
+    loader->open(aix);
 }
 
 ///// VIEW SIGNALS
@@ -145,197 +90,272 @@ void MainWindow::on_condock_toggled(bool checked)
     matrixSetVisible(matrix0202rows, matrix0202cols, false);
 }
 
-/////// MATRIX SIGNALS
-// Ugly way to do this. These are signaled by QButtonGroups of each column of the matrix, representing one card output.
-// The stuff below is simple, but does the "real work".
-// TODO implement stereo linking.
-
-void MainWindow::on_b11_buttonClicked(int i)
-{
-    card->matrixWriteEnum("DSP A Capture Enum", i);
-    checkLinked(ui->b11, ui->b12);
-}
-
-void MainWindow::on_b12_buttonClicked(int i)
-{
-    card->matrixWriteEnum("DSP B Capture Enum", i);
-    checkLinked(ui->b12, ui->b13, ui->b11);
-}
-
-void MainWindow::on_b13_buttonClicked(int i)
-{
-    card->matrixWriteEnum("DSP C Capture Enum", i);
-    checkLinked(ui->b13, ui->b14, ui->b12);
-}
-
-void MainWindow::on_b14_buttonClicked(int i)
-{
-    card->matrixWriteEnum("DSP D Capture Enum", i);
-    checkLinked(ui->b14, ui->b15, ui->b13);
-}
-
-void MainWindow::on_b15_buttonClicked(int i)
-{
-    card->matrixWriteEnum("DSP E Capture Enum", i);
-    checkLinked(ui->b15, ui->b16, ui->b14);
-}
-
-void MainWindow::on_b16_buttonClicked(int i)
-{
-    card->matrixWriteEnum("DSP F Capture Enum", i);
-    checkLinked(ui->b16, NULL, ui->b15);
-}
-
-void MainWindow::on_b0l_buttonClicked(int i)
-{
-    card->matrixWriteEnum("0202 DAC Left Playback Enum", i);
-    checkLinked(ui->b0l, ui->b0r);
-}
-
-void MainWindow::on_b0r_buttonClicked(int i)
-{
-    card->matrixWriteEnum("0202 DAC Right Playback Enum", i);
-    checkLinked(ui->b0r, ui->b0l);
-}
-
-void MainWindow::on_ba0_buttonClicked(int i)
-{
-    card->matrixWriteEnum("1010 ADAT 0 Playback Enum", i);
-    checkLinked(ui->ba0, ui->ba1);
-}
-
-void MainWindow::on_ba1_buttonClicked(int i)
-{
-    card->matrixWriteEnum("1010 ADAT 1 Playback Enum", i);
-    checkLinked(ui->ba1, ui->ba2, ui->ba0);
-}
-
-void MainWindow::on_ba2_buttonClicked(int i)
-{
-    card->matrixWriteEnum("1010 ADAT 2 Playback Enum", i);
-    checkLinked(ui->ba2, ui->ba3, ui->ba1);
-}
-
-void MainWindow::on_ba3_buttonClicked(int i)
-{
-    card->matrixWriteEnum("1010 ADAT 3 Playback Enum", i);
-    checkLinked(ui->ba3, ui->ba4, ui->ba2);
-}
-
-void MainWindow::on_ba4_buttonClicked(int i)
-{
-    card->matrixWriteEnum("1010 ADAT 4 Playback Enum", i);
-    checkLinked(ui->ba4, ui->ba5, ui->ba3);
-}
-
-void MainWindow::on_ba5_buttonClicked(int i)
-{
-    card->matrixWriteEnum("1010 ADAT 5 Playback Enum", i);
-    checkLinked(ui->ba5, ui->ba6, ui->ba4);
-}
-
-void MainWindow::on_ba6_buttonClicked(int i)
-{
-    card->matrixWriteEnum("1010 ADAT 6 Playback Enum", i);
-    checkLinked(ui->ba6, ui->ba7, ui->ba5);
-}
-
-void MainWindow::on_ba7_buttonClicked(int i)
-{
-    card->matrixWriteEnum("1010 ADAT 7 Playback Enum", i);
-    checkLinked(ui->ba7, NULL, ui->ba6);
-}
+//// BOUND WIDGETS
+// Widgets of the binding table signal these; the table tells what to write.
 
-void MainWindow::on_bsl_buttonClicked(int i)
+void MainWindow::bindingChanged(int value)
 {
-    card->matrixWriteEnum("1010 SPDIF Left Playback Enum", i);
-    checkLinked(ui->bsl, ui->bsr);
+    int row = bindingRows.value(sender(), -1);
+    if (card && row >= 0)
+        writeBinding(row, value);
 }
 
-void MainWindow::on_bsr_buttonClicked(int i)
+void MainWindow::bindingToggled(bool checked)
 {
-    card->matrixWriteEnum("1010 SPDIF Right Playback Enum", i);
-    checkLinked(ui->bsr, ui->bsl);
+    bindingChanged(checked);
 }
 
-void MainWindow::on_b1l_buttonClicked(int i)
+void MainWindow::writeBinding(int row, int v)
 {
-    card->matrixWriteEnum("Dock DAC1 Left Playback Enum", i);
-    checkLinked(ui->b1l, ui->b1r);
-}
-
-void MainWindow::on_b1r_buttonClicked(int i)
-{
-    card->matrixWriteEnum("Dock DAC1 Right Playback Enum", i);
-    checkLinked(ui->b1r, ui->b1l);
+    const ControlBinding & b = controlBindings[row];
+    switch (b.kind)
+    {
+    case ControlBinding::Routing:
+        matrixClicked(row, v);
+        break;
+    case ControlBinding::Level:
+    {
+        // Also to the cards linked with this one, if any
+        QList<QPair<QString, QVector<long> > > batch;
+        batch.append(qMakePair(QString(b.element), QVector<long>(1, v)));
+        writeLinked(batch);
+        levelShow(row, v);
+        break;
+    }
+    case ControlBinding::Switch:
+        card->writeBool(b.element, v);
+        break;
+    case ControlBinding::Item:
+        card->writeEnum(b.element, v);
+        break;
+    }
 }
 
-void MainWindow::on_b2l_buttonClicked(int i)
+void MainWindow::holdUpdates(bool hold)
 {
-    card->matrixWriteEnum("Dock DAC2 Left Playback Enum", i);
-    checkLinked(ui->b2l, ui->b2r);
+    setUpdatesEnabled(!hold);
 }
 
-void MainWindow::on_b2r_buttonClicked(int i)
+void MainWindow::showBinding(int row, long v)
 {
-    card->matrixWriteEnum("Dock DAC2 Right Playback Enum", i);
-    checkLinked(ui->b2r, ui->b2l);
+    QObject * widget = bindingWidgets.at(row);
+    if (!widget)
+        return;
+    // Showing a value shouldn't write it back
+    widget->blockSignals(true);
+    switch (controlBindings[row].kind)
+    {
+    case ControlBinding::Routing:
+    {
+        QButtonGroup * bg = static_cast<QButtonGroup *>(widget);
+        // Make sure the index does make reference to an available button
+        int el = card->getSchema().id(controlBindings[row].element);
+        QAbstractButton * button = bg->button(card->alsaToMatrix(el, v));
+        if (button)
+            button->setChecked(true);
+        // or else uncheck all buttons.
+        else if (bg->checkedButton())
+            bg->checkedButton()->setChecked(false);
+        break;
+    }
+    case ControlBinding::Switch:
+        static_cast<QAbstractButton *>(widget)->setChecked(v);
+        break;
+    case ControlBinding::Level:
+        static_cast<QAbstractSlider *>(widget)->setValue(v);
+        levelShow(row, v);
+        break;
+    case ControlBinding::Item:
+    {
+        // The combo holds every item the card offers, external sources
+        // (S/PDIF, ADAT) included. Routes get checked by SoundCard::resync().
+        QComboBox * combo = static_cast<QComboBox *>(widget);
+        if (v < combo->count())
+            combo->setCurrentIndex(v);
+        break;
+    }
+    }
+    widget->blockSignals(false);
+    emit bindingShown(row, v);
 }
 
-void MainWindow::on_b3l_buttonClicked(int i)
+long MainWindow::bindingValue(int row) const
 {
-    card->matrixWriteEnum("Dock DAC3 Left Playback Enum", i);
-    checkLinked(ui->b3l, ui->b3r);
+    QObject * widget = bindingWidgets.at(row);
+    if (!widget)
+        return -1;
+    switch (controlBindings[row].kind)
+    {
+    case ControlBinding::Routing:
+    {
+        QButtonGroup * bg = static_cast<QButtonGroup *>(widget);
+        int el = card->getSchema().id(controlBindings[row].element);
+        return bg->checkedButton() ? card->matrixToAlsa(el, bg->checkedId()) : -1;
+    }
+    case ControlBinding::Switch:
+        return static_cast<QAbstractButton *>(widget)->isChecked();
+    case ControlBinding::Level:
+        return static_cast<QAbstractSlider *>(widget)->value();
+    case ControlBinding::Item:
+        return static_cast<QComboBox *>(widget)->currentIndex();
+    }
+    return -1;
 }
 
-void MainWindow::on_b3r_buttonClicked(int i)
-{
-    card->matrixWriteEnum("Dock DAC3 Right Playback Enum", i);
-    checkLinked(ui->b3r, ui->b3l);
-}
+//// FADERS
 
-void MainWindow::on_b4l_buttonClicked(int i)
+void MainWindow::levelSetScales()
 {
-    card->matrixWriteEnum("Dock DAC4 Left Playback Enum", i);
-    checkLinked(ui->b4l, ui->b4r);
+    const ElementSchema & schema = card->getSchema();
+    for (int row = 0; row < controlBindingCount; row++)
+    {
+        int id = schema.id(controlBindings[row].element);
+        if (controlBindings[row].kind != ControlBinding::Level || !bindingWidgets.at(row) || id < 0)
+            continue;
+        QAbstractSlider * slider = static_cast<QAbstractSlider *>(bindingWidgets.at(row));
+        slider->blockSignals(true);
+        slider->setRange(schema.min(id), schema.max(id));
+        slider->blockSignals(false);
+        if (levelLabels.at(row))
+            levelLabels.at(row)->setVisible(schema.hasDb(id));
+    }
 }
 
-void MainWindow::on_b4r_buttonClicked(int i)
+void MainWindow::levelShow(int row, long v)
 {
-    card->matrixWriteEnum("Dock DAC4 Right Playback Enum", i);
-    checkLinked(ui->b4r, ui->b4l);
+    const ElementSchema & schema = card->getSchema();
+    int id = schema.id(controlBindings[row].element);
+    if (id < 0 || !schema.hasDb(id))
+        return;
+    // Table lookup, a drag costs no ioctls
+    long db = schema.toDb(id, v);
+    QString text = db <= SND_CTL_TLV_DB_GAIN_MUTE ? QString("-inf dB")
+                   : QString("%1 dB").arg(db / 100.0, 0, 'f', 1);
+    if (levelLabels.at(row))
+        levelLabels.at(row)->setText(text);
+    static_cast<QWidget *>(bindingWidgets.at(row))->setToolTip(text);
 }
 
-void MainWindow::on_bpl_buttonClicked(int i)
+void MainWindow::rateSetItems()
 {
-    card->matrixWriteEnum("Dock Phones Left Playback Enum", i);
-    checkLinked(ui->bpl, ui->bpr);
+    const ElementSchema & schema = card->getSchema();
+    int id = schema.id("Clock Internal Rate");
+    ui->rate->blockSignals(true);
+    ui->rate->clear();
+    for (unsigned int i = 0; id >= 0 && i < schema.items(id); i++)
+        ui->rate->addItem(schema.itemName(id, i));
+    ui->rate->blockSignals(false);
 }
 
-void MainWindow::on_bpr_buttonClicked(int i)
-{
-    card->matrixWriteEnum("Dock Phones Right Playback Enum", i);
-    checkLinked(ui->bpr, ui->bpl);
-}
+/////// MATRIX SIGNALS
+// Matrix columns (card outputs) are the Routing rows of the binding table,
+// each with a QButtonGroup.
 
-void MainWindow::on_bdsl_buttonClicked(int i)
+/// Button id of the source linked to button id i (ids are -(row + 2))
+static int linkedButton(int i)
 {
-    card->matrixWriteEnum("Dock SPDIF Left Playback Enum", i);
-    checkLinked(ui->bdsl, ui->bdsr);
+    return -(linkedSource(-(i + 2)) + 2);
 }
 
-void MainWindow::on_bdsr_buttonClicked(int i)
+void MainWindow::matrixClicked(int row, int i)
 {
-    card->matrixWriteEnum("Dock SPDIF Right Playback Enum", i);
-    checkLinked(ui->bdsr, ui->bdsl);
+    const ControlBinding & c = controlBindings[row];
+    const ElementSchema & schema = card->getSchema();
+    QList<QPair<QString, QVector<long> > > batch;
+    int ix = card->matrixToAlsa(schema.id(c.element), i);
+    if (ix >= 0)
+        batch.append(qMakePair(QString(c.element), QVector<long>(1, ix)));
+    // L-R link enabled? Then the partner column gets the partner source,
+    // written together with this one. setChecked() doesn't fire buttonClicked,
+    // so there is no recursion into the partner's slot.
+    QButtonGroup * linked = c.partner ? static_cast<QButtonGroup *>(bindingWidgets.at(row + c.partner)) : NULL;
+    if (ui->link->isChecked() && linked)
+    {
+        const ControlBinding & p = controlBindings[row + c.partner];
+        int li = linkedButton(i);
+        int lix = card->matrixToAlsa(schema.id(p.element), li);
+        if (linked->checkedId() != li && linked->button(li) && lix >= 0)
+        {
+            batch.append(qMakePair(QString(p.element), QVector<long>(1, lix)));
+            linked->button(li)->setChecked(true);
+        }
+    }
+    // Also to the cards linked with this one, if any
+    writeLinked(batch);
 }
 
-void MainWindow::on_conplay_valueChanged(int)
+void MainWindow::matrixSetSources()
 {
-
+    const ElementSchema & schema = card->getSchema();
+    for (int row = 0; row < controlBindingCount; row++)
+    {
+        if (controlBindings[row].kind != ControlBinding::Routing || !bindingWidgets.at(row))
+            continue;
+        QButtonGroup * bg = static_cast<QButtonGroup *>(bindingWidgets.at(row));
+        int el = schema.id(controlBindings[row].element);
+        QList<QAbstractButton *> buttons = bg->buttons();
+        for (QList<QAbstractButton *>::iterator it = buttons.begin(); it != buttons.end(); ++it)
+        {
+            int ix = el < 0 ? -1 : card->matrixToAlsa(el, bg->id(*it));
+            (*it)->setEnabled(ix >= 0);
+            (*it)->setToolTip(ix >= 0 ? schema.itemName(el, ix) : QString());
+        }
+    }
 }
 
-void MainWindow::on_concapture_valueChanged(int)
+/// Counts batches and element writes, for linkTest()
+class WriteCounter : public CardObserver
 {
-
+public:
+    WriteCounter() : batches(0), writes(0) {}
+    void elementChanged(const SoundCard *, const CardChange & change)
+    {
+        if (change.written)
+            writes++;
+    }
+    void batchStarted(const SoundCard *)
+    {
+        batches++;
+    }
+    int batches;
+    int writes;
+};
+
+bool MainWindow::linkTest()
+{
+    useCard(StressTest::bindingCard(this, QVector<long>(), "Link test card"));
+    const ElementSchema & schema = card->getSchema();
+    WriteCounter counter;
+    card->addObserver(&counter);
+    ui->link->setChecked(true);
+    int clicks = 0, failures = 0;
+    for (int row = 0; row < controlBindingCount; row++)
+    {
+        const ControlBinding & c = controlBindings[row];
+        if (c.kind != ControlBinding::Routing || !c.partner || !bindingWidgets.at(row))
+            continue;
+        QButtonGroup * bg = static_cast<QButtonGroup *>(bindingWidgets.at(row));
+        int partner = schema.id(controlBindings[row + c.partner].element);
+        QList<QAbstractButton *> buttons = bg->buttons();
+        for (QList<QAbstractButton *>::iterator it = buttons.begin(); it != buttons.end(); ++it)
+        {
+            // The clicked route, plus the partner route unless it's already there
+            int lix = card->matrixToAlsa(partner, linkedButton(bg->id(*it)));
+            int expected = 1 + (lix >= 0 && card->getCached(partner).value(0) != lix);
+            counter.batches = counter.writes = 0;
+            (*it)->click();
+            card->updateWindow();
+            clicks++;
+            if (counter.batches != 1 || counter.writes != expected)
+            {
+                qDebug() << "Warning: Linked click on " << c.widget << " button " << bg->id(*it)
+                         << ": " << counter.batches << " batches, " << counter.writes
+                         << " writes, expected 1 and " << expected;
+                failures++;
+            }
+        }
+    }
+    card->removeObserver(&counter);
+    qDebug() << "Link test: " << clicks << " linked clicks, " << failures << " failed";
+    return clicks && !failures;
 }
@@ -0,0 +1,251 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "midicontrol.h"
+#include "soundcard.h"
+#include "monotonic.h"
+#include <QSettings>
+#include <QMutexLocker>
+#include <QDebug>
+#include <poll.h>
+#include <errno.h>
+
+/// Lookup table size: two types, 16 channels, 128 numbers
+static const int lookupSize = 2 * 16 * 128;
+
+MidiControl::MidiControl(QObject * parent)
+    : QThread(parent), seq(NULL), card(NULL), stopping(0), worst(0)
+{
+    bindings = loadBindings();
+    lookup.resize(lookupSize);
+    for (int b = 0; b < bindings.size(); b++)
+    {
+        const MidiBinding & mb = bindings.at(b);
+        if (mb.number < 0 || mb.number > 127 || mb.channel > 15)
+        {
+            qDebug() << "Warning: Ignoring MIDI binding for " << mb.element;
+            continue;
+        }
+        // "Any channel" bindings are entered on all 16
+        for (int ch = 0; ch < 16; ch++)
+            if (mb.channel < 0 || mb.channel == ch)
+                lookup[lookupIndex(mb.type, ch, mb.number)].append(b);
+    }
+    pending.resize(bindings.size());
+    dirty.fill(false, bindings.size());
+    arrival.resize(bindings.size());
+}
+
+MidiControl::~MidiControl()
+{
+    stop();
+    wait();
+}
+
+int MidiControl::lookupIndex(MidiBinding::Type type, int channel, int number)
+{
+    return (type * 16 + channel) * 128 + number;
+}
+
+QList<MidiBinding> MidiControl::loadBindings()
+{
+    QList<MidiBinding> list;
+    QSettings settings;
+    int n = settings.beginReadArray("midi/bindings");
+    for (int i = 0; i < n; i++)
+    {
+        settings.setArrayIndex(i);
+        MidiBinding mb;
+        mb.type = settings.value("type").toString() == "note" ? MidiBinding::Note : MidiBinding::Controller;
+        // Channels are 1-16 for humans
+        mb.channel = settings.value("channel", 0).toInt() - 1;
+        mb.number = settings.value("number").toInt();
+        mb.element = settings.value("element").toString();
+        QString action = settings.value("action", "scale").toString();
+        mb.action = action == "toggle" ? MidiBinding::Toggle
+                    : action == "set" ? MidiBinding::Set : MidiBinding::Scale;
+        mb.value = settings.value("value", 0).toInt();
+        list.append(mb);
+    }
+    settings.endArray();
+    if (n == 0)
+    {
+        // Defaults: Volume CC on any channel drives the master fader
+        MidiBinding mb;
+        mb.type = MidiBinding::Controller;
+        mb.channel = -1;
+        mb.number = 7;
+        mb.element = "Master Playback Volume";
+        mb.action = MidiBinding::Scale;
+        mb.value = 0;
+        list.append(mb);
+    }
+    return list;
+}
+
+void MidiControl::setCard(SoundCard * c)
+{
+    QMutexLocker locker(&cardLock);
+    card = c;
+}
+
+void MidiControl::stop()
+{
+    stopping = 1;
+}
+
+int MidiControl::worstLatency() const
+{
+    return worst;
+}
+
+void MidiControl::run()
+{
+    if (snd_seq_open(&seq, "default", SND_SEQ_OPEN_INPUT, SND_SEQ_NONBLOCK) < 0)
+    {
+        qDebug("Warning: No ALSA sequencer, MIDI control disabled.");
+        return;
+    }
+    snd_seq_set_client_name(seq, APPLICATION_NAME);
+    int port = snd_seq_create_simple_port(seq, "Control Surface",
+                                          SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE,
+                                          SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+    if (port < 0)
+    {
+        qDebug() << "Warning: Couldn't create MIDI port: " << snd_strerror(port);
+        snd_seq_close(seq);
+        seq = NULL;
+        return;
+    }
+    qDebug() << "MIDI control port " << snd_seq_client_id(seq) << ":" << port
+            << " ready, " << bindings.size() << " bindings.";
+
+    int nfds = snd_seq_poll_descriptors_count(seq, POLLIN);
+    QVector<struct pollfd> fds(nfds);
+    snd_seq_poll_descriptors(seq, fds.data(), nfds, POLLIN);
+    while (!stopping)
+    {
+        // Wake up now and then to check if we should stop
+        if (poll(fds.data(), nfds, 100) <= 0)
+            continue;
+        // Drain everything that arrived, then write once per binding
+        snd_seq_event_t * ev;
+        int err;
+        while ((err = snd_seq_event_input(seq, &ev)) >= 0)
+            handleEvent(ev, monotonicNs());
+        if (err == -ENOSPC)
+            qDebug("Warning: MIDI input overrun, events lost.");
+        apply();
+    }
+    snd_seq_delete_simple_port(seq, port);
+    snd_seq_close(seq);
+    seq = NULL;
+    qDebug() << "MIDI control stopped. Worst latency: " << (int)worst << " us";
+}
+
+void MidiControl::handleEvent(const snd_seq_event_t * ev, qint64 t)
+{
+    MidiBinding::Type type;
+    int channel, number, value;
+    switch (ev->type)
+    {
+    case SND_SEQ_EVENT_CONTROLLER:
+        type = MidiBinding::Controller;
+        channel = ev->data.control.channel;
+        number = ev->data.control.param;
+        value = ev->data.control.value;
+        break;
+    case SND_SEQ_EVENT_NOTEON:
+        type = MidiBinding::Note;
+        channel = ev->data.note.channel;
+        number = ev->data.note.note;
+        value = ev->data.note.velocity;
+        break;
+    default:
+        return;
+    }
+    if (channel > 15 || number > 127)
+        return;
+    const QList<int> & bound = lookup.at(lookupIndex(type, channel, number));
+    for (QList<int>::const_iterator it = bound.begin(); it != bound.end(); ++it)
+    {
+        const MidiBinding & mb = bindings.at(*it);
+        // Switches and presets only trigger on press
+        if (mb.action != MidiBinding::Scale && value < 64)
+            continue;
+        // Toggles can't be coalesced, two presses are no press
+        if (mb.action == MidiBinding::Toggle && dirty.at(*it))
+        {
+            dirty[*it] = false;
+            continue;
+        }
+        if (!dirty.at(*it))
+            arrival[*it] = t;
+        pending[*it] = value;
+        dirty[*it] = true;
+    }
+}
+
+void MidiControl::apply()
+{
+    QMutexLocker locker(&cardLock);
+    for (int b = 0; b < bindings.size(); b++)
+    {
+        if (!dirty.at(b))
+            continue;
+        dirty[b] = false;
+        if (!card)
+            continue;
+        const MidiBinding & mb = bindings.at(b);
+        try
+        {
+            const ElementSchema & schema = card->getSchema();
+            int id = schema.find(mb.element);
+            if (id < 0)
+                continue;
+            const QString & name = schema.name(id);
+            int index = schema.index(id);
+            switch (mb.action)
+            {
+            case MidiBinding::Scale:
+                card->writeStereoInt(name,
+                    schema.min(id) + (schema.max(id) - schema.min(id)) * pending.at(b) / 127, index);
+                break;
+            case MidiBinding::Toggle:
+                card->writeBool(name, !card->readBool(name, index), index);
+                break;
+            case MidiBinding::Set:
+                if (schema.type(id) == SND_CTL_ELEM_TYPE_ENUMERATED)
+                    card->writeEnum(name, mb.value, index);
+                else
+                    card->writeStereoInt(name, mb.value, index);
+                break;
+            }
+        }
+        catch (QString err)
+        {
+            qDebug() << "MIDI write failed: " << err;
+            continue;
+        }
+        int latency = (monotonicNs() - arrival.at(b)) / 1000;
+        if (latency > worst)
+        {
+            worst = latency;
+            qDebug() << "MIDI control: new worst latency " << latency << " us";
+        }
+    }
+}
@@ -0,0 +1,128 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef MIDICONTROL_H
+#define MIDICONTROL_H
+
+#include <QThread>
+#include <QMutex>
+#include <QAtomicInt>
+#include <QString>
+#include <QList>
+#include <QVector>
+#include "alsa/asoundlib.h"
+
+class SoundCard;
+
+/** A MIDI control surface binding.
+    Maps a controller (CC) or note to a card element.
+    */
+struct MidiBinding
+{
+    enum Type { Controller, Note };
+    enum Action
+    {
+        /// Scale 0-127 to the element's integer range (faders)
+        Scale,
+        /// Flip a switch on note on/CC > 63 (pads)
+        Toggle,
+        /// Set element to value on note on/CC > 63 (routing presets)
+        Set
+    };
+    Type type;
+    /// MIDI channel 0-15, or -1 for any
+    int channel;
+    /// Controller or note number
+    int number;
+    /// Element name
+    QString element;
+    Action action;
+    /// For Set: enumeration index (or integer) to write
+    long value;
+};
+
+/** MIDI control surface input.
+    Creates an ALSA sequencer client with a virtual input port, and maps
+    incoming controller and note events to SoundCard writes using a binding
+    table (read from the "midi/bindings" settings array).
+    Runs on its own thread. Events are drained in bursts, and bursts are
+    coalesced per binding, so a fast fader sweep causes one write per burst,
+    not one per CC message. Widgets follow through the usual ALSA callbacks.
+    */
+class MidiControl : public QThread
+{
+    Q_OBJECT
+
+public:
+    MidiControl(QObject * parent = 0);
+    /** Destructor.
+        Stops the thread and closes the sequencer.
+        */
+    ~MidiControl();
+
+    /** Set card to write to.
+        Blocks until writes in progress are done, so the previous card
+        can be deleted afterwards. NULL detaches.
+        */
+    void setCard(SoundCard * c);
+    /// Ask thread to finish.
+    void stop();
+
+    /// Worst latency from event arrival to completed write, in microseconds.
+    int worstLatency() const;
+
+    /** Binding table, read from settings.
+        Each entry of the "midi/bindings" array has keys type ("cc" or "note"),
+        channel (1-16, omit for any), number, element ("name" or
+        "name[index]", as in cue lists), action ("scale",
+        "toggle" or "set") and value (for "set").
+        Without bindings, CC 7 (volume) drives the master fader.
+        */
+    static QList<MidiBinding> loadBindings();
+
+protected:
+    void run();
+
+private:
+    /// Record an incoming event in the pending slots.
+    void handleEvent(const snd_seq_event_t * ev, qint64 arrival);
+    /// Write pending values to the card.
+    void apply();
+    /// Slot in the lookup table
+    static int lookupIndex(MidiBinding::Type type, int channel, int number);
+
+    snd_seq_t * seq;
+    QList<MidiBinding> bindings;
+    /** Bindings by (type, channel, number), see lookupIndex().
+        Filled once, so every event costs one array access.
+        */
+    QVector<QList<int> > lookup;
+    /// Latest value per binding, valid if dirty
+    QVector<int> pending;
+    QVector<bool> dirty;
+    /// Arrival of the oldest event coalesced into the pending value
+    QVector<qint64> arrival;
+
+    /// Card to write to, guarded by cardLock
+    SoundCard * card;
+    QMutex cardLock;
+    QAtomicInt stopping;
+    /// Worst latency seen, in microseconds
+    QAtomicInt worst;
+};
+
+#endif // MIDICONTROL_H
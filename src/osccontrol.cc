@@ -0,0 +1,527 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "osccontrol.h"
+#include "soundcard.h"
+#include "controlbindings.h"
+#include "monotonic.h"
+#include <QSettings>
+#include <QMutexLocker>
+#include <QDebug>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+/// Largest datagram
+static const int bufferSize = 65536;
+/// Most messages a datagram may carry
+static const int maxMessages = 1024;
+/// Datagrams the load generator keeps in flight
+static const int loadWindow = 16;
+
+/** Position after the padded string at pos, or -1 if it isn't terminated.
+    OSC strings end with one to four nulls, up to a multiple of four bytes.
+    */
+static int stringEnd(const char * p, int size, int pos)
+{
+    const char * end = (const char *)memchr(p + pos, 0, size - pos);
+    if (!end)
+        return -1;
+    int next = ((end - p) + 4) & ~3;
+    return next <= size ? next : -1;
+}
+
+static quint32 bigEndian(const char * p)
+{
+    return ((quint32)(uchar)p[0] << 24) | ((quint32)(uchar)p[1] << 16)
+           | ((quint32)(uchar)p[2] << 8) | (uchar)p[3];
+}
+
+static void appendInt(QByteArray & b, quint32 v)
+{
+    for (int i = 3; i >= 0; i--)
+        b.append((char)(v >> (i * 8)));
+}
+
+static void appendString(QByteArray & b, const char * s)
+{
+    b.append(s);
+    // At least one null
+    do
+        b.append('\0');
+    while (b.size() % 4);
+}
+
+/** Local load generator.
+    Sends bundles to the server, two alternating sets of values, keeping
+    a few datagrams in flight so none are dropped.
+    */
+class OscLoad : public QThread
+{
+public:
+    OscLoad(OscControl * server, int seconds, int bundle)
+        : server(server), seconds(seconds), bundle(bundle), sent(0), elapsed(0), stopping(0) {}
+    void stop() { stopping = 1; }
+
+    OscControl * server;
+    int seconds;
+    int bundle;
+    int sent;
+    /// How long sending took (ns)
+    qint64 elapsed;
+
+protected:
+    void run();
+
+private:
+    QAtomicInt stopping;
+};
+
+void OscLoad::run()
+{
+    // Routing columns and master, over and over
+    QVector<int> rows;
+    for (int row = 0; row < controlBindingCount; row++)
+        if (controlBindings[row].kind == ControlBinding::Routing
+            || controlBindings[row].kind == ControlBinding::Level)
+            rows.append(row);
+    QByteArray packets[2];
+    for (int k = 0; k < 2; k++)
+    {
+        QByteArray & packet = packets[k];
+        appendString(packet, "#bundle");
+        // Time tag "immediately"
+        appendInt(packet, 0);
+        appendInt(packet, 1);
+        for (int m = 0; m < bundle; m++)
+        {
+            const ControlBinding & b = controlBindings[rows.at(m % rows.size())];
+            QByteArray message;
+            appendString(message, QByteArray("/emutrix/").append(b.widget).constData());
+            if (b.kind == ControlBinding::Level)
+            {
+                float f = k ? 0.25f : 0.5f;
+                quint32 bits;
+                memcpy(&bits, &f, sizeof(bits));
+                appendString(message, ",f");
+                appendInt(message, bits);
+            }
+            else
+            {
+                // Items 0 and 1 (off and the first source)
+                appendString(message, ",i");
+                appendInt(message, k);
+            }
+            appendInt(packet, message.size());
+            packet.append(message);
+        }
+    }
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in to;
+    memset(&to, 0, sizeof(to));
+    to.sin_family = AF_INET;
+    to.sin_port = htons(server->port);
+    if (server->host == "0.0.0.0" || inet_pton(AF_INET, server->host.constData(), &to.sin_addr) != 1)
+        to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int base = server->processed();
+    qint64 start = monotonicNs();
+    qint64 end = start + (qint64)seconds * 1000000000;
+    while (!stopping && monotonicNs() < end)
+    {
+        // Give up waiting after 100 ms, the datagram was lost
+        qint64 waiting = monotonicNs();
+        while (sent - (server->processed() - base) >= loadWindow && !stopping
+               && monotonicNs() - waiting < 100000000)
+            usleep(20);
+        const QByteArray & packet = packets[sent % 2];
+        if (sendto(fd, packet.constData(), packet.size(), 0, (struct sockaddr *)&to, sizeof(to)) < 0)
+        {
+            usleep(100);
+            continue;
+        }
+        sent++;
+    }
+    elapsed = monotonicNs() - start;
+    close(fd);
+    server->loadDone = 1;
+}
+
+OscControl::OscControl(QObject * parent)
+    : QThread(parent), count(0), card(NULL), stopping(0), worst(0), packets(0),
+      load(NULL), loadDone(0), loading(false), loadMessages(0), loadLatency(0), loadPackets(0)
+{
+    QSettings settings;
+    port = settings.value("osc/port", 7770).toInt();
+    host = settings.value("osc/address", "127.0.0.1").toString().toLatin1();
+    for (int row = 0; row < controlBindingCount; row++)
+        addresses.append(QByteArray("/emutrix/").append(controlBindings[row].widget));
+    ids.fill(-1, controlBindingCount);
+    buffer.resize(bufferSize);
+    messages.resize(maxMessages);
+}
+
+OscControl::~OscControl()
+{
+    if (load)
+    {
+        load->stop();
+        load->wait();
+    }
+    stop();
+    wait();
+    delete load;
+}
+
+void OscControl::setCard(SoundCard * c)
+{
+    QMutexLocker locker(&cardLock);
+    card = c;
+    for (int row = 0; row < controlBindingCount; row++)
+        ids[row] = card ? card->getSchema().id(controlBindings[row].element) : -1;
+    // A load test's state is of the previous card
+    loadState.clear();
+}
+
+void OscControl::stop()
+{
+    stopping = 1;
+}
+
+int OscControl::worstLatency() const
+{
+    return worst;
+}
+
+int OscControl::processed() const
+{
+    return packets;
+}
+
+void OscControl::generateLoad(int seconds, int bundle)
+{
+    if (load || !port)
+        return;
+    bundle = qBound(1, bundle, 256);
+    {
+        QMutexLocker locker(&cardLock);
+        if (!card)
+            return;
+        loadState = card->getCachedState();
+        loadMessages = 0;
+        loadLatency = 0;
+        loadPackets = 0;
+        loading = true;
+    }
+    qDebug() << "OSC load test: " << seconds << " s, " << bundle << " messages per bundle.";
+    load = new OscLoad(this, seconds, bundle);
+    load->start();
+}
+
+void OscControl::run()
+{
+    if (!port)
+    {
+        qDebug("OSC control disabled.");
+        return;
+    }
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (fd < 0 || inet_pton(AF_INET, host.constData(), &addr.sin_addr) != 1
+        || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        qDebug() << "Warning: Can't listen for OSC on " << host.constData() << ":" << port
+                 << ": " << strerror(errno);
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    qDebug() << "OSC control listening on " << host.constData() << ":" << port;
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while (!stopping)
+    {
+        // Wake up now and then to check if we should stop
+        if (poll(&pfd, 1, 100) > 0)
+        {
+            // Drain everything that arrived, one batch per datagram
+            ssize_t size;
+            while ((size = recv(fd, buffer.data(), buffer.size(), MSG_DONTWAIT)) >= 0)
+            {
+                qint64 arrival = monotonicNs();
+                count = 0;
+                // A bad datagram is dropped whole, nothing half applied
+                if (size % 4 || !parse(buffer.constData(), size, 0))
+                    qDebug("Warning: Malformed OSC packet ignored.");
+                else
+                    apply(arrival);
+                packets.ref();
+            }
+        }
+        if (loadDone.testAndSetOrdered(1, 0))
+            finishLoad();
+    }
+    close(fd);
+    qDebug() << "OSC control stopped. Worst latency: " << (int)worst << " us";
+}
+
+bool OscControl::parse(const char * p, int size, int depth)
+{
+    if (size < 16 || memcmp(p, "#bundle", 8))
+        return parseMessage(p, size);
+    // Elements after the time tag: size, then message or bundle
+    if (depth > 8)
+        return false;
+    for (int pos = 16; pos < size; )
+    {
+        if (pos + 4 > size)
+            return false;
+        int length = bigEndian(p + pos);
+        pos += 4;
+        if (length <= 0 || length % 4 || length > size - pos || !parse(p + pos, length, depth + 1))
+            return false;
+        pos += length;
+    }
+    return true;
+}
+
+bool OscControl::parseMessage(const char * p, int size)
+{
+    int pos = stringEnd(p, size, 0);
+    // Type tags are required
+    if (pos < 0 || p[0] != '/' || pos >= size || p[pos] != ',')
+        return false;
+    Message m;
+    m.type = p[pos + 1];
+    m.i = 0;
+    m.f = 0;
+    m.s = NULL;
+    pos = stringEnd(p, size, pos);
+    if (pos < 0)
+        return false;
+    // The first argument is the value; others are ignored
+    switch (m.type)
+    {
+    case 'i':
+    case 'f':
+    {
+        if (pos + 4 > size)
+            return false;
+        quint32 bits = bigEndian(p + pos);
+        m.i = (qint32)bits;
+        memcpy(&m.f, &bits, sizeof(m.f));
+        break;
+    }
+    case 's':
+        if (stringEnd(p, size, pos) < 0)
+            return false;
+        m.s = p + pos;
+        break;
+    case 'T':
+    case 'F':
+        break;
+    default:
+        // Nothing we can use
+        return true;
+    }
+    for (int row = 0; row < addresses.size(); row++)
+    {
+        if (!matches(p, addresses.at(row).constData()))
+            continue;
+        if (count == messages.size())
+            return false;
+        m.row = row;
+        messages[count++] = m;
+    }
+    return true;
+}
+
+bool OscControl::matches(const char * pattern, const char * address)
+{
+    for (;; pattern++, address++)
+    {
+        switch (*pattern)
+        {
+        case '\0':
+            return *address == '\0';
+        case '*':
+            // Any run of characters, within one part of the address
+            for (const char * a = address; ; a++)
+            {
+                if (matches(pattern + 1, a))
+                    return true;
+                if (*a == '\0' || *a == '/')
+                    return false;
+            }
+        case '?':
+            if (*address == '\0' || *address == '/')
+                return false;
+            break;
+        case '[':
+        {
+            const char * p = pattern + 1;
+            bool negate = *p == '!';
+            if (negate)
+                p++;
+            bool found = false;
+            for (; *p && *p != ']'; p++)
+            {
+                if (p[1] == '-' && p[2] && p[2] != ']')
+                {
+                    found = found || (*address >= p[0] && *address <= p[2]);
+                    p += 2;
+                }
+                else
+                    found = found || *p == *address;
+            }
+            if (!*p || !*address || found == negate)
+                return false;
+            pattern = p;
+            break;
+        }
+        case '{':
+        {
+            // Each alternative, followed by the rest of the pattern
+            const char * close = strchr(pattern, '}');
+            if (!close)
+                return false;
+            for (const char * alt = pattern + 1; alt <= close; )
+            {
+                const char * altEnd = alt;
+                while (altEnd != close && *altEnd != ',')
+                    altEnd++;
+                int n = altEnd - alt;
+                if (!strncmp(alt, address, n) && matches(close + 1, address + n))
+                    return true;
+                alt = altEnd + 1;
+            }
+            return false;
+        }
+        default:
+            if (*pattern != *address)
+                return false;
+        }
+    }
+}
+
+bool OscControl::toValue(int id, const Message & m, long & value) const
+{
+    const ElementSchema & schema = card->getSchema();
+    switch (controlBindings[m.row].kind)
+    {
+    case ControlBinding::Routing:
+    case ControlBinding::Item:
+        if (m.type == 'i')
+        {
+            value = m.i;
+            return schema.isValid(id, value);
+        }
+        if (m.type != 's')
+            return false;
+        for (unsigned int item = 0; item < schema.items(id); item++)
+            if (schema.itemName(id, item) == QLatin1String(m.s))
+            {
+                value = item;
+                return true;
+            }
+        return false;
+    case ControlBinding::Switch:
+        value = m.type == 'T' || (m.type == 'i' && m.i) || (m.type == 'f' && m.f != 0);
+        return m.type != 's';
+    case ControlBinding::Level:
+        if (m.type == 'f')
+        {
+            value = schema.min(id) + qRound(qBound(0.0f, m.f, 1.0f) * (schema.max(id) - schema.min(id)));
+            return true;
+        }
+        if (m.type != 'i')
+            return false;
+        value = schema.clamp(id, m.i);
+        return true;
+    }
+    return false;
+}
+
+void OscControl::apply(qint64 arrival)
+{
+    QMutexLocker locker(&cardLock);
+    if (!card || !count)
+        return;
+    WriteBatch batch;
+    for (int i = 0; i < count; i++)
+    {
+        const Message & m = messages.at(i);
+        int id = ids.at(m.row);
+        long value;
+        if (id < 0 || !toValue(id, m, value))
+            continue;
+        ElementWrite w;
+        w.id = id;
+        w.values.append(value);
+        batch.append(w);
+    }
+    if (batch.isEmpty())
+        return;
+    card->writeBatch(batch, this);
+    int latency = (monotonicNs() - arrival) / 1000;
+    if (latency > worst)
+        worst = latency;
+    if (loading)
+    {
+        loadMessages += batch.size();
+        loadLatency += latency;
+        loadPackets++;
+    }
+}
+
+void OscControl::finishLoad()
+{
+    load->wait();
+    QMutexLocker locker(&cardLock);
+    loading = false;
+    double seconds = load->elapsed / 1e9;
+    qDebug() << "OSC load test: " << load->sent << " bundles sent, " << loadPackets << " applied in "
+             << seconds << " s: " << loadPackets / seconds << " bundles/s, "
+             << loadMessages / seconds << " messages/s, latency mean "
+             << (loadPackets ? loadLatency / loadPackets : 0) << " us, worst " << (int)worst << " us";
+    if (!card || loadState.isEmpty())
+        return;
+    // Put back whatever the test changed, as one batch
+    const ElementSchema & schema = card->getSchema();
+    QVector<long> state = card->getCachedState();
+    WriteBatch batch;
+    for (int id = 0; id < schema.size(); id++)
+    {
+        const long * before = loadState.constData() + schema.offset(id);
+        if (!memcmp(before, state.constData() + schema.offset(id), schema.count(id) * sizeof(long)))
+            continue;
+        ElementWrite w;
+        w.id = id;
+        for (unsigned int ch = 0; ch < schema.count(id); ch++)
+            w.values.append(before[ch]);
+        batch.append(w);
+    }
+    card->writeBatch(batch, this);
+    loadState.clear();
+}
@@ -0,0 +1,150 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef OSCCONTROL_H
+#define OSCCONTROL_H
+
+#include <QThread>
+#include <QMutex>
+#include <QAtomicInt>
+#include <QVector>
+#include <QByteArray>
+
+class SoundCard;
+class OscLoad;
+
+/** OSC (Open Sound Control) input over UDP.
+    Every bound control (see controlbindings.h) answers to /emutrix/WIDGET,
+    e.g. /emutrix/master, /emutrix/rate, /emutrix/d1pad or /emutrix/b11
+    (matrix column). Arguments, by kind of control:
+    - routing and rate: ALSA item index (i) or item name (s)
+    - pads: i, f, T or F; nonzero is on
+    - master: 0-1 of the range (f) or a raw value (i)
+    Addresses may be patterns (*, ?, [a-z], {a,b}), so /emutrix/d?pad
+    switches the Audio Dock output pads.
+
+    Each datagram is written as one SoundCard::writeBatch(): a bundle,
+    nested bundles included, is one atomic batch (and one undo step).
+    Time tags are ignored, bundles are applied as they arrive.
+    Datagrams are parsed in place from a preallocated buffer, into a
+    preallocated list of writes, so parsing allocates nothing.
+
+    Settings: "osc/port" (default 7770, 0 disables) and "osc/address"
+    (default 127.0.0.1; 0.0.0.0 to listen on all interfaces).
+    */
+class OscControl : public QThread
+{
+    Q_OBJECT
+
+public:
+    OscControl(QObject * parent = 0);
+    /** Destructor.
+        Stops the load generator and the thread.
+        */
+    ~OscControl();
+
+    /** Set card to write to.
+        Blocks until writes in progress are done, so the previous card
+        can be deleted afterwards. NULL detaches.
+        */
+    void setCard(SoundCard * c);
+    /// Ask thread to finish.
+    void stop();
+
+    /// Worst latency from datagram arrival to completed batch, in microseconds.
+    int worstLatency() const;
+    /// Datagrams applied so far
+    int processed() const;
+
+    /** Runs a local load generator.
+        Sends bundles of routing and master changes to the server as fast
+        as it takes them, then prints throughput and latency, and writes
+        back the card's state from before the test, as one batch.
+        Call once the server is running and a card is set.
+        @param seconds How long to run
+        @param bundle Messages per bundle
+        */
+    void generateLoad(int seconds, int bundle);
+
+protected:
+    void run();
+
+private:
+    /// One message, as parsed
+    struct Message
+    {
+        /// Binding table row
+        int row;
+        /// OSC type tag of the argument
+        char type;
+        qint32 i;
+        float f;
+        /// Points into the datagram
+        const char * s;
+    };
+
+    /// Parses a packet (message or bundle) into messages; false if malformed
+    bool parse(const char * p, int size, int depth);
+    bool parseMessage(const char * p, int size);
+    /// Writes parsed messages as one batch
+    void apply(qint64 arrival);
+    /// Element value for a message, false if it has none
+    bool toValue(int id, const Message & m, long & value) const;
+    /// Load test over: report and put the card back as it was
+    void finishLoad();
+
+    /** OSC address pattern matching.
+        @param pattern Address pattern, may have * ? [] {}
+        @param address Address to match
+        */
+    static bool matches(const char * pattern, const char * address);
+
+    int port;
+    QByteArray host;
+    /// Address of each binding row
+    QVector<QByteArray> addresses;
+    /// Datagram buffer
+    QVector<char> buffer;
+    /// Messages of the datagram being parsed; count used
+    QVector<Message> messages;
+    int count;
+
+    /// Card to write to and element ids of binding rows, guarded by cardLock
+    SoundCard * card;
+    QVector<int> ids;
+    QMutex cardLock;
+    QAtomicInt stopping;
+    /// Worst latency seen, in microseconds
+    QAtomicInt worst;
+    QAtomicInt packets;
+
+    /// Load generator, once started; loadDone is set when it's finished
+    OscLoad * load;
+    QAtomicInt loadDone;
+    /// Load test running, guarded by cardLock
+    bool loading;
+    /// State before the load test, written back when it's done
+    QVector<long> loadState;
+    /// Messages and total latency (us) during the load test
+    qint64 loadMessages;
+    qint64 loadLatency;
+    int loadPackets;
+
+    friend class OscLoad;
+};
+
+#endif // OSCCONTROL_H
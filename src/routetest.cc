@@ -0,0 +1,190 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "routetest.h"
+#include "correlator.h"
+#include "soundcard.h"
+#include <QSettings>
+#include <QDebug>
+#include <cmath>
+
+/// Samples of silence before the MLS
+static const int preRoll = 4800;
+/// Largest latency looked for, 200 ms
+static const int maxLag = 9600;
+/// Frames per read and write
+static const int chunk = 1024;
+
+RouteTest::RouteTest(SoundCard * card, QObject * parent)
+    : QThread(parent), card(card)
+{
+}
+
+RouteTest::~RouteTest()
+{
+    wait();
+}
+
+snd_pcm_t * RouteTest::openPcm(const QString & device, snd_pcm_stream_t stream, int channels)
+{
+    snd_pcm_t * pcm;
+    int err = snd_pcm_open(&pcm, device.toLatin1().constData(), stream, 0);
+    if (err < 0)
+        throw QString("Can't open %1: %2").arg(device).arg(snd_strerror(err));
+    err = snd_pcm_set_params(pcm, SND_PCM_FORMAT_S32_LE, SND_PCM_ACCESS_RW_INTERLEAVED,
+                             channels, 48000, 1, 100000);
+    if (err < 0)
+    {
+        snd_pcm_close(pcm);
+        throw QString("Can't set up %1: %2").arg(device).arg(snd_strerror(err));
+    }
+    return pcm;
+}
+
+QVector<float> RouteTest::playAndRecord(const QVector<float> & signal)
+{
+    QSettings settings;
+    int index = card->getIndex();
+    QString playDevice = settings.value("selftest/playback", "hw:%1,3").toString().arg(index);
+    int playChannels = settings.value("selftest/playbackChannels", 16).toInt();
+    int playChannel = settings.value("selftest/playbackChannel", 0).toInt();
+    QString captureDevice = settings.value("selftest/capture", "hw:%1,2").toString().arg(index);
+    int captureChannels = settings.value("selftest/captureChannels", 16).toInt();
+    int captureChannel = settings.value("selftest/captureChannel", 0).toInt();
+    if (playChannel < 0 || playChannel >= playChannels || captureChannel < 0 || captureChannel >= captureChannels)
+        throw QString("Bad self-test channel settings");
+
+    snd_pcm_t * play = openPcm(playDevice, SND_PCM_STREAM_PLAYBACK, playChannels);
+    snd_pcm_t * capture = NULL;
+    QVector<float> recording(signal.size());
+    try
+    {
+        capture = openPcm(captureDevice, SND_PCM_STREAM_CAPTURE, captureChannels);
+        // Linked streams start together, so the lag is the route's alone
+        bool linked = snd_pcm_link(capture, play) == 0;
+        if (!linked)
+            qDebug() << "Warning: Route test: Can't link " << playDevice << " and " << captureDevice
+                     << ", latency includes their start offset";
+        QVector<qint32> out(chunk * playChannels, 0);
+        QVector<qint32> in(chunk * captureChannels);
+        int frames = signal.size();
+        int written = 0, read = 0;
+        while (read < frames)
+        {
+            // Playback stays two chunks ahead, silence after the signal
+            while (written - read < 2 * chunk)
+            {
+                for (int i = 0; i < chunk; i++)
+                    out[i * playChannels + playChannel] =
+                        written + i < frames ? (qint32)(signal.at(written + i) * 2147483647.0f) : 0;
+                snd_pcm_sframes_t r = snd_pcm_writei(play, out.constData(), chunk);
+                if (r < 0)
+                    throw QString("Playback failed (%1), try again").arg(snd_strerror(r));
+                written += r;
+            }
+            if (!linked && read == 0)
+                snd_pcm_start(play);
+            // Reading starts the capture, and with it the playback
+            snd_pcm_sframes_t r = snd_pcm_readi(capture, in.data(), chunk);
+            if (r < 0)
+                throw QString("Capture failed (%1), try again").arg(snd_strerror(r));
+            for (int i = 0; i < r && read + i < frames; i++)
+                recording[read + i] = in.at(i * captureChannels + captureChannel) * (1.0f / 2147483648.0f);
+            read += r;
+        }
+    }
+    catch (QString)
+    {
+        if (capture)
+            snd_pcm_close(capture);
+        snd_pcm_close(play);
+        throw;
+    }
+    snd_pcm_drop(play);
+    snd_pcm_close(capture);
+    snd_pcm_close(play);
+    return recording;
+}
+
+void RouteTest::run()
+{
+    QSettings settings;
+    QString destination = settings.value("selftest/destination", "DSP A Capture Enum").toString();
+    QString source = settings.value("selftest/source", "DSP 0").toString();
+    const ElementSchema & schema = card->getSchema();
+    int id = -1;
+    QVector<long> saved;
+    bool ok = false;
+    QString report;
+    try
+    {
+        if (!destination.isEmpty())
+        {
+            id = schema.find(destination);
+            if (id < 0)
+                throw QString("No routing element %1").arg(destination);
+            int item = schema.itemIndex(id, source);
+            if (item < 0)
+                throw QString("%1 can't be routed to %2").arg(source).arg(destination);
+            saved = card->getCached(id);
+            WriteBatch loop;
+            ElementWrite w;
+            w.id = id;
+            w.values.append(item);
+            loop.append(w);
+            if (!card->writeBatch(loop, this))
+                throw QString("Can't route %1 to %2").arg(source).arg(destination);
+            // Let the routing settle before playing
+            msleep(50);
+        }
+        QVector<float> reference = Correlator::mls(15, 0.5f);
+        Correlator correlator(reference, maxLag);
+        QVector<float> signal(preRoll + correlator.recordingSize(), 0);
+        for (int i = 0; i < reference.size(); i++)
+            signal[preRoll + i] = reference.at(i);
+        QVector<float> recording = playAndRecord(signal);
+        // Lags count from the start of the MLS
+        Correlator::Result r;
+        QString route = destination.isEmpty() ? QString("Loopback") : source + " -> " + destination;
+        if (!correlator.analyze(recording.constData() + preRoll, r))
+            report = tr("%1: the test signal didn't come back").arg(route);
+        else
+        {
+            ok = r.corrupted == 0;
+            report = tr("%1: latency %2 samples (%3 ms), gain %4 dB%5, %6 of %7 samples corrupted, SNR %8 dB")
+                     .arg(route).arg(r.lag).arg(r.lag / 48.0, 0, 'f', 2)
+                     .arg(20 * log10(qAbs(r.gain)), 0, 'f', 1).arg(r.gain < 0 ? tr(" (inverted)") : QString())
+                     .arg(r.corrupted).arg(reference.size()).arg(r.snr, 0, 'f', 1);
+        }
+    }
+    catch (QString err)
+    {
+        report = err;
+    }
+    if (!saved.isEmpty())
+    {
+        WriteBatch restore;
+        ElementWrite w;
+        w.id = id;
+        w.values = saved;
+        restore.append(w);
+        if (!card->writeBatch(restore, this))
+            report += tr("; routing could NOT be restored");
+    }
+    qDebug() << "Route test: " << report;
+    emit done(ok, report);
+}
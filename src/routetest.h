@@ -0,0 +1,78 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef ROUTETEST_H
+#define ROUTETEST_H
+
+#include <QThread>
+#include <QString>
+#include <QVector>
+#include "alsa/asoundlib.h"
+
+class SoundCard;
+
+/** Round trip self-test of a route.
+    Programs the matrix so a playback channel loops back to a capture
+    channel, plays an MLS through it while recording, and finds the MLS
+    in the recording (see Correlator): latency in samples, gain and
+    corrupted samples. The routing is then written back as it was, in
+    one batch. Runs on its own thread; the result comes with done().
+
+    Settings ("selftest/..."), defaults for the E-mu 1010 family:
+    - "destination": routing element looped back, default
+      "DSP A Capture Enum"; empty leaves the routing alone (e.g. with
+      snd-aloop devices below)
+    - "source": routing item fed to it, default "DSP 0"
+    - "playback", "playbackChannels", "playbackChannel": PCM device
+      ("hw:%1,3", %1 being the card index), its channel count (16) and
+      the channel played (0)
+    - "capture", "captureChannels", "captureChannel": same for the
+      recording ("hw:%1,2", 16, 0)
+    */
+class RouteTest : public QThread
+{
+    Q_OBJECT
+
+public:
+    /** @param card Card whose routing is programmed; also the PCM devices' card */
+    RouteTest(SoundCard * card, QObject * parent = 0);
+    /** Waits for the test to finish. */
+    ~RouteTest();
+
+signals:
+    /** Test over.
+        @param ok Whether the signal came back intact
+        @param report What was found, or what went wrong
+        */
+    void done(bool ok, const QString & report);
+
+protected:
+    void run();
+
+private:
+    /// Opens a PCM device for 32 bit interleaved samples at 48 kHz. Throws QString.
+    static snd_pcm_t * openPcm(const QString & device, snd_pcm_stream_t stream, int channels);
+    /** Plays signal on one channel while recording another.
+        Throws QString.
+        @return Recording, as long as signal
+        */
+    QVector<float> playAndRecord(const QVector<float> & signal);
+
+    SoundCard * card;
+};
+
+#endif // ROUTETEST_H
@@ -0,0 +1,157 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "shmstate.h"
+#include "monotonic.h"
+#include <QDebug>
+#include <stdio.h>
+#include <errno.h>
+
+ShmState::ShmState(SoundCard * c) : card(c), header(NULL), values(NULL), size(0)
+{
+    // Readers find segments by ALSA card index
+    if (card->isVirtual())
+        return;
+    const ElementSchema & schema = card->getSchema();
+    name = QString("/emutrix.%1").arg(card->getIndex()).toLatin1();
+    size = emutrix_shm_size(schema.size(), schema.valueCount());
+    // No O_TRUNC: a segment left behind may still be mapped by readers,
+    // who'd get SIGBUS if it shrank under them. Resized to the final size.
+    int fd = shm_open(name.data(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0 || ftruncate(fd, size) < 0)
+    {
+        qDebug() << "Warning: Couldn't create shared memory segment " << name << ": " << strerror(errno);
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    void * mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED)
+    {
+        qDebug() << "Warning: Couldn't map shared memory segment " << name << ": " << strerror(errno);
+        shm_unlink(name.data());
+        return;
+    }
+    header = (emutrix_shm_header *)mem;
+    // Readers still on an old segment see it being written
+    header->magic = 0;
+    header->seq = 1;
+    __sync_synchronize();
+    // Element table, written once
+    header->version = EMUTRIX_SHM_VERSION;
+    header->elements = schema.size();
+    header->values = schema.valueCount();
+    header->card = card->getIndex();
+    strncpy(header->card_name, card->getName().toLatin1().data(), sizeof(header->card_name) - 1);
+    emutrix_shm_element * elements = emutrix_shm_elements(header);
+    for (int id = 0; id < schema.size(); id++)
+    {
+        strncpy(elements[id].name, schema.name(id).toLatin1().data(), EMUTRIX_SHM_NAME_LEN - 1);
+        elements[id].type = schema.type(id);
+        elements[id].index = schema.index(id);
+        elements[id].count = schema.count(id);
+        elements[id].offset = schema.offset(id);
+        elements[id].min = schema.min(id);
+        elements[id].max = schema.max(id);
+    }
+    values = emutrix_shm_values(header);
+    // Current state, then start following changes
+    QVector<long> state = card->getCachedState();
+    for (int i = 0; i < state.size(); i++)
+        values[i] = state.at(i);
+    __sync_synchronize();
+    header->seq = 2;
+    // Readers check magic last
+    __sync_synchronize();
+    header->magic = EMUTRIX_SHM_MAGIC;
+    card->addObserver(this);
+    qDebug() << "Publishing card state in shared memory " << name;
+}
+
+ShmState::~ShmState()
+{
+    if (!header)
+        return;
+    card->removeObserver(this);
+    munmap(header, size);
+    shm_unlink(name.data());
+}
+
+void ShmState::elementChanged(const SoundCard *, const CardChange & change)
+{
+    // Single writer: observers run with the card lock held
+    const ElementSchema & schema = card->getSchema();
+    int32_t * dest = values + schema.offset(change.id);
+    header->seq++;
+    __sync_synchronize();
+    for (unsigned int i = 0; i < schema.count(change.id); i++)
+        dest[i] = change.values[i];
+    __sync_synchronize();
+    header->seq++;
+}
+
+bool ShmState::benchmark(int card)
+{
+    emutrix_shm * s = emutrix_shm_open(card);
+    if (!s)
+    {
+        qDebug() << "No shared memory state for card " << card << ", is emutrix running?";
+        return false;
+    }
+    emutrix_shm_header * h = s->header;
+    // Snapshots, enough for ~ 0.2 s
+    QVector<int32_t> out(h->values);
+    int runs = qMax(100, (int)(100000000 / (h->values + 1)));
+    qint64 start = monotonicNs();
+    for (int r = 0; r < runs; r++)
+        if (emutrix_shm_snapshot(h, out.data()))
+        {
+            qDebug() << "Shared memory segment stuck mid update, is emutrix hanging?";
+            emutrix_shm_close(s);
+            return false;
+        }
+    double shmUs = (monotonicNs() - start) / 1000.0 / runs;
+    qDebug() << "Shared memory: " << h->elements << " elements, " << h->values << " values, "
+             << shmUs << " us per snapshot";
+    emutrix_shm_close(s);
+    // What scripts do now: a process walking every control
+    QByteArray command = QString("amixer -c %1 contents").arg(card).toLatin1();
+    const int amixerRuns = 20;
+    start = monotonicNs();
+    for (int r = 0; r < amixerRuns; r++)
+    {
+        FILE * pipe = popen(command.data(), "r");
+        if (!pipe)
+        {
+            qDebug() << "Can't run amixer: " << strerror(errno);
+            return false;
+        }
+        char buffer[4096];
+        while (fread(buffer, 1, sizeof(buffer), pipe) > 0)
+            ;
+        if (pclose(pipe) != 0)
+        {
+            qDebug() << "amixer failed";
+            return false;
+        }
+    }
+    double amixerUs = (monotonicNs() - start) / 1000.0 / amixerRuns;
+    qDebug() << "amixer contents: " << amixerUs << " us per run, "
+             << amixerUs / shmUs << " times the snapshot";
+    return true;
+}
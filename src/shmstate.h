@@ -0,0 +1,62 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef SHMSTATE_H
+#define SHMSTATE_H
+
+#include <QByteArray>
+#include "soundcard.h"
+#include "emutrix_shm.h"
+
+/** Publishes a card's state in POSIX shared memory.
+    Other local processes can map the segment and take consistent
+    snapshots of all element values without asking ALSA (or us) anything.
+    Layout is described in emutrix_shm.h, and is derived from the card's
+    element schema. Updated on every change through CardObserver.
+    */
+class ShmState : public CardObserver
+{
+public:
+    /** Creates the segment and publishes the current state.
+        Registers with the card. On failure, a warning is printed and
+        nothing is published. Virtual cards are never published.
+        */
+    ShmState(SoundCard * card);
+    /** Unregisters from the card and removes the segment. */
+    ~ShmState();
+
+    void elementChanged(const SoundCard * card, const CardChange & change);
+
+    /** Compares reading card state from the segment of a running emutrix
+        with running amixer, as scripts do. Prints the time per snapshot and
+        per amixer run.
+        @return false if the segment or amixer weren't there
+        */
+    static bool benchmark(int card);
+
+private:
+    SoundCard * card;
+    /// Segment name
+    QByteArray name;
+    /// Mapped segment, NULL if not available
+    emutrix_shm_header * header;
+    /// Values area in the segment
+    int32_t * values;
+    size_t size;
+};
+
+#endif // SHMSTATE_H
@@ -16,10 +16,23 @@
 
 #include "soundcard.h"
 #include "sanealsa.h"
-#include "mainwindow.h"
-#include "ui_mainwindow.h"
+#include "controlbindings.h"
 #include <QDebug>
 #include <QString>
+#include <QMutexLocker>
+#include <QVarLengthArray>
+#include <QtAlgorithms>
+#include <unistd.h>
+#include "monotonic.h"
+
+/// Events handled in one go before the GUI gets a chance to run
+static const int maxDrain = 4096;
+/// Report how long absorbing took when this many elements changed at once
+static const int stormReport = 16;
+/// Time the firmware gets to settle after a clock rate change (ns)
+static const qint64 resyncDelay = 50000000LL;
+/// How often processEvents() reads the pads, whose changes aren't reported (ns)
+static const qint64 padPollInterval = 100000000LL;
 
 /// call ALSA function or die trying.
 void tryAlsa(int err)
@@ -50,23 +63,40 @@ QList<QPair<QString, int> > SoundCard::getCardList()
     return list;
 }
 
-SoundCard::SoundCard(int index) : index(index), hctl(NULL), window(NULL)
+SoundCard::SoundCard(int index, bool defaults)
+    : index(index), hctl(NULL), stormEvents(0), stormStart(0), changedEvents(0), changedSince(0), quiet(false),
+      rateId(-1), rateResync(true), rateChangedAt(0), padsPolledAt(0), simulatedLatency(0), writeOrigin(NULL), elementLocks(NULL),
+      lock(QMutex::Recursive), window(NULL)
 {
-    // Create a new element_value object, use thorugh this class to write to ALSA mixer
-    tryAlsa(snd_ctl_elem_value_malloc(&value));
     qDebug("Opening card...");
     QString name = QString("hw:") + QString().number(index);
     if (snd_hctl_open(&hctl, name.toLatin1().data(), SND_CTL_NONBLOCK))
-        throw "Oops. Couldn't access sound card.";
+        throw QString("Oops. Couldn't access sound card.");
     qDebug("Loading card elements...");
     tryAlsa(snd_hctl_load(hctl));
-    // Populate elements map to make stuff easier in the future
+    // Element descriptions, read once. Element ids are hctl positions.
+    schema = ElementSchema::fromCard(hctl);
     elements.clear();
-    for (snd_hctl_elem_t * el = snd_hctl_first_elem(hctl);
-      el != snd_hctl_last_elem(hctl);
-      el = snd_hctl_elem_next(el))
-        elements.insert(snd_hctl_elem_get_name(el), el);
-    qDebug() << elements.size() << " elements loaded. Setting start defaults...;";
+    elements.reserve(schema->size());
+    elementIds.clear();
+    for (snd_hctl_elem_t * el = snd_hctl_first_elem(hctl); el; el = snd_hctl_elem_next(el))
+    {
+        elementIds.insert(el, elements.size());
+        elements.append(el);
+    }
+    dirtyMask.resize(schema->size());
+    changedMask.resize(schema->size());
+    allocateValues();
+    // Read everything once, later reads and writes keep the cache current
+    state.fill(0, schema->valueCount());
+    // (some elements aren't readable, those stay at 0).
+    for (int id = 0; id < schema->size(); id++)
+        if (snd_hctl_elem_read(elements.at(id), valueBuffers.at(id)) >= 0)
+            store(id, false);
+    qDebug() << elements.size() << " elements loaded.";
+    if (!defaults)
+        return;
+    qDebug("Setting start defaults...");
     // Set "sane" values, mostly to elements not controllable from within the program
     for (int i = 0; sanealsa_0[i] != ""; i++)
         writeStereoInt(sanealsa_0[i], 0);
@@ -76,269 +106,765 @@ SoundCard::SoundCard(int index) : index(index), hctl(NULL), window(NULL)
         writeBool(sanealsa_false[i], false);
 }
 
+SoundCard::SoundCard(ElementSchema::Pointer schema, const QVector<long> & state, const QString & name)
+    : index(-1), hctl(NULL), schema(schema), virtualName(name), stormEvents(0), stormStart(0), changedEvents(0), changedSince(0), quiet(false),
+      rateId(-1), rateResync(true), rateChangedAt(0), padsPolledAt(0), state(state), device(state), simulatedLatency(0), writeOrigin(NULL),
+      elementLocks(NULL), lock(QMutex::Recursive), window(NULL)
+{
+    if (state.size() != schema->valueCount())
+        throw QString("Card state doesn't match its elements.");
+    // Private copies now: a detach in a later data() call would reallocate
+    // under readers holding only an element lock (readDevice, readValue)
+    this->state.detach();
+    device.detach();
+    elements.fill(NULL, schema->size());
+    allocateValues();
+    dirtyMask.resize(schema->size());
+    changedMask.resize(schema->size());
+    qDebug() << "Virtual card " << name << " with " << elements.size() << " elements.";
+}
+
 SoundCard::~SoundCard()
 {
-    snd_ctl_elem_value_free(value);
+    for (QVector<snd_ctl_elem_value_t *>::iterator it = valueBuffers.begin(); it != valueBuffers.end(); ++it)
+        snd_ctl_elem_value_free(*it);
+    delete [] elementLocks;
     if (hctl)
       snd_hctl_free(hctl);
 }
 
+void SoundCard::allocateValues()
+{
+    // One buffer per element, used through this class to read and write ALSA elements
+    valueBuffers.fill(NULL, schema->size());
+    for (int id = 0; id < schema->size(); id++)
+        tryAlsa(snd_ctl_elem_value_malloc(&valueBuffers[id]));
+    elementLocks = new QMutex[schema->size()];
+}
+
 QString SoundCard::getName()
 {
+    if (!hctl)
+        return virtualName;
     char * name;
     assert(!snd_card_get_name(index, &name));
     return QString(name);
 }
 
-void SoundCard::setupCallbacks(MainWindow * w)
+QString SoundCard::getId()
+{
+    if (!hctl)
+        return virtualName;
+    QMutexLocker locker(&lock);
+    snd_ctl_card_info_t * info;
+    tryAlsa(snd_ctl_card_info_malloc(&info));
+    QString id;
+    if (snd_ctl_card_info(snd_hctl_ctl(hctl), info) == 0)
+        id = snd_ctl_card_info_get_id(info);
+    snd_ctl_card_info_free(info);
+    return id;
+}
+
+int SoundCard::getIndex() const
+{
+    return index;
+}
+
+bool SoundCard::isVirtual() const
+{
+    return !hctl;
+}
+
+const ElementSchema & SoundCard::getSchema() const
+{
+    return *schema;
+}
+
+QVector<long> SoundCard::getCached(int id)
+{
+    QMutexLocker locker(&lock);
+    return state.mid(schema->offset(id), schema->count(id));
+}
+
+QVector<long> SoundCard::getCachedState()
 {
-    window = w;
+    QMutexLocker locker(&lock);
+    return state;
+}
+
+void SoundCard::addObserver(CardObserver * o)
+{
+    QMutexLocker locker(&lock);
+    observers.append(o);
+}
+
+void SoundCard::removeObserver(CardObserver * o)
+{
+    QMutexLocker locker(&lock);
+    observers.removeAll(o);
+}
+
+void SoundCard::setupCallbacks(CardView * v)
+{
+    QMutexLocker locker(&lock);
+    window = v;
     qDebug("Registering callbacks with ALSA");
     assert(!elements.empty());
-    // Setup ALSA callbacks for two special controls... Also sets initial values with a fake callback
-    setAlsaCallback("Master Playback Volume", (snd_hctl_elem_callback_t)&SoundCard::alsaMasterChanged);
-    setAlsaCallback("Clock Internal Rate", &SoundCard::alsaRateChanged);
-    // ..and for all those pads and routing enums.
-    for (QMap<QString, snd_hctl_elem_t *>::iterator it = elements.begin();
-        it != elements.end();
-        ++it)
-        if (it.key().contains("PAD"))
-            setAlsaCallback(it.key().toLatin1().data(), &SoundCard::alsaPadChanged);
-        else if (it.key().endsWith("Enum"))
-            setAlsaCallback(it.key().toLatin1().data(), &SoundCard::alsaRoutingChanged);
+    rateId = schema->id("Clock Internal Rate");
+    bindings.fill(-1, schema->size());
+    watched.fill(false, schema->size());
+    // Follow the elements of the binding table, and all pads and routing
+    // enums. Also sets initial values with a fake callback.
+    pads.clear();
+    resyncIds.clear();
+    for (int id = 0; id < schema->size(); id++)
+    {
+        const QString & name = schema->name(id);
+        int row = controlBindingRow(name);
+        if (name.contains("PAD"))
+        {
+            pads.append(id);
+            resyncIds.append(id);
+        }
+        else if (name.endsWith("Enum"))
+            resyncIds.append(id);
+        else if (row < 0)
+            continue;
+        watch(id, row);
+    }
+}
+
+void SoundCard::setRateResync(bool on)
+{
+    QMutexLocker locker(&lock);
+    rateResync = on;
+}
+
+void SoundCard::watchAll()
+{
+    QMutexLocker locker(&lock);
+    // Like watch(), but without reading: not every element is readable,
+    // and the constructor read those that are.
+    for (int id = 0; id < schema->size(); id++)
+    {
+        snd_hctl_elem_t * el = elements.at(id);
+        if (watched.testBit(id) || !el)
+            continue;
+        if (schema->name(id).contains("PAD"))
+            pads.append(id);
+        watched.setBit(id);
+        snd_hctl_elem_set_callback_private(el, this);
+        snd_hctl_elem_set_callback(el, &SoundCard::alsaElementChanged);
+    }
 }
 
 void SoundCard::updateCallbacks()
 {
     // qDebug("Timer click!");
-    // Handle ALSA callbacks.
-    if (snd_hctl_wait(hctl, 10))
-        snd_hctl_handle_events(hctl);
+    processEvents(10);
+    updateWindow();
+}
+
+int SoundCard::processEvents(int timeout)
+{
+    int events = 0;
+    if (hctl)
+    {
+        // Handle ALSA callbacks. Don't hold the lock while waiting, writers
+        // on other threads would stall.
+        events = snd_hctl_wait(hctl, timeout);
+        QMutexLocker locker(&lock);
+        if (events > 0)
+            events = drainEvents();
+    }
+    // Virtual cards have no ALSA events; wait as long as ALSA would,
+    // unless simulated ones are pending. simulateEvent() marks them from
+    // other threads, so look under the lock, but don't sleep holding it.
+    else
+    {
+        bool idle;
+        {
+            QMutexLocker locker(&lock);
+            idle = dirty.isEmpty();
+        }
+        if (idle)
+            usleep(timeout * 1000);
+    }
+    QMutexLocker locker(&lock);
+    if (!hctl)
+        events = dirty.size();
+    pollPads();
+    flushEvents();
+    if (rateChangedAt && monotonicNs() - rateChangedAt >= resyncDelay)
+        resync();
+    return qMax(events, 0);
+}
+
+void SoundCard::pollPads()
+{
     // Workaround for driver bug: The driver doesn't report pad changes.
-    // Poll manually.
-    for (QMap<QString, snd_hctl_elem_t *>::iterator it = elements.begin();
-        it != elements.end();
-        ++it)
-        if (it.key().contains("PAD"))
-            alsaPadChanged(it.value(), SND_CTL_EVENT_MASK_VALUE);
+    // Poll now and then, and only read back (and notify) those that changed.
+    qint64 now = monotonicNs();
+    if (pads.isEmpty() || now - padsPolledAt < padPollInterval)
+        return;
+    padsPolledAt = now;
+    QVector<long> values;
+    for (QVector<int>::const_iterator it = pads.begin(); it != pads.end(); ++it)
+        if (readDevice(*it, values)
+            && !qEqual(values.constBegin(), values.constEnd(), state.constBegin() + schema->offset(*it)))
+            markDirty(*it);
+}
+
+void SoundCard::updateWindow()
+{
+    QMutexLocker locker(&lock);
+    if (changed.isEmpty())
+        return;
+    // Update the window once for all changes
+    quiet = changed.size() > 1;
+    if (window)
+    {
+        if (quiet)
+            window->holdUpdates(true);
+        for (QVector<int>::const_iterator it = changed.begin(); it != changed.end(); ++it)
+            if (watched.testBit(*it))
+                showElement(*it);
+        if (quiet)
+            window->holdUpdates(false);
+    }
+    if (changed.size() >= stormReport)
+        qDebug() << "Absorbed " << qMax(changedEvents, changed.size()) << " events on "
+                 << changed.size() << " elements in "
+                 << (monotonicNs() - changedSince) / 1000 << " us";
+    quiet = false;
+    for (QVector<int>::const_iterator it = changed.begin(); it != changed.end(); ++it)
+        changedMask.clearBit(*it);
+    changed.clear();
+    changedEvents = 0;
+}
+
+void SoundCard::windowChanged(int id)
+{
+    if (changedMask.testBit(id))
+        return;
+    if (changed.isEmpty())
+        changedSince = dirty.isEmpty() ? monotonicNs() : stormStart;
+    changedMask.setBit(id);
+    changed.append(id);
+}
+
+void SoundCard::resync()
+{
+    // Routes and pads as the firmware left them, in one pass. These reads
+    // are the firmware's doing, not expected changes: stop tracking first.
+    qint64 since = rateChangedAt;
+    rateChangedAt = 0;
+    for (QVector<int>::const_iterator it = resyncIds.begin(); it != resyncIds.end(); ++it)
+        readValue(*it);
+    WriteBatch restore;
+    for (QVector<int>::const_iterator it = resyncIds.begin(); it != resyncIds.end(); ++it)
+    {
+        int offset = schema->offset(*it);
+        unsigned int n = schema->count(*it);
+        if (qEqual(state.constBegin() + offset, state.constBegin() + offset + n,
+                   expected.constBegin() + offset))
+            continue;
+        ElementWrite w;
+        w.id = *it;
+        w.values = expected.mid(offset, n);
+        restore.append(w);
+    }
+    if (!restore.isEmpty())
+    {
+        writeBatch(restore);
+        // Widgets show what the firmware did; put them back too
+        for (WriteBatch::const_iterator w = restore.begin(); w != restore.end(); ++w)
+            windowChanged(w->id);
+    }
+    qDebug() << "Clock rate changed: " << restore.size() << " of " << resyncIds.size()
+             << " routes and pads restored, card was inconsistent for "
+             << (monotonicNs() - since) / 1000 << " us";
+    expected.clear();
+}
+
+int SoundCard::drainEvents()
+{
+    // Callbacks only mark elements dirty. Another client (alsactl restore,
+    // a DAW) may be changing lots of elements: drain while events keep
+    // coming, but don't starve the GUI.
+    int events = 0;
+    do
+    {
+        int n = snd_hctl_handle_events(hctl);
+        if (n <= 0)
+            break;
+        events += n;
+    }
+    while (events < maxDrain && snd_hctl_wait(hctl, 0) > 0);
+    stormEvents += events;
+    return events;
+}
+
+void SoundCard::handleEvent(int id, unsigned int mask)
+{
+    for (QList<CardObserver *>::iterator it = observers.begin(); it != observers.end(); ++it)
+        (*it)->elementEvent(this, id, mask);
+    // Read back later, once per element, see flushEvents()
+    if (mask == SND_CTL_EVENT_MASK_VALUE)
+        markDirty(id);
+}
+
+void SoundCard::markDirty(int id)
+{
+    if (dirtyMask.testBit(id))
+        return;
+    if (dirty.isEmpty())
+        stormStart = monotonicNs();
+    dirtyMask.setBit(id);
+    dirty.append(id);
+}
+
+void SoundCard::flushEvents()
+{
+    if (dirty.isEmpty())
+        return;
+    // Read back every changed element once, with its latest value. The
+    // window follows on the next updateWindow().
+    for (QVector<int>::const_iterator it = dirty.begin(); it != dirty.end(); ++it)
+    {
+        readValue(*it);
+        windowChanged(*it);
+    }
+    changedEvents += qMax(stormEvents, dirty.size());
+    for (QVector<int>::const_iterator it = dirty.begin(); it != dirty.end(); ++it)
+        dirtyMask.clearBit(*it);
+    dirty.clear();
+    stormEvents = 0;
+}
+
+void SoundCard::setSimulatedLatency(int us)
+{
+    QMutexLocker locker(&lock);
+    simulatedLatency = qMax(us, 0);
+}
+
+bool SoundCard::readDevice(int id, QVector<long> & values)
+{
+    if (id < 0 || id >= schema->size())
+        return false;
+    // Only what the cache holds
+    switch (schema->type(id))
+    {
+    case SND_CTL_ELEM_TYPE_INTEGER:
+    case SND_CTL_ELEM_TYPE_BOOLEAN:
+    case SND_CTL_ELEM_TYPE_ENUMERATED:
+        break;
+    default:
+        return false;
+    }
+    // Not the card lock: a poller shouldn't wait for writes to other elements
+    QMutexLocker locker(elementLocks + id);
+    if (hctl && snd_hctl_elem_read(elements.at(id), valueBuffers.at(id)) < 0)
+        return false;
+    if (!hctl)
+        setValue(id, device.constData() + schema->offset(id));
+    values.resize(schema->count(id));
+    getValue(id, values.data());
+    return true;
+}
+
+void SoundCard::refresh(const QVector<int> & ids)
+{
+    QMutexLocker locker(&lock);
+    for (QVector<int>::const_iterator it = ids.begin(); it != ids.end(); ++it)
+        if (*it >= 0 && *it < schema->size())
+            markDirty(*it);
+}
+
+QVector<int> SoundCard::unreportedElements()
+{
+    QMutexLocker locker(&lock);
+    return pads;
+}
+
+void SoundCard::simulateEvent(int id, const QVector<long> & values)
+{
+    if (id < 0 || id >= schema->size() || values.isEmpty() || !isVirtual())
+        return;
+    QMutexLocker locker(&lock);
+    simulateValue(id, values);
+    simulateEvent(id, SND_CTL_EVENT_MASK_VALUE);
+}
+
+void SoundCard::simulateEvent(int id, unsigned int mask)
+{
+    if (id < 0 || id >= schema->size() || !isVirtual())
+        return;
+    QMutexLocker locker(&lock);
+    stormEvents++;
+    handleEvent(id, mask);
+}
+
+void SoundCard::simulateValue(int id, const QVector<long> & values)
+{
+    if (id < 0 || id >= schema->size() || values.isEmpty() || !isVirtual())
+        return;
+    QMutexLocker locker(&lock);
+    {
+        QMutexLocker element(elementLocks + id);
+        // Whatever the driver would report, unvalidated
+        long * v = device.data() + schema->offset(id);
+        for (unsigned int i = 0; i < schema->count(id); i++)
+            v[i] = values.value(i, values.last());
+    }
+    markDirty(id);
 }
 
-void SoundCard::setAlsaCallback(const char * eln, snd_hctl_elem_callback_t cb)
+void SoundCard::watch(int id, int row)
 {
-  //  qDebug() << "Setting up " << eln << " callback...";
-    snd_hctl_elem_t * el = elements.find(eln).value();
-    // SoundCard is passed as private to static callbacks.
-    snd_hctl_elem_set_callback_private(el, this);
-    snd_hctl_elem_set_callback(el, cb);
+    bindings[id] = row;
+    watched.setBit(id);
+    snd_hctl_elem_t * el = elements.at(id);
+    if (el)
+    {
+        // SoundCard is passed as private to the static callback.
+        snd_hctl_elem_set_callback_private(el, this);
+        snd_hctl_elem_set_callback(el, &SoundCard::alsaElementChanged);
+    }
     // Fake callback to read initial values
-   // qDebug() << "Reading initial status";
-    cb(el, SND_CTL_EVENT_MASK_VALUE);
+    elementEvent(id);
 }
 
 ///// GENERIC ALSA WRITERS
-void SoundCard::writeValue(const QString &el)
+int SoundCard::elementId(const QString & el, int index) const
+{
+    int id = schema->id(el, index);
+    if (id < 0)
+        qDebug() << "Warning: Element " << el << "[" << index << "] not available!";
+    return id;
+}
+
+bool SoundCard::checkType(int id, snd_ctl_elem_type_t type) const
 {
-        //qDebug() << "Writing to "<< el << " ALSA element.";
-        if (elements.contains(el))
-            assert(snd_hctl_elem_write(elements.find(el).value(), value) >= 0);
+    if (schema->type(id) == type)
+        return true;
+    qDebug() << "Warning: Element " << schema->name(id) << " is a "
+            << snd_ctl_elem_type_name(schema->type(id)) << ", not a "
+            << snd_ctl_elem_type_name(type);
+    return false;
+}
+
+bool SoundCard::writeValue(int id)
+{
+        //qDebug() << "Writing to "<< schema->name(id) << " ALSA element.";
+        if (hctl)
+        {
+            int err = snd_hctl_elem_write(elements.at(id), valueBuffers.at(id));
+            if (err < 0)
+            {
+                qDebug() << "Warning: Writing " << schema->name(id) << " failed: " << snd_strerror(err);
+                return false;
+            }
+        }
         else
-            qDebug() << "Warning: Element " << el << " not available!";
+        {
+            if (simulatedLatency)
+                usleep(simulatedLatency);
+            getValue(id, device.data() + schema->offset(id));
+        }
+        store(id, true);
+        return true;
+}
+
+bool SoundCard::writeElement(int id, const QVector<long> & values)
+{
+    QMutexLocker locker(elementLocks + id);
+    return fillValue(id, values) && writeValue(id);
+}
+
+void SoundCard::readValue(int id)
+{
+    QMutexLocker locker(elementLocks + id);
+    if (hctl)
+        tryAlsa(snd_hctl_elem_read(elements.at(id), valueBuffers.at(id)));
+    else
+        setValue(id, device.constData() + schema->offset(id));
+    store(id, false);
+}
+
+void SoundCard::getValue(int id, long * v) const
+{
+    unsigned int n = schema->count(id);
+    switch (schema->type(id))
+    {
+    case SND_CTL_ELEM_TYPE_INTEGER:
+        for (unsigned int i = 0; i < n; i++)
+            v[i] = snd_ctl_elem_value_get_integer(valueBuffers.at(id), i);
+        break;
+    case SND_CTL_ELEM_TYPE_BOOLEAN:
+        for (unsigned int i = 0; i < n; i++)
+            v[i] = snd_ctl_elem_value_get_boolean(valueBuffers.at(id), i);
+        break;
+    case SND_CTL_ELEM_TYPE_ENUMERATED:
+        for (unsigned int i = 0; i < n; i++)
+            v[i] = snd_ctl_elem_value_get_enumerated(valueBuffers.at(id), i);
+        break;
+    default:
+        break;
+    }
+}
+
+void SoundCard::setValue(int id, const long * v)
+{
+    unsigned int n = schema->count(id);
+    switch (schema->type(id))
+    {
+    case SND_CTL_ELEM_TYPE_INTEGER:
+        for (unsigned int i = 0; i < n; i++)
+            snd_ctl_elem_value_set_integer(valueBuffers.at(id), i, v[i]);
+        break;
+    case SND_CTL_ELEM_TYPE_BOOLEAN:
+        for (unsigned int i = 0; i < n; i++)
+            snd_ctl_elem_value_set_boolean(valueBuffers.at(id), i, v[i]);
+        break;
+    case SND_CTL_ELEM_TYPE_ENUMERATED:
+        for (unsigned int i = 0; i < n; i++)
+            snd_ctl_elem_value_set_enumerated(valueBuffers.at(id), i, v[i]);
+        break;
+    default:
+        break;
+    }
+}
+
+void SoundCard::store(int id, bool written)
+{
+    long * v = state.data() + schema->offset(id);
+    unsigned int n = schema->count(id);
+    switch (schema->type(id))
+    {
+    case SND_CTL_ELEM_TYPE_INTEGER:
+    case SND_CTL_ELEM_TYPE_BOOLEAN:
+    case SND_CTL_ELEM_TYPE_ENUMERATED:
+        break;
+    default:
+        // Bytes, IEC958: not cached
+        return;
+    }
+    QVarLengthArray<long, 32> old(n);
+    for (unsigned int i = 0; i < n; i++)
+        old[i] = v[i];
+    getValue(id, v);
+    if (id == rateId && v[0] != old[0] && rateResync && !rateChangedAt)
+    {
+        // The firmware may reset or mute routes now, whoever changed the
+        // rate. Remember how they were; resync() puts them back.
+        expected = state;
+        rateChangedAt = monotonicNs();
+    }
+    else if (rateChangedAt && (written || !pads.contains(id)))
+    {
+        // Whatever we write meanwhile is what we expect, and so are changes
+        // ALSA reports: those are other clients', the firmware's aren't
+        // reported. Pad changes never are, so pads can't be told apart.
+        for (unsigned int i = 0; i < n; i++)
+            expected[schema->offset(id) + i] = v[i];
+    }
+    CardChange change;
+    change.id = id;
+    change.values = v;
+    change.old = old.constData();
+    change.written = written;
+    change.origin = written ? writeOrigin : NULL;
+    for (QList<CardObserver *>::iterator it = observers.begin(); it != observers.end(); ++it)
+        (*it)->elementChanged(this, change);
+}
+
+bool SoundCard::fillValue(int id, const QVector<long> & values)
+{
+    if (values.isEmpty())
+        return false;
+    unsigned int n = schema->count(id);
+    // Fill every channel, so the element is written with one ioctl
+    switch (schema->type(id))
+    {
+    case SND_CTL_ELEM_TYPE_INTEGER:
+        for (unsigned int i = 0; i < n; i++)
+            snd_ctl_elem_value_set_integer(valueBuffers.at(id), i, schema->clamp(id, values.value(i, values.last())));
+        return true;
+    case SND_CTL_ELEM_TYPE_BOOLEAN:
+        for (unsigned int i = 0; i < n; i++)
+            snd_ctl_elem_value_set_boolean(valueBuffers.at(id), i, values.value(i, values.last()) != 0);
+        return true;
+    case SND_CTL_ELEM_TYPE_ENUMERATED:
+        for (unsigned int i = 0; i < n; i++)
+        {
+            long v = values.value(i, values.last());
+            if (!schema->isValid(id, v))
+            {
+                qDebug() << "Warning: " << schema->name(id) << " has no item #" << v;
+                return false;
+            }
+            snd_ctl_elem_value_set_enumerated(valueBuffers.at(id), i, v);
+        }
+        return true;
+    default:
+        qDebug() << "Warning: Can't write " << schema->name(id);
+        return false;
+    }
 }
 
-void SoundCard::writeStereoInt(const QString & el, int v)
+bool SoundCard::writeBatch(const WriteBatch & batch, const void * origin)
+{
+    QMutexLocker locker(&lock);
+    writeOrigin = origin;
+    for (QList<CardObserver *>::iterator it = observers.begin(); it != observers.end(); ++it)
+        (*it)->batchStarted(this);
+    bool ok = true;
+    for (WriteBatch::const_iterator w = batch.begin(); w != batch.end(); ++w)
+        if (w->id >= 0 && w->id < schema->size())
+            ok = writeElement(w->id, w->values) && ok;
+    for (QList<CardObserver *>::iterator it = observers.begin(); it != observers.end(); ++it)
+        (*it)->batchFinished(this);
+    writeOrigin = NULL;
+    return ok;
+}
+
+void SoundCard::writeStereoInt(const QString & el, int v, int index)
 {
     /* Allmost all E-mu faders are stereo, exceptions are [PCM] {Center|LFE} Playback Volume and Master Playback Volume (mono),
-    and of course all those pesky Multichannel Routing/Volume thingies, with witch we don't bother right now. Mono faders
-    work with this, too. */
-    //TODO check if the element is the right type
+    and the Multichannel Routing/Volume thingies, which have as many values as channels. All channels get the same value. */
     //qDebug() << "Stereo faders " << el << " to " << v;
-    snd_ctl_elem_value_set_integer(value, 0, v);
-    snd_ctl_elem_value_set_integer(value, 1, v);
-    writeValue(el);
+    writeInts(el, QVector<long>(1, v), index);
 }
 
-// Set or unsets generic alsa switches
-void SoundCard::writeBool(const QString & s, bool a)
+void SoundCard::writeInts(const QString & el, const QVector<long> & values, int index)
 {
-    snd_ctl_elem_value_set_boolean(value, 0, a);
-    writeValue(s);
+    int id = elementId(el, index);
+    if (id < 0 || values.isEmpty() || !checkType(id, SND_CTL_ELEM_TYPE_INTEGER))
+        return;
+    QMutexLocker locker(&lock);
+    writeElement(id, values);
 }
 
-void SoundCard::writeEnum(const QString & e, int i)
+bool SoundCard::readBool(const QString & el, int index)
 {
-    snd_ctl_elem_value_set_enumerated(value, 0, i);
-    writeValue(e);
+    int id = elementId(el, index);
+    if (id < 0 || !checkType(id, SND_CTL_ELEM_TYPE_BOOLEAN))
+        return false;
+    QMutexLocker locker(&lock);
+    readValue(id);
+    return state.at(schema->offset(id)) != 0;
 }
 
-void SoundCard::matrixWriteEnum(const QString & e, int i)
+// Set or unsets generic alsa switches
+void SoundCard::writeBool(const QString & s, bool a, int index)
 {
-    // Translate QButtonGroup indices to alsa enumeration indices. Let's only hope both are constant across environments.
-    int alsai = -(i+2);
-    // Write them and cross fingers.
-    writeEnum(e, alsai);
+    int id = elementId(s, index);
+    if (id < 0 || !checkType(id, SND_CTL_ELEM_TYPE_BOOLEAN))
+        return;
+    QMutexLocker locker(&lock);
+    writeElement(id, QVector<long>(1, a));
 }
 
-////// ALSA CALLBACKS
-
-SoundCard * SoundCard::readCallbackValue(snd_hctl_elem_t * el, unsigned int mask)
+void SoundCard::writeEnum(const QString & e, int i, int index)
 {
-    if (mask != SND_CTL_EVENT_MASK_VALUE)
-        return NULL;
-    SoundCard * c = (SoundCard * )snd_hctl_elem_get_callback_private(el);
-    assert(c);
-    tryAlsa(snd_hctl_elem_read(el, c->value));
-    return c;
+    int id = elementId(e, index);
+    if (id < 0 || !checkType(id, SND_CTL_ELEM_TYPE_ENUMERATED))
+        return;
+    QMutexLocker locker(&lock);
+    writeElement(id, QVector<long>(1, i));
 }
 
-int SoundCard::alsaMasterChanged(snd_hctl_elem_t * elem, unsigned int mask)
+/// Driver item names of the matrix rows (sources), in row order
+static const char * const matrixSources[] = {
+    "Silence", "Dock Mic A", "Dock Mic B",
+    "Dock ADC1 Left", "Dock ADC1 Right", "Dock ADC2 Left", "Dock ADC2 Right",
+    "Dock ADC3 Left", "Dock ADC3 Right", "0202 ADC Left", "0202 ADC Right",
+    "0202 SPDIF Left", "0202 SPDIF Right",
+    "ADAT 0", "ADAT 1", "ADAT 2", "ADAT 3", "ADAT 4", "ADAT 5", "ADAT 6", "ADAT 7",
+    "DSP 0", "DSP 1", "DSP 2", "DSP 3", "DSP 4", "DSP 5", "DSP 6", "DSP 7",
+    "DSP 8", "DSP 9", "DSP 10", "DSP 11", "DSP 12", "DSP 13", "DSP 14", "DSP 15"
+};
+static const int matrixSourceCount = sizeof(matrixSources) / sizeof(matrixSources[0]);
+
+QString SoundCard::matrixSource(int i)
 {
-    SoundCard * c = readCallbackValue(elem, mask);
-    if (!c)
-        return 0;
-    int value = snd_ctl_elem_value_get_integer(c->value, 0);
-   // qDebug() << "Master volume changed to " << value;
-    c->window->ui->master->setValue(value);
-    return 0;
+    // QButtonGroup assigns ids -2, -3, ... in matrix row order
+    int row = -(i + 2);
+    return row >= 0 && row < matrixSourceCount ? QString(matrixSources[row]) : QString();
 }
 
-int SoundCard::alsaRateChanged(snd_hctl_elem_t *elem, unsigned int mask)
+int SoundCard::matrixToAlsa(int el, int i) const
 {
-    SoundCard * c = readCallbackValue(elem, mask);
-    if (!c)
-        return 0;
-    qDebug("Clock rate changed.");
-    int ix = snd_ctl_elem_value_get_enumerated(c->value, 0);
-    // Set Index, unless it is S/PDIF or ADAT!
-    // FIXME
-    if (ix <= c->window->ui->rate->count() - 1)
-        c->window->ui->rate->setCurrentIndex(ix);
-    return 0;
+    // By name: the driver's item order isn't ours to rely on
+    QString source = matrixSource(i);
+    return el >= 0 && !source.isEmpty() ? schema->itemIndex(el, source) : -1;
 }
 
-int SoundCard::alsaPadChanged(snd_hctl_elem_t *elem, unsigned int mask)
-{
-    // FIXME this dosen't work. Neither way: emutrix->alsamixer or
-    // alsamixer->emutrix. Function never gets called, unless
-    // explicitely. Why?
-    SoundCard * c = readCallbackValue(elem, mask);
-    QString ename = snd_hctl_elem_get_name(elem);
-    QAbstractButton * button = NULL;
-    if (!c)
-        return 0;
-    bool pad = snd_ctl_elem_value_get_boolean(c->value, 0);
-    MainWindow * w = c->window;
-    // Commenting this out, too many calls to this function because of
-    // driver bug workaround polute stdout.
-    // qDebug() << ename << " changed to " << pad;
-    if (ename == "ADC1 14dB PAD Audio Dock Capture Switch")
-        button = w->ui->d1padin;
-    else if (ename == "ADC2 14dB PAD Audio Dock Capture Switch")
-        button = w->ui->d2padin;
-    else if (ename == "ADC3 14dB PAD Audio Dock Capture Switch")
-        button = w->ui->d3padin;
-    else if (ename == "ADC1 14dB PAD 0202 Capture Switch")
-        button = w->ui->adcpadin;
-    else if (ename == "DAC1 Audio Dock 14dB PAD Playback Switch")
-        button = w->ui->d1pad;
-    else if (ename == "DAC2 Audio Dock 14dB PAD Playback Switch")
-        button = w->ui->d2pad;
-    else if (ename == "DAC3 Audio Dock 14dB PAD Playback Switch")
-        button = w->ui->d3pad;
-    else if (ename == "DAC4 Audio Dock 14dB PAD Playback Switch")
-        button = w->ui->d4pad;
-    else if (ename == "DAC1 0202 14dB PAD Playback Switch")
-        button = w->ui->dacpad;
-    else
-        qDebug() << "No pad callback for element " << snd_hctl_elem_get_name(elem);
+int SoundCard::alsaToMatrix(int el, int ix) const
+{
+    if (el < 0 || ix < 0 || (unsigned long)ix >= schema->items(el))
+        return -1;
+    const QString & item = schema->itemName(el, ix);
+    for (int row = 0; row < matrixSourceCount; row++)
+        if (item == matrixSources[row])
+            return -(row + 2);
+    return -1;
+}
 
-    if (button)
-        button->setChecked(pad);
-    return 0;
+void SoundCard::matrixWriteEnum(const QString & e, int i)
+{
+    QList<QPair<QString, int> > batch;
+    batch.append(qMakePair(e, i));
+    matrixWriteEnums(batch);
 }
 
-int SoundCard::alsaRoutingChanged(snd_hctl_elem_t *elem, unsigned int mask)
-{
-    SoundCard * c = readCallbackValue(elem, mask);
-    if (!c)
-        return 0;
-    MainWindow * w = c->window;
-    QButtonGroup * bg = NULL;
-    QString ename = snd_hctl_elem_get_name(elem);
-    int ix = snd_ctl_elem_value_get_enumerated(c->value, 0);
-    // Convert ALSA index to button index
-    ix = -(ix + 2);
-    qDebug() << ename << " routing to " << ix;
-    if (ename == "DSP A Capture Enum")
-        bg = w->ui->b11;
-    else if (ename == "DSP B Capture Enum")
-        bg = w->ui->b12;
-    else if (ename == "DSP C Capture Enum")
-        bg = w->ui->b13;
-    else if (ename == "DSP D Capture Enum")
-        bg = w->ui->b14;
-    else if (ename == "DSP E Capture Enum")
-        bg = w->ui->b15;
-    else if (ename == "DSP F Capture Enum")
-        bg = w->ui->b16;
-    else if (ename == "0202 DAC Left Playback Enum")
-        bg = w->ui->b0l;
-    else if (ename == "0202 DAC Right Playback Enum")
-        bg = w->ui->b0r;
-    else if (ename == "1010 ADAT 0 Playback Enum")
-        bg = w->ui->ba0;
-    else if (ename == "1010 ADAT 1 Playback Enum")
-        bg = w->ui->ba1;
-    else if (ename == "1010 ADAT 2 Playback Enum")
-        bg = w->ui->ba2;
-    else if (ename == "1010 ADAT 3 Playback Enum")
-        bg = w->ui->ba3;
-    else if (ename == "1010 ADAT 4 Playback Enum")
-        bg = w->ui->ba4;
-    else if (ename == "1010 ADAT 5 Playback Enum")
-        bg = w->ui->ba5;
-    else if (ename == "1010 ADAT 6 Playback Enum")
-        bg = w->ui->ba6;
-    else if (ename == "1010 ADAT 7 Playback Enum")
-        bg = w->ui->ba7;
-    else if (ename == "1010 SPDIF Left Playback Enum")
-        bg = w->ui->bsl;
-    else if (ename == "1010 SPDIF Right Playback Enum")
-        bg = w->ui->bsr;
-    else if (ename == "Dock DAC1 Left Playback Enum")
-        bg = w->ui->b1l;
-    else if (ename == "Dock DAC1 Right Playback Enum")
-        bg = w->ui->b1r;
-    else if (ename == "Dock DAC2 Left Playback Enum")
-        bg = w->ui->b2l;
-    else if (ename == "Dock DAC2 Right Playback Enum")
-        bg = w->ui->b2r;
-    else if (ename == "Dock DAC3 Left Playback Enum")
-        bg = w->ui->b3l;
-    else if (ename == "Dock DAC3 Right Playback Enum")
-        bg = w->ui->b3r;
-    else if (ename == "Dock DAC4 Left Playback Enum")
-        bg = w->ui->b4l;
-    else if (ename == "Dock DAC4 Right Playback Enum")
-        bg = w->ui->b4r;
-    else if (ename == "Dock Phones Left Playback Enum")
-        bg = w->ui->bpl;
-    else if (ename == "Dock Phones Right Playback Enum")
-        bg = w->ui->bpr;
-    else if (ename == "Dock SPDIF Left Playback Enum")
-        bg = w->ui->bdsl;
-    else if (ename == "Dock SPDIF Right Playback Enum")
-        bg = w->ui->bdsr;
-    else
+void SoundCard::matrixWriteEnums(const QList<QPair<QString, int> > & batch)
+{
+    WriteBatch writes;
+    for (QList<QPair<QString, int> >::const_iterator it = batch.begin();
+        it != batch.end();
+        ++it)
     {
-        qDebug() << "No routing callback for element " << ename;
-        return 0;
+        ElementWrite w;
+        w.id = elementId(it->first);
+        if (w.id < 0 || !checkType(w.id, SND_CTL_ELEM_TYPE_ENUMERATED))
+            continue;
+        // Translate QButtonGroup indices to alsa enumeration indices.
+        int alsai = matrixToAlsa(w.id, it->second);
+        if (alsai < 0)
+        {
+            qDebug() << "Warning: No source for button " << it->second << " in " << it->first;
+            continue;
+        }
+        w.values.append(alsai);
+        writes.append(w);
     }
+    writeBatch(writes);
+}
 
-    // Make sure ix does make reference to an available button
-    if (bg->button(ix))
-        bg->button(ix)->setChecked(true);
-    // or else uncheck all buttons.
-    else
-        bg->checkedButton()->setChecked(false);
+////// ALSA CALLBACKS
+
+void SoundCard::elementEvent(int id)
+{
+    readValue(id);
+    showElement(id);
+}
+
+void SoundCard::showElement(int id)
+{
+    long v = state.at(schema->offset(id));
+    if (schema->type(id) == SND_CTL_ELEM_TYPE_ENUMERATED && v >= 0
+        && v < (long)schema->items(id) && !quiet)
+        qDebug() << schema->name(id) << " set to " << schema->itemName(id, v);
+    if (window && bindings.at(id) >= 0)
+        window->showBinding(bindings.at(id), v);
+}
+
+int SoundCard::alsaElementChanged(snd_hctl_elem_t * el, unsigned int mask)
+{
+    SoundCard * c = (SoundCard * )snd_hctl_elem_get_callback_private(el);
+    assert(c);
+    c->handleEvent(c->elementIds.value(el), mask);
     return 0;
 }
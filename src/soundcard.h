@@ -19,13 +19,96 @@
 
 #include <QString>
 #include <QMap>
+#include <QHash>
+#include <QVector>
+#include <QMutex>
+#include <QBitArray>
 #include "alsa/asoundlib.h"
-#include "mainwindow.h"
+#include "elementschema.h"
+
+class SoundCard;
+
+/** An element change, as seen by CardObserver. */
+struct CardChange
+{
+    /// Element id
+    int id;
+    /// New values, one per channel
+    const long * values;
+    /// Previous (cached) values
+    const long * old;
+    /// True for writes by emutrix, false for values read from ALSA
+    bool written;
+    /// Whoever asked for the write through writeBatch(), or NULL
+    const void * origin;
+};
+
+/** Interface for objects that follow the card's state.
+    Observers are told about every element value that is written by
+    emutrix or reported by ALSA. They are called with the card lock held,
+    from whatever thread caused the change, and must be quick.
+    */
+class CardObserver
+{
+public:
+    virtual ~CardObserver() {}
+    /** Element changed.
+        @param card Card the element belongs to
+        @param change What changed
+        */
+    virtual void elementChanged(const SoundCard * card, const CardChange & change) = 0;
+    /** ALSA reported an event, before coalescing: elementChanged() follows
+        once per element, when it is read back (if the value changed).
+        @param id Element id
+        @param mask SND_CTL_EVENT_MASK_* bits
+        */
+    virtual void elementEvent(const SoundCard *, int /*id*/, unsigned int /*mask*/) {}
+    /** A batch of writes starts.
+        Changes up to batchFinished() belong together (e.g. a stereo pair).
+        */
+    virtual void batchStarted(const SoundCard *) {}
+    /// A batch of writes is done.
+    virtual void batchFinished(const SoundCard *) {}
+};
+
+/** Something showing the card's bound controls.
+    The main window, or the terminal frontend. Told about changed elements
+    of the binding table by updateWindow(), in the thread calling it.
+    */
+class CardView
+{
+public:
+    virtual ~CardView() {}
+    /** Shows an element value on its control. Shouldn't write back.
+        @param row Binding table row (see controlbindings.h)
+        @param v Value of the element's first channel
+        */
+    virtual void showBinding(int row, long v) = 0;
+    /** Many changes follow (true), or they are done (false).
+        Views may hold repaints in between.
+        */
+    virtual void holdUpdates(bool) {}
+};
+
+/** One write of a batch.
+    Values are one per channel; if there are less, the last one is repeated.
+    Integers are clamped to the element range, invalid enumeration
+    indices are skipped.
+    */
+struct ElementWrite
+{
+    /// Element id
+    int id;
+    QVector<long> values;
+};
+typedef QList<ElementWrite> WriteBatch;
 
 /** This class is a wrapper around ALSA functions.
   It is targeted at handling EMU cards only. Deals with initialization in constructor and
   offers reading and writing functionality.
   Callbacks are also handled by this class when requested through updateCallbacks()
+  Readers and writers may be called from other threads (e.g. MIDI input); callbacks
+  are only run from the thread calling updateCallbacks() or updateWindow().
   */
 class SoundCard
 {
@@ -33,18 +116,38 @@ public:
     /** Constructor.
       Initializes ALSA card. Pass as pointer to avoid creating and destroying ALSA handles.
       @param index is the ALSA card index
+      @param defaults Set start defaults (see sanealsa.h); not for other programs' cards
+      */
+    SoundCard(int index, bool defaults = true);
+    /** Virtual card constructor.
+      Creates a card that isn't there: writes only go to the state cache,
+      and events come from simulateEvent(). Used to replay traces and to
+      work without an E-mu card.
+      @param schema Element layout
+      @param state Initial values, flat array as described by the schema
+      @param name Card name
       */
-    SoundCard(int index);
+    SoundCard(ElementSchema::Pointer schema, const QVector<long> & state, const QString & name);
     /** Destructor.
       Frees ALSA card handles.
       */
     ~SoundCard();
 
     /** Setup ALSA callbacks.
-      @param w is the mainwindow that should be modified with callbacks.
+      @param v is the view that should be modified with callbacks.
       Should this be moved to updateCallbacks()?
     */
-    void setupCallbacks(MainWindow * w);
+    void setupCallbacks(CardView * v);
+
+    /** Follow every element, not just those of the binding table.
+      For library users (see emutrix.h), who may care about any of them.
+      Call after setupCallbacks().
+      */
+    void watchAll();
+    /** Whether to put back routes and pads the firmware resets after a
+      clock rate change (see resync()). On by default.
+      */
+    void setRateResync(bool on);
 
     /** Returns a list of card names & ALSA indices
       Ordered acording to ALSA index
@@ -52,82 +155,263 @@ public:
     static QList<QPair<QString, int> > getCardList();
 
     QString getName();
+    /** ALSA card id (e.g. "Emu10k1"), as used in alsactl state files.
+      Virtual cards use their name.
+      */
+    QString getId();
+    /// ALSA card index, -1 for virtual cards
+    int getIndex() const;
+    /// True for cards built from a schema, with no ALSA device behind
+    bool isVirtual() const;
+
+    /** Element descriptions.
+      Type, channel count, range and enumeration items of every element,
+      read once when the card was loaded.
+      */
+    const ElementSchema & getSchema() const;
+
+    /** Last known values of an element.
+      Kept up to date on every read and write, so it costs no ioctl.
+      Values are laid out as described by the schema (see ElementSchema::offset()).
+      @param id Element id
+      @return One value per channel.
+      */
+    QVector<long> getCached(int id);
+    /** Copy of the last known values of all elements.
+      Flat array, see ElementSchema::offset().
+      */
+    QVector<long> getCachedState();
+
+    /** Register an observer.
+      It gets called on every change from now on. Does not take ownership.
+      */
+    void addObserver(CardObserver * o);
+    /// Unregister an observer.
+    void removeObserver(CardObserver * o);
+
+    /** Driver item name of the source on a matrix row.
+      @param i Button id
+      @return Item name, empty if there's no such row.
+      */
+    static QString matrixSource(int i);
+    /** Translate matrix button id to ALSA enumeration index.
+      Looks the row's source up by item name.
+      @param el Routing element id
+      @param i Button id
+      @return Enumeration index, or -1 if the element has no such item.
+      */
+    int matrixToAlsa(int el, int i) const;
+    /** Translate ALSA enumeration index to matrix button id.
+      Inverse of matrixToAlsa.
+      @return Button id, or -1 if the source has no matrix row.
+      */
+    int alsaToMatrix(int el, int ix) const;
 
     /** Update ALSA callbacks
         Set to timeout when GUI stuff is idle. Updates
         ALSA status and polls any pending events, calling callbacks.
-        Argument ignored.
+        Same as processEvents() followed by updateWindow().
         */
     void updateCallbacks();
+    /** Handles ALSA events.
+        Events are coalesced: all pending ones are drained, and each changed
+        element is read back once. Pads, whose changes the driver doesn't
+        report, are polled every 100 ms. The window isn't touched, so this may
+        run on its own thread (see ControlThread).
+        @param timeout How long to wait for events (ms)
+        @return Number of events handled.
+        */
+    int processEvents(int timeout);
+    /** Updates the window with changes handled by processEvents().
+        All of them in one go. GUI thread only.
+        */
+    void updateWindow();
+    /** Changes an element of a virtual card, as another ALSA client would.
+      Like real events, it is picked up by the next processEvents().
+      Does nothing on real cards.
+      @param id Element id
+      @param values New values, one per channel
+      */
+    void simulateEvent(int id, const QVector<long> & values);
+    /** An event on a virtual card's element, without a new value.
+      E.g. replayed from a trace (see TracePlayer), along with
+      simulateValue().
+      @param mask SND_CTL_EVENT_MASK_* bits
+      */
+    void simulateEvent(int id, unsigned int mask);
+    /** Changes what a virtual card's device holds, without an event.
+      The element is read back by the next processEvents().
+      */
+    void simulateValue(int id, const QVector<long> & values);
+    /** Makes writes to a virtual card take a while, like real ones.
+      @param us Time each element write takes, in microseconds
+      */
+    void setSimulatedLatency(int us);
+    /** Reads an element straight from the device.
+      Neither the cache nor observers are touched. Takes only the element's
+      lock, so pollers don't wait for writes (or batches) of other elements.
+      @param id Element id
+      @param values Filled with one value per channel
+      @return false if the element couldn't be read.
+      */
+    bool readDevice(int id, QVector<long> & values);
+    /** Reads elements back on the next updateCallbacks().
+      As if ALSA had reported a change: cache and window get updated.
+      May be called from any thread.
+      */
+    void refresh(const QVector<int> & ids);
+    /** Elements whose changes the driver doesn't report (the pads).
+      Known after setupCallbacks().
+      */
+    QVector<int> unreportedElements();
 
     ///// VARIOUS ALSA WRITER FUNCTIONS
-    /** Writes ALSA elements consisting of one or two integer values ("faders").
-        Most elements we bother with right now are stereo, a few mono.
-        This function handles both. Writes the same value to both channels.
+    /** Writes ALSA integer elements ("faders").
+        Most elements we bother with right now are stereo, a few mono, and
+        the multichannel routing/volume elements have many channels.
+        This function handles all of them. Writes the same value to every channel.
+        @param el Element name
+        @param value Value to use for all channels
+        @param index ALSA index, for elements that share their name
+        Calls writeValue to do actual writing.
+        */
+    void writeStereoInt(const QString & el, int value, int index = 0);
+    /** Writes a whole channel array to an ALSA integer element.
+        All channels are written in one go. If there are less values than
+        channels, the last value is repeated; extra values are ignored.
         @param el Element name
-        @param value Value to use for both channels
+        @param values One value per channel
+        @param index ALSA index, for elements that share their name
         Calls writeValue to do actual writing.
         */
-    void writeStereoInt(const QString & el, int value);
+    void writeInts(const QString & el, const QVector<long> & values, int index = 0);
+    /** Reads (the first channel of) an ALSA switch.
+        @param el Element name
+        @param index ALSA index, for elements that share their name
+        @return Switch state, false if the element isn't available.
+        */
+    bool readBool(const QString & el, int index = 0);
     /** Toggles ALSA switches (single index)
         AKA boolean elements.
         @param el Element name
+        @param index ALSA index, for elements that share their name
         Calls writeValue to do actual writing.
         */
-    void writeBool(const QString & el, bool);
+    void writeBool(const QString & el, bool, int index = 0);
     /** Selects index from ALSA enumerated element
         Selects an item from a (mono) enumeration.
         Mostly for routing, but also used in clock rate selection.
         @param el Element to write to
         @i Index of enumerated selection
+        @param index ALSA index, for elements that share their name
         Calls writeValue to do actual writing.
         */
-    void writeEnum(const QString &el, int i);
+    void writeEnum(const QString &el, int i, int index = 0);
+    /** Writes several elements as one batch.
+        Nothing else is written to the card in between, and observers see the
+        batch as one unit (e.g. one undo step).
+        @param batch Writes, by element id
+        @param origin Passed on to observers, so they can recognize their own writes
+        @return false if any write failed or had invalid values (the
+                others are still done).
+        */
+    bool writeBatch(const WriteBatch & batch, const void * origin = NULL);
     /** Same as writeEnum, but converting icon to alsa indices.*/
     void matrixWriteEnum(const QString & el, int i);
+    /** Batched matrixWriteEnum.
+        Writes several routing elements in one go, e.g. both sides of
+        a stereo-linked pair.
+        @param batch List of element names and button indices
+        */
+    void matrixWriteEnums(const QList<QPair<QString, int> > & batch);
 
 private:
+    /** Look up element id by name and ALSA index.
+        Warns if the element isn't available.
+        @return Element id, or -1.
+        */
+    int elementId(const QString & el, int index = 0) const;
+    /** Checks element type.
+        Warns if element id isn't of the given type.
+        */
+    bool checkType(int id, snd_ctl_elem_type_t type) const;
+    /** Writes an element.
+        Fills its value buffer and writes it to ALSA, holding the element's
+        lock, then caches it. Call with the card lock held.
+        @param id Element id
+        @param values One value per channel, see ElementWrite
+        @return false if a value was invalid (nothing is written, and a
+                warning printed) or ALSA refused.
+        */
+    bool writeElement(int id, const QVector<long> & values);
     /** Does ALSA element writing
-        Writes whatever is in the value private member to ALSA.
-        @param el Element name
-        Does no sanity checks, right now.
+        Writes whatever is in the element's value buffer to ALSA.
+        @param id Element id
+        Callers validate values against the schema.
+        @return false if ALSA refused.
+        */
+    bool writeValue(int id);
+    /** Fills the value buffer of element id.
+        Values are validated/clamped according to the element type.
+        @return false if there's nothing valid to write.
         */
-    void writeValue(const QString &el);
+    bool fillValue(int id, const QVector<long> & values);
+    /** Reads element from ALSA into its value buffer, and caches it.
+        Virtual cards read from the device array.
+        Call with the card lock held.
+        @param id Element id
+        */
+    void readValue(int id);
+    /** Copies the value buffer to the state cache and tells observers.
+        @param id Element id
+        @param written True for our own writes
+        */
+    void store(int id, bool written);
+    /// Copies the value buffer of element id into v (one long per channel)
+    void getValue(int id, long * v) const;
+    /// Copies v into the value buffer of element id
+    void setValue(int id, const long * v);
+    /// Allocates value buffers and locks of all elements
+    void allocateValues();
 
 private:
     //// ALSA CALLBACKS
-    /** Set callback function for a given element
-        This function takes an element name and a function which should
-        be called each time the element value changes (Inside or outside
-        emutrix.
-        */
-    void setAlsaCallback(const char * eln, snd_hctl_elem_callback_t cb);
-    /** Read callback value.
-        Reads the changed value from element el (if mask is proper),
-        stored in value member. Returns MainWindow that changed, or NULL on
-        error.
-        */
-    static SoundCard * readCallbackValue(snd_hctl_elem_t * el, unsigned int mask);
-    /** Master change.
-        This callback function gets called when master playback volume changes
-        @see setAlsaCallback
-        */
-    static int alsaMasterChanged(snd_hctl_elem_t *elem, unsigned int mask);
-    /** Clock rate change
-        This callback function gets called when ALSA "Internal Clock Rate" element changes
-        @see setAlsaCallback
-        */
-    static int alsaRateChanged(snd_hctl_elem_t *elem, unsigned int mask);
-    /** Pad change.
-        This callback function gets called when any pad changes state.
-        @see setAlsaCallback
-        */
-    static int alsaPadChanged(snd_hctl_elem_t *elem, unsigned int mask);
-    /** Routing changed
-        This callback function gets called when an ALSA routing enumeration changes value.
-        @see setAlsaCallback
-        */
-    static int alsaRoutingChanged(snd_hctl_elem_t *elem, unsigned int mask);
+    /** Follow changes of an element.
+        Registers the ALSA callback and reads the initial value.
+        @param id Element id
+        @param row Row of the binding table showing it (see controlbindings.h), or -1
+        */
+    void watch(int id, int row);
+    /** Reads element id and shows it.
+        */
+    void elementEvent(int id);
+    /** Shows the cached value of element id on its widget, if it has one.
+        Through CardView::showBinding(), in the view's thread.
+        */
+    void showElement(int id);
+    /// Handles pending ALSA events, which mark elements dirty
+    int drainEvents();
+    /// Element id changed, read it back on the next flushEvents()
+    void markDirty(int id);
+    /// An ALSA event, real or simulated: tells observers, marks value changes dirty
+    void handleEvent(int id, unsigned int mask);
+    /// Reads back dirty elements
+    void flushEvents();
+    /// Marks pads dirty that changed on the device, every padPollInterval
+    void pollPads();
+    /// Element id needs to be shown on the next updateWindow()
+    void windowChanged(int id);
+    /** Checks routes and pads after a clock rate change.
+        Re-reads them, and writes back (as one batch) those that differ
+        from what they were before the change, updated with our writes and
+        reported changes since.
+        */
+    void resync();
+    /** ALSA callback.
+        Registered for all watched elements; the SoundCard is
+        passed as callback private.
+        */
+    static int alsaElementChanged(snd_hctl_elem_t * el, unsigned int mask);
 
 private:
     ///// ALSA HANDLES
@@ -137,25 +421,88 @@ private:
       Using this frees us from having to load an sort elements.
       Also has some caching features */
     snd_hctl_t * hctl;
-    /** String to ALSA elements map.
-        Makes accesing elements easier.
-        Each element contains info about the type of the element
-        (integer, boolean, int64, etc.), its "interface" (card, midi, timer, etc.),
-        if it is locked, etc.
-        This is loaded at start andwhenever switching cards, although it should
-        not change.
-        Several functions defined in this class allow for writing elements by QString
-        */
-    QMap<QString, snd_hctl_elem_t *> elements;
-    /** ALSA element value.
-        Reused in this class for all writes and reads.
-        Contains one or more indexed values of whatever type the element understands.
-        */
-    snd_ctl_elem_value_t * value;
-    /** Window that contains UI elements.
+    /** Element schema.
+        Type, count, range and items of every element, indexed by element id.
+        Shared with other cards with the same layout.
+        Several functions defined in this class allow for writing elements by
+        QString; names are translated to ids through it.
+        */
+    ElementSchema::Pointer schema;
+    /** Name of virtual cards. */
+    QString virtualName;
+    /** ALSA element handles, by element id.
+        This is loaded at start and whenever switching cards.
+        All NULL for virtual cards.
+        */
+    QVector<snd_hctl_elem_t *> elements;
+    /// Element ids by handle, for callbacks
+    QHash<snd_hctl_elem_t *, int> elementIds;
+    /// Binding table rows, by element id (-1 if none)
+    QVector<int> bindings;
+    /// Elements followed through ALSA callbacks, by id
+    QBitArray watched;
+    /// Changed elements, in order of arrival, and as bits by id
+    QVector<int> dirty;
+    QBitArray dirtyMask;
+    /// Events behind the dirty elements
+    int stormEvents;
+    /// When the first dirty element was marked (ns)
+    qint64 stormStart;
+    /// Elements to show on the next updateWindow(), in order, and as bits by id
+    QVector<int> changed;
+    QBitArray changedMask;
+    /// Events behind the changed elements
+    int changedEvents;
+    /// When the first of them arrived (ns)
+    qint64 changedSince;
+    /// Changes aren't logged while many elements are being updated
+    bool quiet;
+    /// Id of "Clock Internal Rate", -1 if none
+    int rateId;
+    /// Resync after rate changes, see setRateResync()
+    bool rateResync;
+    /// Routing and pad elements, checked after clock rate changes
+    QVector<int> resyncIds;
+    /// When the clock rate changed (ns), 0 if no resync is pending
+    qint64 rateChangedAt;
+    /// State as it should be after the resync
+    QVector<long> expected;
+    /// Ids of the pad switches, whose changes the driver doesn't report
+    QVector<int> pads;
+    /// When pollPads() last read them (ns)
+    qint64 padsPolledAt;
+    /** Last known values of all elements.
+        Flat array, laid out as described by the schema.
+        */
+    QVector<long> state;
+    /// Values of the device behind a virtual card (empty for real cards)
+    QVector<long> device;
+    /// Time a write to the virtual device takes (us)
+    int simulatedLatency;
+    /// Objects following the state
+    QList<CardObserver *> observers;
+    /// Origin of the batch being written, see writeBatch()
+    const void * writeOrigin;
+    /** ALSA element values, by element id.
+        Allocated once; each holds one or more indexed values of whatever
+        type its element understands. Guarded by elementLocks, so reads
+        and writes of different elements don't wait for each other.
+        */
+    QVector<snd_ctl_elem_value_t *> valueBuffers;
+    /** One per element: guards its value buffer, its ALSA reads and writes,
+        and its part of device.
+        Taken after lock, never before it.
+        */
+    QMutex * elementLocks;
+    /** Serializes writes, the state cache, observers and event handling.
+        Recursive, because callbacks update widgets, whose signals may write
+        back to the card. readDevice() doesn't need it.
+        */
+    QMutex lock;
+    /** View (window) that contains UI elements.
       Is modified on callbacks.
       */
-    MainWindow * window;
+    CardView * window;
 };
 
 #endif // SOUNDCARD_H
@@ -0,0 +1,144 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "spectrumview.h"
+#include "analyzer.h"
+#include <QComboBox>
+#include <QTimer>
+#include <QPainter>
+#include <QVBoxLayout>
+#include <QSettings>
+#include <QFileInfo>
+
+/// Source ComboBox data of items other than capture channels
+static const int toneSource = -1;
+static const int fileSource = -2;
+/// Level shown at the bottom of the panel (dB)
+static const float bottomDb = -100;
+
+SpectrumView::SpectrumView(QWidget * parent)
+    : QWidget(parent), analyzer(new Analyzer(this)), sources(new QComboBox(this)),
+      timer(new QTimer(this)), active(false), card(-1)
+{
+    QVBoxLayout * layout = new QVBoxLayout(this);
+    layout->addWidget(sources);
+    // Bars are painted below the ComboBox
+    layout->addStretch();
+    setMinimumSize(320, 160);
+    levels.fill(bottomDb, Analyzer::bands);
+    setCard(-1);
+    connect(sources, SIGNAL(currentIndexChanged(int)), this, SLOT(sourceChanged(int)));
+    // Display rate, same as the analyzer publishes at
+    timer->setInterval(33);
+    connect(timer, SIGNAL(timeout()), this, SLOT(refresh()));
+}
+
+void SpectrumView::setCard(int index)
+{
+    card = index;
+    // Keep the selection if the new card has it too
+    QVariant selected = sources->currentIndex() < 0 ? QVariant() : sources->itemData(sources->currentIndex());
+    sources->blockSignals(true);
+    sources->clear();
+    if (card >= 0)
+    {
+        int channels = QSettings().value("analyzer/channels", 16).toInt();
+        for (int ch = 0; ch < channels; ch++)
+            sources->addItem(tr("Capture %1").arg(ch + 1), ch);
+    }
+    sources->addItem(tr("Test tone"), toneSource);
+    if (!file.isEmpty())
+        sources->addItem(QFileInfo(file).fileName(), fileSource);
+    sources->setCurrentIndex(qMax(sources->findData(selected), 0));
+    sources->blockSignals(false);
+    restart();
+}
+
+void SpectrumView::setFile(const QString & path)
+{
+    file = path;
+    setCard(card);
+    sources->setCurrentIndex(sources->findData(fileSource));
+}
+
+void SpectrumView::setActive(bool a)
+{
+    active = a;
+    restart();
+}
+
+void SpectrumView::sourceChanged(int)
+{
+    restart();
+}
+
+void SpectrumView::restart()
+{
+    analyzer->stop();
+    analyzer->wait();
+    timer->stop();
+    levels.fill(bottomDb);
+    update();
+    if (!active || sources->currentIndex() < 0)
+        return;
+    int source = sources->itemData(sources->currentIndex()).toInt();
+    if (source == toneSource)
+        analyzer->setTone();
+    else if (source == fileSource)
+        analyzer->setFile(file, 0);
+    else
+        analyzer->setCapture(card, source);
+    analyzer->start(QThread::LowPriority);
+    timer->start();
+}
+
+void SpectrumView::refresh()
+{
+    if (analyzer->levels(levels) || !analyzer->isRunning())
+        update();
+}
+
+void SpectrumView::paintEvent(QPaintEvent *)
+{
+    QPainter painter(this);
+    int top = sources->y() + sources->height() + 4;
+    QRect area(0, top, width(), height() - top);
+    painter.fillRect(area, Qt::black);
+    // A line every 20 dB
+    painter.setPen(QColor(60, 60, 60));
+    for (int db = 0; db > bottomDb; db -= 20)
+    {
+        int y = area.top() + (int)(area.height() * db / bottomDb);
+        painter.drawLine(0, y, area.width(), y);
+        painter.drawText(2, y + 12, tr("%1 dB").arg(db));
+    }
+    QColor bar(80, 200, 80);
+    for (int b = 0; b < levels.size(); b++)
+    {
+        float level = qBound(bottomDb, levels.at(b), 0.0f);
+        int h = (int)(area.height() * (1 - level / bottomDb));
+        int x = area.width() * b / levels.size();
+        int w = area.width() * (b + 1) / levels.size() - x - 1;
+        painter.fillRect(x, area.bottom() - h, qMax(w, 1), h, bar);
+    }
+    QString err = analyzer->error();
+    if (!err.isEmpty())
+    {
+        painter.setPen(QColor(Qt::red));
+        painter.drawText(area.adjusted(4, 4, -4, -4), Qt::AlignCenter, err);
+    }
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef SPECTRUMVIEW_H
+#define SPECTRUMVIEW_H
+
+#include <QWidget>
+#include <QVector>
+#include <QString>
+
+class QComboBox;
+class QTimer;
+class Analyzer;
+
+/** Analyzer panel.
+    Shows the spectrum of a capture channel (route a source to it on the
+    matrix), a WAV file or a test tone as bars, one per Analyzer band.
+    The analyzer only runs while the panel is active.
+    */
+class SpectrumView : public QWidget
+{
+    Q_OBJECT
+
+public:
+    SpectrumView(QWidget * parent = 0);
+
+    /** Offer the capture channels of a card.
+        @param index ALSA card index, -1 for none (virtual cards)
+        */
+    void setCard(int index);
+    /// Offer a WAV file as a source, and select it
+    void setFile(const QString & path);
+
+public slots:
+    /// Start or stop analyzing, e.g. as the panel is shown and hidden
+    void setActive(bool active);
+
+protected:
+    void paintEvent(QPaintEvent *);
+
+private slots:
+    /// Source ComboBox
+    void sourceChanged(int);
+    /// Display timer
+    void refresh();
+
+private:
+    /// Restart the analyzer on the selected source, if active
+    void restart();
+
+    Analyzer * analyzer;
+    QComboBox * sources;
+    QTimer * timer;
+    bool active;
+    int card;
+    QString file;
+    /// Band levels shown (dB)
+    QVector<float> levels;
+};
+
+#endif // SPECTRUMVIEW_H
@@ -0,0 +1,433 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "stresstest.h"
+#include "mainwindow.h"
+#include "controlbindings.h"
+#include "monotonic.h"
+#include <QThread>
+#include <QAtomicInt>
+#include <QDataStream>
+#include <QByteArray>
+#include <QStringList>
+#include <QButtonGroup>
+#include <QAbstractButton>
+#include <QAbstractSlider>
+#include <QCoreApplication>
+#include <QDebug>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/// Histogram bucket width (ns) and count
+static const qint64 bucketWidth = 100000;
+static const int buckets = 10000;
+/// User actions per timer tick
+static const int actionsPerTick = 4;
+/// User actions between card switches
+static const int switchEvery = 2000;
+/// How often results are printed (ns)
+static const qint64 reportInterval = 10000000000LL;
+/// External changes not shown after this long were overwritten (ns)
+static const qint64 pendingTimeout = 1000000000LL;
+
+/** The simulated external client.
+    Changes bound elements of the card at random, as fast as another ALSA
+    client dragging things around would.
+    */
+class StressClient : public QThread
+{
+public:
+    StressClient(StressTest * test, SoundCard * card, uint seed)
+        : test(test), card(card), seed(seed), stopping(0), events(0)
+    {
+    }
+
+    void stop()
+    {
+        stopping = 1;
+    }
+
+    /// Changes made so far
+    int changes() const
+    {
+        return events;
+    }
+
+protected:
+    void run()
+    {
+        qsrand(seed);
+        const ElementSchema & schema = card->getSchema();
+        QVector<int> ids;
+        for (int row = 0; row < controlBindingCount; row++)
+        {
+            int id = schema.id(controlBindings[row].element);
+            // Clock rate changes start a resync, leave them to the user
+            if (id >= 0 && controlBindings[row].kind != ControlBinding::Item)
+                ids.append(id);
+        }
+        if (ids.isEmpty())
+            return;
+        QVector<long> values(1);
+        while (!stopping)
+        {
+            int id = ids.at(qrand() % ids.size());
+            switch (schema.type(id))
+            {
+            case SND_CTL_ELEM_TYPE_BOOLEAN:
+                values[0] = qrand() % 2;
+                break;
+            case SND_CTL_ELEM_TYPE_ENUMERATED:
+                values[0] = qrand() % schema.items(id);
+                break;
+            default:
+                values[0] = schema.min(id) + qrand() % (schema.max(id) - schema.min(id) + 1);
+            }
+            test->changing(id, values.at(0));
+            card->simulateEvent(id, values);
+            events.ref();
+            usleep(qrand() % 1000);
+        }
+    }
+
+private:
+    StressTest * test;
+    SoundCard * card;
+    uint seed;
+    QAtomicInt stopping;
+    QAtomicInt events;
+};
+
+/// Message handler in use before the test
+static QtMsgHandler previousHandler = NULL;
+
+/// Drops chatter (e.g. routing changes), keeps warnings and results
+static void stressMessage(QtMsgType type, const char * msg)
+{
+    if (type == QtDebugMsg && strncmp(msg, "Warning", 7) && strncmp(msg, "Error", 5)
+        && strncmp(msg, "Stress", 6) && strncmp(msg, "Divergence", 10))
+        return;
+    if (previousHandler)
+        previousHandler(type, msg);
+    else
+        fprintf(stderr, "%s\n", msg);
+}
+
+StressTest::StressTest(MainWindow * window, int seconds, uint seed)
+    : QObject(window), window(window), seconds(seconds), seed(seed), card(NULL), client(NULL),
+      sweep(0), started(0), lastReport(0), userOps(0), clientEvents(0), switches(0),
+      missed(0), latencies(buckets + 1, 0), shownCount(0), worst(0)
+{
+    qsrand(seed);
+    for (int row = 0; row < controlBindingCount; row++)
+    {
+        switch (controlBindings[row].kind)
+        {
+        case ControlBinding::Routing:
+            routes.append(row);
+            break;
+        case ControlBinding::Switch:
+            pads.append(row);
+            break;
+        case ControlBinding::Level:
+            faders.append(row);
+            break;
+        default:
+            break;
+        }
+    }
+    connect(&timer, SIGNAL(timeout()), this, SLOT(act()));
+    connect(window, SIGNAL(bindingShown(int,long)), this, SLOT(shown(int,long)));
+    previousHandler = qInstallMsgHandler(stressMessage);
+    qDebug() << "Stress test for " << seconds << " s, seed " << seed;
+}
+
+StressTest::~StressTest()
+{
+    if (client)
+    {
+        client->stop();
+        client->wait();
+        delete client;
+    }
+    qInstallMsgHandler(previousHandler);
+}
+
+SoundCard * StressTest::createCard()
+{
+    return bindingCard(window, state, "Stress test card");
+}
+
+SoundCard * StressTest::bindingCard(MainWindow * window, const QVector<long> & state, const QString & name)
+{
+    // Layout of the binding table, with as many sources as the matrix has
+    // rows and the fader's range
+    QByteArray layout;
+    QDataStream out(&layout, QIODevice::WriteOnly);
+    out << (qint32)controlBindingCount;
+    for (int row = 0; row < controlBindingCount; row++)
+    {
+        const ControlBinding & b = controlBindings[row];
+        QObject * widget = window->findChild<QObject *>(b.widget);
+        QStringList items;
+        qint64 min = 0, max = 1;
+        quint8 type = SND_CTL_ELEM_TYPE_BOOLEAN;
+        switch (b.kind)
+        {
+        case ControlBinding::Routing:
+        {
+            QButtonGroup * bg = qobject_cast<QButtonGroup *>(widget);
+            for (int i = 0; bg && i < bg->buttons().size(); i++)
+                items.append(SoundCard::matrixSource(-(i + 2)));
+            type = SND_CTL_ELEM_TYPE_ENUMERATED;
+            break;
+        }
+        case ControlBinding::Level:
+        {
+            QAbstractSlider * slider = qobject_cast<QAbstractSlider *>(widget);
+            min = slider ? slider->minimum() : 0;
+            max = slider ? slider->maximum() : 100;
+            type = SND_CTL_ELEM_TYPE_INTEGER;
+            break;
+        }
+        case ControlBinding::Item:
+            items << "44100" << "48000";
+            type = SND_CTL_ELEM_TYPE_ENUMERATED;
+            break;
+        default:
+            break;
+        }
+        if (type == SND_CTL_ELEM_TYPE_ENUMERATED)
+            max = items.size() - 1;
+        quint8 access = ElementSchema::Readable | ElementSchema::Writable;
+        out << QString(b.element) << (quint16)0 << (quint32)(row + 1) << type << access << (quint16)1
+            << min << max << (qint64)0 << items;
+    }
+    QDataStream in(&layout, QIODevice::ReadOnly);
+    ElementSchema::Pointer schema = ElementSchema::fromStream(in);
+    if (state.size() != schema->valueCount())
+        return new SoundCard(schema, QVector<long>(schema->valueCount(), 0), name);
+    return new SoundCard(schema, state, name);
+}
+
+void StressTest::start(SoundCard * c)
+{
+    card = c;
+    const ElementSchema & schema = card->getSchema();
+    ids.resize(controlBindingCount);
+    for (int row = 0; row < controlBindingCount; row++)
+        ids[row] = schema.id(controlBindings[row].element);
+    client = new StressClient(this, card, qrand());
+    client->start();
+    if (!timer.isActive())
+    {
+        started = lastReport = monotonicNs();
+        timer.start(0);
+    }
+}
+
+void StressTest::changing(int id, long value)
+{
+    QMutexLocker locker(&mutex);
+    Pending & p = pending[id];
+    p.value = value;
+    p.when = monotonicNs();
+}
+
+void StressTest::shown(int row, long value)
+{
+    if (row >= ids.size() || ids.at(row) < 0)
+        return;
+    qint64 now = monotonicNs();
+    QMutexLocker locker(&mutex);
+    QHash<int, Pending>::iterator it = pending.find(ids.at(row));
+    if (it == pending.end() || it->value != value)
+        return;
+    qint64 latency = now - it->when;
+    pending.erase(it);
+    latencies[qMin(latency / bucketWidth, (qint64)buckets)]++;
+    worst = qMax(worst, latency);
+    shownCount++;
+}
+
+void StressTest::act()
+{
+    for (int i = 0; i < actionsPerTick; i++)
+    {
+        int r = qrand() % 4;
+        if (r < 2)
+            clickMatrix();
+        else if (r == 2)
+            togglePad();
+        else
+            sweepFader();
+        userOps++;
+        if (userOps % switchEvery == 0)
+        {
+            switchCard();
+            // The timer is still running, take the rest next time
+            return;
+        }
+    }
+    qint64 now = monotonicNs();
+    if (now - lastReport >= reportInterval)
+    {
+        report(false);
+        lastReport = now;
+    }
+    if (now - started >= seconds * 1000000000LL)
+        finish();
+}
+
+void StressTest::clickMatrix()
+{
+    if (routes.isEmpty())
+        return;
+    QButtonGroup * bg = window->findChild<QButtonGroup *>(controlBindings[routes.at(qrand() % routes.size())].widget);
+    if (!bg)
+        return;
+    QList<QAbstractButton *> buttons = bg->buttons();
+    if (buttons.isEmpty())
+        return;
+    QAbstractButton * b = buttons.at(qrand() % buttons.size());
+    // Buttons of sources the card lacks are disabled, and ignore clicks
+    b->click();
+}
+
+void StressTest::togglePad()
+{
+    if (pads.isEmpty())
+        return;
+    QAbstractButton * b = window->findChild<QAbstractButton *>(controlBindings[pads.at(qrand() % pads.size())].widget);
+    if (b)
+        b->click();
+}
+
+void StressTest::sweepFader()
+{
+    if (faders.isEmpty())
+        return;
+    QAbstractSlider * s = window->findChild<QAbstractSlider *>(controlBindings[faders.at(qrand() % faders.size())].widget);
+    if (!s)
+        return;
+    // Dragging: small steps, back to the bottom at the top
+    sweep += 1 + qrand() % 5;
+    s->setValue(s->minimum() + sweep % (s->maximum() - s->minimum() + 1));
+}
+
+void StressTest::switchCard()
+{
+    client->stop();
+    client->wait();
+    clientEvents += client->changes();
+    delete client;
+    client = NULL;
+    {
+        QMutexLocker locker(&mutex);
+        pending.clear();
+    }
+    state = card->getCachedState();
+    SoundCard * c = createCard();
+    // Closes the current card, as picking another one in the combo does
+    window->useCard(c);
+    start(c);
+    switches++;
+}
+
+void StressTest::finish()
+{
+    timer.stop();
+    client->stop();
+    client->wait();
+    clientEvents += client->changes();
+    delete client;
+    client = NULL;
+    // Let the last events reach the window
+    QTimer::singleShot(500, this, SLOT(compare()));
+}
+
+void StressTest::compare()
+{
+    const ElementSchema & schema = card->getSchema();
+    int widgetDiffs = 0, deviceDiffs = 0;
+    for (int row = 0; row < controlBindingCount; row++)
+    {
+        int id = ids.at(row);
+        if (id < 0)
+            continue;
+        long shows = window->bindingValue(row);
+        long has = card->getCached(id).at(0);
+        if (shows != has)
+        {
+            qDebug() << "Divergence: " << schema.name(id) << " shows " << shows << ", card has " << has;
+            widgetDiffs++;
+        }
+    }
+    for (int id = 0; id < schema.size(); id++)
+    {
+        QVector<long> values;
+        if (card->readDevice(id, values) && values != card->getCached(id))
+        {
+            qDebug() << "Divergence: " << schema.name(id) << " cached differently from the device";
+            deviceDiffs++;
+        }
+    }
+    report(true);
+    qDebug() << "Stress test done: " << widgetDiffs << " widgets and "
+             << deviceDiffs << " elements diverge";
+    QCoreApplication::exit(widgetDiffs || deviceDiffs ? 1 : 0);
+}
+
+qint64 StressTest::percentile(double p) const
+{
+    qint64 target = (qint64)(p * shownCount + 0.5);
+    qint64 seen = 0;
+    for (int i = 0; i < buckets; i++)
+    {
+        seen += latencies.at(i);
+        if (seen >= target)
+            return (i + 1) * bucketWidth / 1000;
+    }
+    return worst / 1000;
+}
+
+void StressTest::report(bool final)
+{
+    qint64 now = monotonicNs();
+    {
+        // Changes that never showed were overwritten by the user
+        QMutexLocker locker(&mutex);
+        QHash<int, Pending>::iterator it = pending.begin();
+        while (it != pending.end())
+            if (now - it->when > pendingTimeout)
+            {
+                it = pending.erase(it);
+                missed++;
+            }
+            else
+                ++it;
+    }
+    double s = (now - started) / 1e9;
+    qint64 events = clientEvents + (client ? client->changes() : 0);
+    qDebug() << "Stress" << (final ? " result" : "") << ": " << s << " s, "
+             << (s > 0 ? userOps / s : 0) << " user ops/s, "
+             << (s > 0 ? events / s : 0) << " client changes/s, " << switches << " card switches";
+    qDebug() << "Stress UI latency: " << shownCount << " shown, p50 " << percentile(0.5)
+             << " us, p99 " << percentile(0.99) << " us, p99.9 " << percentile(0.999)
+             << " us, max " << worst / 1000 << " us; " << missed << " overwritten";
+}
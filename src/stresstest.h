@@ -0,0 +1,134 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef STRESSTEST_H
+#define STRESSTEST_H
+
+#include <QObject>
+#include <QTimer>
+#include <QMutex>
+#include <QHash>
+#include <QVector>
+#include "soundcard.h"
+
+class MainWindow;
+class StressClient;
+
+/** Stress and consistency test of the control path.
+    Runs on a virtual card with the layout of the binding table (see
+    controlbindings.h), so no E-mu card is needed. Random user actions
+    (matrix clicks, pad toggles, fader sweeps, card switches) go through the
+    window's widgets, while another thread changes the same elements as an
+    external ALSA client would, through SoundCard::simulateEvent().
+
+    Reports operations per second and how long external changes take to show
+    on the widgets, every 10 s and at the end. When time is up, widgets,
+    card cache and virtual device are compared, and the application quits
+    with status 1 if they differ. Meant to run for long, also in sanitizer
+    builds (qmake CONFIG+=tsan or CONFIG+=asan).
+    */
+class StressTest : public QObject
+{
+    Q_OBJECT
+
+public:
+    /** Sets up the test; start() runs it.
+        @param window Window whose widgets are driven
+        @param seconds How long to run
+        @param seed Random seed, to repeat a run
+        */
+    StressTest(MainWindow * window, int seconds, uint seed);
+    ~StressTest();
+
+    /** Creates a virtual card with the layout of the binding table.
+        In the state of the previous card, if any. Caller takes ownership.
+        */
+    SoundCard * createCard();
+    /** Virtual card with the layout of the binding table.
+        As many sources as the window's matrix has rows, and its fader ranges.
+        @param window Window whose widgets give the layout
+        @param state Initial values, all 0 if they don't fit the layout
+        @param name Card name
+        @return New card, caller takes ownership.
+        */
+    static SoundCard * bindingCard(MainWindow * window, const QVector<long> & state, const QString & name);
+    /** Starts user actions and the external client.
+        The window must be using a card from createCard().
+        */
+    void start(SoundCard * card);
+
+private slots:
+    /// Next user actions
+    void act();
+    /// A bound widget shows a value
+    void shown(int row, long value);
+    /// Time is up, let things settle and compare
+    void finish();
+    void compare();
+
+private:
+    /// External change about to be made, waiting to be shown
+    struct Pending
+    {
+        long value;
+        qint64 when;
+    };
+    friend class StressClient;
+    /// Called by the client before changing element id
+    void changing(int id, long value);
+
+    void clickMatrix();
+    void togglePad();
+    void sweepFader();
+    void switchCard();
+    /// Prints operation rates and latency percentiles
+    void report(bool final);
+    /// Latency percentile (us), from the histogram
+    qint64 percentile(double p) const;
+
+    MainWindow * window;
+    int seconds;
+    uint seed;
+    SoundCard * card;
+    StressClient * client;
+    QTimer timer;
+    /// Last state, for the next card
+    QVector<long> state;
+    /// Element id by binding row, of the current card
+    QVector<int> ids;
+    /// Rows by kind of widget
+    QVector<int> routes, pads, faders;
+    int sweep;
+    qint64 started;
+    qint64 lastReport;
+    qint64 userOps;
+    /// Changes by clients of previous cards
+    qint64 clientEvents;
+    int switches;
+    /// Protects pending, taken by the client and the GUI thread
+    QMutex mutex;
+    QHash<int, Pending> pending;
+    qint64 missed;
+    /** UI latency histogram, 100 us buckets up to 1 s, plus overflow.
+        Fixed size, so runs of hours don't grow.
+        */
+    QVector<qint64> latencies;
+    qint64 shownCount;
+    qint64 worst;
+};
+
+#endif // STRESSTEST_H
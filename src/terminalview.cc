@@ -0,0 +1,434 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "terminalview.h"
+#include "controlbindings.h"
+#include "matrix_visibility.h"
+#include <QString>
+#include <QtAlgorithms>
+#include <curses.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+/// First matrix (grid) row and column with buttons; those before are labels
+static const int firstGridRow = 2;
+static const int firstGridCol = 2;
+/// Grid size, as in mainwindow.ui
+static const int gridRows = 38;
+static const int gridCols = 32;
+/// Screen columns for source names
+static const int labelWidth = 18;
+/// Screen lines above the matrix: status, pads, blank and two header lines
+static const int headerLines = 5;
+/// Screen columns per pad on the pad line
+static const int padWidth = 12;
+/// How long to wait for card events before looking at the keyboard (ms)
+static const int eventTimeout = 20;
+
+/// Output group labels of the matrix header, by first grid column
+struct ColumnGroup
+{
+    int col;
+    const char * label;
+};
+static const ColumnGroup columnGroups[] = {
+    { 2, "ALSA Capture" },
+    { 8, "0202" },
+    { 10, "1010 ADAT" },
+    { 18, "SPDIF" },
+    { 20, "Dock DAC" },
+    { 28, "Phone" },
+    { 30, "SPDIF" },
+    { gridCols, NULL }
+};
+/// Channel labels of the matrix header, by grid column from firstGridCol
+static const char * const columnLabels[] = {
+    "11", "12", "13", "14", "15", "16", "L", "R",
+    "0", "1", "2", "3", "4", "5", "6", "7", "L", "R",
+    "1L", "1R", "2L", "2R", "3L", "3R", "4L", "4R", "L", "R", "L", "R"
+};
+
+QByteArray TerminalView::message;
+bool TerminalView::messageChanged = false;
+bool TerminalView::active = false;
+
+/// Appends the grid lines of a -1 terminated list, labels excluded
+static void addVisible(QVector<int> & visible, const int list[], int first)
+{
+    for (; *list >= 0; list++)
+        if (*list >= first && !visible.contains(*list))
+            visible.append(*list);
+}
+
+TerminalView::TerminalView(SoundCard * c, Config conf)
+    : card(c), schema(c->getSchema()), config(conf), sourceElement(-1),
+      masterRow(-1), rateRow(-1), cursorRow(0), cursorCol(0), link(false),
+      cellWidth(3), ready(false)
+{
+    columnBinding.fill(-1, gridCols);
+    bindingColumn.fill(-1, controlBindingCount);
+    shown.fill(-1, controlBindingCount);
+    // Routing rows of the binding table are the matrix columns, in order
+    int col = firstGridCol;
+    for (int row = 0; row < controlBindingCount; row++)
+    {
+        const ControlBinding & b = controlBindings[row];
+        int id = schema.id(b.element);
+        switch (b.kind)
+        {
+        case ControlBinding::Routing:
+            if (col < gridCols)
+            {
+                columnBinding[col] = row;
+                bindingColumn[row] = col;
+            }
+            col++;
+            if (sourceElement < 0 && id >= 0)
+                sourceElement = id;
+            break;
+        case ControlBinding::Switch:
+            if (id >= 0)
+                pads.append(row);
+            break;
+        case ControlBinding::Level:
+            if (!strcmp(b.widget, "master"))
+                masterRow = row;
+            break;
+        case ControlBinding::Item:
+            if (!strcmp(b.widget, "rate"))
+                rateRow = row;
+            break;
+        }
+    }
+    initscr();
+    cbreak();
+    noecho();
+    keypad(stdscr, TRUE);
+    nodelay(stdscr, TRUE);
+    curs_set(0);
+    active = true;
+    layout();
+}
+
+TerminalView::~TerminalView()
+{
+    endwin();
+    active = false;
+}
+
+void TerminalView::run()
+{
+    for (;;)
+    {
+        card->processEvents(eventTimeout);
+        int ch;
+        while ((ch = getch()) != ERR)
+            if (!key(ch))
+                return;
+        // Card events and our own writes, in one go
+        card->updateWindow();
+        drawMessage();
+        refresh();
+    }
+}
+
+void TerminalView::showBinding(int row, long v)
+{
+    long old = shown.at(row);
+    shown[row] = v;
+    if (!ready)
+        return;
+    switch (controlBindings[row].kind)
+    {
+    case ControlBinding::Routing:
+        // Just the cell losing the route and the one getting it
+        if (bindingColumn.at(row) >= 0)
+        {
+            drawCell(old + firstGridRow, bindingColumn.at(row));
+            drawCell(v + firstGridRow, bindingColumn.at(row));
+        }
+        break;
+    case ControlBinding::Switch:
+        if (pads.indexOf(row) >= 0)
+            drawPad(pads.indexOf(row));
+        break;
+    case ControlBinding::Level:
+    case ControlBinding::Item:
+        drawStatus();
+        break;
+    }
+}
+
+void TerminalView::showMessage(QtMsgType type, const char * msg)
+{
+    if (active)
+    {
+        message = msg;
+        messageChanged = true;
+    }
+    else
+        fprintf(stderr, "%s\n", msg);
+    if (type == QtFatalMsg)
+    {
+        if (active)
+            endwin();
+        fprintf(stderr, "%s\n", msg);
+        abort();
+    }
+}
+
+void TerminalView::layout()
+{
+    rows.clear();
+    cols.clear();
+    // 1010 is always visible, as in the window
+    addVisible(rows, matrixCommonRows, firstGridRow);
+    addVisible(rows, matrixALSArows, firstGridRow);
+    addVisible(rows, matrix1010rows, firstGridRow);
+    addVisible(cols, matrixCommonCols, firstGridCol);
+    addVisible(cols, matrixALSAcols, firstGridCol);
+    addVisible(cols, matrix1010cols, firstGridCol);
+    if (config == Config0202)
+    {
+        addVisible(rows, matrix0202rows, firstGridRow);
+        addVisible(cols, matrix0202cols, firstGridCol);
+    }
+    else if (config == ConfigDock)
+    {
+        addVisible(rows, matrixDockRows, firstGridRow);
+        addVisible(cols, matrixDockCols, firstGridCol);
+    }
+    qSort(rows);
+    qSort(cols);
+    cellWidth = cols.isEmpty() || (COLS - labelWidth) / cols.size() >= 3 ? 3 : 2;
+    cursorRow = qBound(0, cursorRow, rows.size() - 1);
+    cursorCol = qBound(0, cursorCol, cols.size() - 1);
+    rowLine.fill(-1, gridRows);
+    colX.fill(-1, gridCols);
+    for (int i = 0; i < rows.size(); i++)
+        rowLine[rows.at(i)] = headerLines + i;
+    for (int i = 0; i < cols.size(); i++)
+        colX[cols.at(i)] = labelWidth + i * cellWidth;
+
+    ready = true;
+    erase();
+    drawStatus();
+    drawPads();
+    // Output groups over their first visible column, then channels
+    for (int g = 0; columnGroups[g].label; g++)
+    {
+        int x = -1;
+        int span = 0;
+        for (int c = columnGroups[g].col; c < columnGroups[g + 1].col; c++)
+            if (colX.at(c) >= 0)
+            {
+                x = x < 0 ? colX.at(c) : x;
+                span += cellWidth;
+            }
+        if (x >= 0)
+            mvaddnstr(headerLines - 2, x, columnGroups[g].label, span - 1);
+    }
+    for (int i = 0; i < cols.size(); i++)
+        mvaddnstr(headerLines - 1, colX.at(cols.at(i)), columnLabels[cols.at(i) - firstGridCol], cellWidth - 1);
+    // Sources, named by the card
+    for (int i = 0; i < rows.size(); i++)
+    {
+        int ix = rows.at(i) - firstGridRow;
+        if (sourceElement >= 0 && ix < (int)schema.items(sourceElement))
+            mvaddnstr(rowLine.at(rows.at(i)), 0,
+                      schema.itemName(sourceElement, ix).toLocal8Bit().constData(), labelWidth - 1);
+        for (int j = 0; j < cols.size(); j++)
+            drawCell(rows.at(i), cols.at(j));
+    }
+    mvaddnstr(LINES - 1, 0, "arrows move  space route  l link  1-9 pads  +/- master  r rate  c config  q quit", COLS - 1);
+    messageChanged = true;
+    drawMessage();
+}
+
+void TerminalView::drawCell(int r, int c)
+{
+    int y = rowLine.value(r, -1);
+    int x = colX.value(c, -1);
+    if (y < 0 || x < 0)
+        return;
+    int b = columnBinding.at(c);
+    int id = b < 0 ? -1 : schema.id(controlBindings[b].element);
+    int ix = r - firstGridRow;
+    // Routed, available, or not offered by the card
+    chtype ch = ' ';
+    if (id >= 0 && schema.isValid(id, ix))
+        ch = shown.at(b) == ix ? '#' : '.';
+    bool cursor = rows.at(cursorRow) == r && cols.at(cursorCol) == c;
+    mvaddch(y, x, ch | (cursor ? A_REVERSE : A_NORMAL));
+}
+
+void TerminalView::drawStatus()
+{
+    QString status = card->getName();
+    int id = rateRow < 0 ? -1 : schema.id(controlBindings[rateRow].element);
+    if (id >= 0 && shown.at(rateRow) >= 0 && shown.at(rateRow) < (long)schema.items(id))
+        status += QString("  Rate: %1").arg(schema.itemName(id, shown.at(rateRow)));
+    id = masterRow < 0 ? -1 : schema.id(controlBindings[masterRow].element);
+    if (id >= 0 && schema.hasDb(id))
+    {
+        long db = schema.toDb(id, shown.at(masterRow));
+        status += db <= SND_CTL_TLV_DB_GAIN_MUTE ? QString("  Master: -inf dB")
+                  : QString("  Master: %1 dB").arg(db / 100.0, 0, 'f', 1);
+    }
+    else if (id >= 0)
+        status += QString("  Master: %1").arg(shown.at(masterRow));
+    const char * const configNames[] = { "1212M", "1010 only", "Dock" };
+    status += QString("  Connections: %1  Link: %2").arg(configNames[config]).arg(link ? "on" : "off");
+    move(0, 0);
+    clrtoeol();
+    addnstr(status.toLocal8Bit().constData(), COLS - 1);
+}
+
+void TerminalView::drawPads()
+{
+    move(1, 0);
+    clrtoeol();
+    addstr("Pads");
+    for (int i = 0; i < pads.size(); i++)
+        drawPad(i);
+}
+
+void TerminalView::drawPad(int i)
+{
+    char field[padWidth + 1];
+    snprintf(field, sizeof(field), "%d:%s[%c]", i + 1, controlBindings[pads.at(i)].widget,
+             shown.at(pads.at(i)) > 0 ? 'x' : ' ');
+    mvaddnstr(1, 5 + i * padWidth, field, padWidth - 1);
+}
+
+void TerminalView::drawMessage()
+{
+    if (!messageChanged)
+        return;
+    messageChanged = false;
+    move(LINES - 2, 0);
+    clrtoeol();
+    addnstr(message.constData(), COLS - 1);
+}
+
+bool TerminalView::key(int ch)
+{
+    int id;
+    switch (ch)
+    {
+    case 'q':
+    case 'Q':
+        return false;
+    case KEY_UP:
+        moveCursor(-1, 0);
+        break;
+    case KEY_DOWN:
+        moveCursor(1, 0);
+        break;
+    case KEY_LEFT:
+        moveCursor(0, -1);
+        break;
+    case KEY_RIGHT:
+        moveCursor(0, 1);
+        break;
+    case ' ':
+    case '\n':
+    case KEY_ENTER:
+        route();
+        break;
+    case 'l':
+        link = !link;
+        drawStatus();
+        break;
+    case '+':
+    case '=':
+    case '-':
+        id = masterRow < 0 ? -1 : schema.id(controlBindings[masterRow].element);
+        if (id >= 0)
+        {
+            long step = qMax(schema.step(id), 1L) * (ch == '-' ? -1 : 1);
+            card->writeStereoInt(controlBindings[masterRow].element,
+                                 schema.clamp(id, shown.at(masterRow) + step));
+        }
+        break;
+    case 'r':
+        id = rateRow < 0 ? -1 : schema.id(controlBindings[rateRow].element);
+        if (id >= 0 && schema.items(id))
+            card->writeEnum(controlBindings[rateRow].element, (shown.at(rateRow) + 1) % schema.items(id));
+        break;
+    case 'c':
+        config = (Config)((config + 1) % 3);
+        layout();
+        break;
+    case KEY_RESIZE:
+        layout();
+        break;
+    default:
+        if (ch >= '1' && ch <= '9' && ch - '1' < pads.size())
+        {
+            int row = pads.at(ch - '1');
+            card->writeBool(controlBindings[row].element, shown.at(row) <= 0);
+        }
+        break;
+    }
+    return true;
+}
+
+void TerminalView::moveCursor(int dr, int dc)
+{
+    if (rows.isEmpty() || cols.isEmpty())
+        return;
+    int r = rows.at(cursorRow);
+    int c = cols.at(cursorCol);
+    cursorRow = qBound(0, cursorRow + dr, rows.size() - 1);
+    cursorCol = qBound(0, cursorCol + dc, cols.size() - 1);
+    drawCell(r, c);
+    drawCell(rows.at(cursorRow), cols.at(cursorCol));
+}
+
+void TerminalView::route()
+{
+    if (rows.isEmpty() || cols.isEmpty())
+        return;
+    int b = columnBinding.at(cols.at(cursorCol));
+    int ix = rows.at(cursorRow) - firstGridRow;
+    if (b < 0)
+        return;
+    const ControlBinding & c = controlBindings[b];
+    WriteBatch batch;
+    ElementWrite w;
+    w.id = schema.id(c.element);
+    if (w.id < 0 || !schema.isValid(w.id, ix))
+        return;
+    w.values.append(ix);
+    batch.append(w);
+    // L-R link enabled? Then the partner column gets the partner source,
+    // written together with this one.
+    if (link && c.partner)
+    {
+        ElementWrite p;
+        p.id = schema.id(controlBindings[b + c.partner].element);
+        int pix = linkedSource(ix);
+        if (p.id >= 0 && schema.isValid(p.id, pix) && shown.at(b + c.partner) != pix)
+        {
+            p.values.append(pix);
+            batch.append(p);
+        }
+    }
+    card->writeBatch(batch);
+}
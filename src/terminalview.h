@@ -0,0 +1,135 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef TERMINALVIEW_H
+#define TERMINALVIEW_H
+
+#include <QVector>
+#include <QByteArray>
+#include <QtGlobal>
+#include "soundcard.h"
+
+/** Terminal (ncurses) frontend.
+    For working over SSH, where starting the window takes seconds. Shows
+    the routing matrix, filtered by device configuration like the window's
+    connector buttons (see matrix_visibility.h), the pads, master level
+    and clock rate, all through the binding table (controlbindings.h).
+
+    Only what changes is drawn: showBinding() redraws the old and new
+    cell of a routing column, or the pad or status field of other bindings.
+    The whole screen is laid out again only when the configuration or the
+    terminal size changes.
+
+    Keys: arrows move, space/enter routes the source to the output,
+    l toggles L-R link, 1-9 toggle pads, +/- master, r next rate,
+    c next configuration, q quits.
+    */
+class TerminalView : public CardView
+{
+public:
+    /// Devices connected to the card, as the window's connector buttons
+    enum Config
+    {
+        /// 1010 and 1212 (0202) boards
+        Config0202,
+        /// 1010 board only
+        Config1010,
+        /// 1010 board and Audio Dock
+        ConfigDock
+    };
+
+    /** Takes over the terminal.
+        Call SoundCard::setupCallbacks() on the card afterwards, to show
+        its values.
+        */
+    TerminalView(SoundCard * card, Config config);
+    /// Gives the terminal back
+    ~TerminalView();
+
+    /** Handles card events and keys until q is pressed. */
+    void run();
+
+    void showBinding(int row, long v);
+
+    /** Qt message handler.
+        Messages end up on the bottom line instead of garbling the screen.
+        */
+    static void showMessage(QtMsgType type, const char * msg);
+
+private:
+    /// Works out visible rows and columns, and draws everything
+    void layout();
+    /** Draws a matrix cell.
+        @param r Matrix (grid) row, as in matrix_visibility.h
+        @param c Matrix (grid) column
+        */
+    void drawCell(int r, int c);
+    /// Draws the status line: card, rate, master, configuration, link
+    void drawStatus();
+    /// Draws the pad line
+    void drawPads();
+    /// Draws pad i of the pad line
+    void drawPad(int i);
+    /// Draws the latest message, if there's a new one
+    void drawMessage();
+    /// Handles a key. @return false to quit.
+    bool key(int ch);
+    /// Moves the cursor by rows/columns of the visible matrix
+    void moveCursor(int dr, int dc);
+    /// Routes the source under the cursor to its output (and its partner's)
+    void route();
+
+    SoundCard * card;
+    const ElementSchema & schema;
+    Config config;
+    /// Visible matrix rows (sources) and columns (outputs), grid numbering
+    QVector<int> rows;
+    QVector<int> cols;
+    /// Screen line and column of grid rows and columns, -1 if hidden
+    QVector<int> rowLine;
+    QVector<int> colX;
+    /// Binding table row of each grid column, -1 for label columns
+    QVector<int> columnBinding;
+    /// Grid column of each binding table row, -1 if not a routing row
+    QVector<int> bindingColumn;
+    /// Value on screen, by binding table row
+    QVector<long> shown;
+    /// Binding table rows of the pads the card has, in key order
+    QVector<int> pads;
+    /// Element whose items name the matrix rows, -1 if none
+    int sourceElement;
+    /// Binding table rows of the master fader and rate combo, -1 if none
+    int masterRow;
+    int rateRow;
+    /// Cursor, as indices into rows and cols
+    int cursorRow;
+    int cursorCol;
+    /// L-R link, as the window's link button
+    bool link;
+    /// Screen columns per matrix cell
+    int cellWidth;
+    /// False until layout(); no drawing before
+    bool ready;
+
+    /// Latest message, see showMessage()
+    static QByteArray message;
+    static bool messageChanged;
+    /// True while the terminal is ours
+    static bool active;
+};
+
+#endif // TERMINALVIEW_H
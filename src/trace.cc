@@ -0,0 +1,222 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+#include <QDebug>
+#include <QMutexLocker>
+#include "monotonic.h"
+
+/// "EMXT"
+static const quint32 traceMagic = 0x454d5854;
+static const quint16 traceVersion = 5;
+/// Longest a fast replay runs per play() call (ns), so the window keeps up
+static const qint64 fastSlice = 5000000;
+
+TraceRecorder::TraceRecorder(SoundCard * card, const QString & path)
+    : card(card), file(path), last(monotonicNs())
+{
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+    {
+        qDebug() << "Warning: Can't record to " << path << ": " << file.errorString();
+        return;
+    }
+    out.setDevice(&file);
+    out.setVersion(QDataStream::Qt_4_6);
+    const ElementSchema & schema = card->getSchema();
+    QVector<long> state = card->getCachedState();
+    out << traceMagic << traceVersion << card->getName();
+    schema.save(out);
+    out << (qint32)state.size();
+    for (int i = 0; i < state.size(); i++)
+        out << (qint32)state.at(i);
+    card->addObserver(this);
+    qDebug() << "Recording trace to " << path;
+}
+
+TraceRecorder::~TraceRecorder()
+{
+    if (file.isOpen())
+        card->removeObserver(this);
+}
+
+void TraceRecorder::record(Trace::Kind kind)
+{
+    qint64 now = monotonicNs();
+    out << (quint32)((now - last) / 1000) << (quint8)kind;
+    // Keep the remainder, so rounding doesn't add up
+    last = now - (now - last) % 1000;
+}
+
+void TraceRecorder::elementChanged(const SoundCard *, const CardChange & change)
+{
+    const ElementSchema & schema = card->getSchema();
+    unsigned int n = qMin(schema.count(change.id), 255u);
+    if (!change.written)
+    {
+        // Readbacks only give the replayed device its values; the events
+        // are recorded by elementEvent()
+        unsigned int i;
+        for (i = 0; i < n && change.values[i] == change.old[i]; i++)
+            ;
+        if (i == n)
+            return;
+    }
+    record(change.written ? Trace::Write : Trace::Readback);
+    out << (quint16)change.id << (quint8)n;
+    for (unsigned int i = 0; i < n; i++)
+        out << (qint32)change.values[i];
+}
+
+void TraceRecorder::elementEvent(const SoundCard *, int id, unsigned int mask)
+{
+    record(Trace::Event);
+    out << (quint16)id << (quint32)mask;
+}
+
+void TraceRecorder::batchStarted(const SoundCard *)
+{
+    record(Trace::BatchStart);
+}
+
+void TraceRecorder::batchFinished(const SoundCard *)
+{
+    record(Trace::BatchEnd);
+}
+
+TracePlayer::TracePlayer(const QString & path)
+    : file(path), mask(0), pending(false), inBatch(false), start(0), end(0), count(0)
+{
+    if (!file.open(QIODevice::ReadOnly))
+        throw QString("Can't open trace %1: %2").arg(path).arg(file.errorString());
+    in.setDevice(&file);
+    in.setVersion(QDataStream::Qt_4_6);
+    quint32 magic;
+    quint16 version;
+    in >> magic >> version;
+    if (magic != traceMagic || version != traceVersion)
+        throw QString("%1 is not an emutrix trace.").arg(path);
+    in >> name;
+    schema = ElementSchema::fromStream(in);
+    qint32 n;
+    in >> n;
+    if (n != schema->valueCount())
+        throw QString("Bad trace %1.").arg(path);
+    state.resize(n);
+    for (int i = 0; i < n; i++)
+    {
+        qint32 v;
+        in >> v;
+        state[i] = v;
+    }
+    if (in.status() != QDataStream::Ok)
+        throw QString("Bad trace %1.").arg(path);
+    when = 0;
+    pending = readNext();
+}
+
+SoundCard * TracePlayer::createCard() const
+{
+    return new SoundCard(schema, state, name);
+}
+
+bool TracePlayer::readNext()
+{
+    quint32 dt;
+    in >> dt >> kind;
+    if (in.status() != QDataStream::Ok)
+        return false;
+    when += (qint64)dt * 1000;
+    values.clear();
+    if (kind == Trace::Readback || kind == Trace::Write || kind == Trace::Event)
+    {
+        quint16 i;
+        in >> i;
+        id = i;
+        if (kind == Trace::Event)
+            in >> mask;
+        else
+        {
+            quint8 n;
+            in >> n;
+            for (int c = 0; c < n; c++)
+            {
+                qint32 v;
+                in >> v;
+                values.append(v);
+            }
+        }
+        if (id >= schema->size())
+        {
+            qDebug() << "Warning: Trace has no element #" << id;
+            return false;
+        }
+    }
+    return in.status() == QDataStream::Ok;
+}
+
+bool TracePlayer::play(SoundCard * card, bool fast)
+{
+    qint64 now = monotonicNs();
+    if (!start)
+        start = now;
+    while (pending && (fast ? monotonicNs() - now < fastSlice : when <= now - start))
+    {
+        switch (kind)
+        {
+        case Trace::Event:
+            card->simulateEvent(id, mask);
+            break;
+        case Trace::Readback:
+            card->simulateValue(id, values);
+            break;
+        case Trace::Write:
+            {
+                ElementWrite w;
+                w.id = id;
+                w.values = values;
+                batch.append(w);
+                if (!inBatch)
+                {
+                    card->writeBatch(batch);
+                    batch.clear();
+                }
+            }
+            break;
+        case Trace::BatchStart:
+            inBatch = true;
+            break;
+        case Trace::BatchEnd:
+            inBatch = false;
+            card->writeBatch(batch);
+            batch.clear();
+            break;
+        default:
+            qDebug() << "Warning: Unknown trace record " << kind;
+        }
+        count++;
+        pending = readNext();
+    }
+    if (!pending && !end)
+        end = monotonicNs();
+    return pending;
+}
+
+qint64 TracePlayer::elapsed() const
+{
+    if (!start)
+        return 0;
+    return (end ? end : monotonicNs()) - start;
+}
@@ -0,0 +1,133 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <QFile>
+#include <QDataStream>
+#include <QString>
+#include "soundcard.h"
+
+/** Control event traces.
+    A trace starts with the card's name, element schema and state, so it can
+    be replayed on a virtual card, with no E-mu card around. Then come the
+    records: every event ALSA reported (raw, before coalescing, so storms
+    replay as storms), the values read back after them (readbacks), our
+    own writes, and batch boundaries, each with the time since the
+    previous record.
+
+    Record layout (QDataStream, big endian):
+    - quint32 microseconds since previous record
+    - quint8 kind (Trace::Kind)
+    - readbacks and writes: quint16 element id, quint8 value count,
+      qint32 values
+    - events: quint16 element id, quint32 event mask
+    */
+namespace Trace
+{
+    enum Kind { Readback, Write, BatchStart, BatchEnd, Event };
+}
+
+/** Records a card's events and writes to a trace file.
+    Follows the card as an observer, from the moment it is created.
+    */
+class TraceRecorder : public CardObserver
+{
+public:
+    /** Opens the trace file and writes the card's current state.
+        On failure, a warning is printed and nothing is recorded.
+        */
+    TraceRecorder(SoundCard * card, const QString & path);
+    /** Unregisters from the card and closes the file. */
+    ~TraceRecorder();
+
+    void elementChanged(const SoundCard * card, const CardChange & change);
+    void elementEvent(const SoundCard * card, int id, unsigned int mask);
+    void batchStarted(const SoundCard * card);
+    void batchFinished(const SoundCard * card);
+
+private:
+    /// Writes record header
+    void record(Trace::Kind kind);
+
+    SoundCard * card;
+    QFile file;
+    QDataStream out;
+    /// Time of the last record (ns)
+    qint64 last;
+};
+
+/** Replays a trace.
+    Events go through SoundCard::simulateEvent(), and readbacks set the
+    virtual device's values (SoundCard::simulateValue()), so the card
+    coalesces and reads back as if ALSA had reported them. Writes are
+    written again (batches as batches).
+    */
+class TracePlayer
+{
+public:
+    /** Opens a trace and reads its header.
+        Throws QString if it isn't a trace.
+        */
+    TracePlayer(const QString & path);
+
+    /** Creates a virtual card in the recorded initial state.
+        Caller takes ownership.
+        */
+    SoundCard * createCard() const;
+    /** Plays the records that are due.
+        Call it often. Must be called from the thread that handles
+        the card's callbacks.
+        @param card Card to play on
+        @param fast Ignore recorded times: play as much as fits in a few
+                    milliseconds, the rest on the next calls
+        @return false when the trace is over.
+        */
+    bool play(SoundCard * card, bool fast);
+
+    /// Records played so far
+    int played() const { return count; }
+    /// Time spent playing so far (ns)
+    qint64 elapsed() const;
+
+private:
+    /// Reads next record into kind, when, id and values; false at the end
+    bool readNext();
+
+    QFile file;
+    QDataStream in;
+    QString name;
+    ElementSchema::Pointer schema;
+    QVector<long> state;
+    /// Next record
+    quint8 kind;
+    qint64 when;
+    int id;
+    QVector<long> values;
+    quint32 mask;
+    bool pending;
+    /// Writes of the batch being played
+    WriteBatch batch;
+    bool inBatch;
+    /// When playing started (ns), 0 if not yet
+    qint64 start;
+    /// When playing ended (ns), 0 if not yet
+    qint64 end;
+    int count;
+};
+
+#endif // TRACE_H
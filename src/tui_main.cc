@@ -0,0 +1,67 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <QStringList>
+#include <QPair>
+#include <QtDebug>
+#include <cstdio>
+#include "soundcard.h"
+#include "terminalview.h"
+
+int main(int argc, char *argv[])
+{
+    // No QApplication: nothing here needs an event loop, or a display
+    qInstallMsgHandler(TerminalView::showMessage);
+    QStringList args;
+    for (int i = 1; i < argc; i++)
+        args.append(QString::fromLocal8Bit(argv[i]));
+    // --card N: ALSA card index, otherwise the first E-mu card found
+    // --connections 1212|1010|dock: matrix shown, as the window's connector buttons
+    int index = -1;
+    int opt = args.indexOf("--card");
+    if (opt >= 0 && opt + 1 < args.size())
+        index = args.at(opt + 1).toInt();
+    TerminalView::Config config = TerminalView::Config0202;
+    opt = args.indexOf("--connections");
+    if (opt >= 0 && opt + 1 < args.size())
+    {
+        if (args.at(opt + 1) == "1010")
+            config = TerminalView::Config1010;
+        else if (args.at(opt + 1) == "dock")
+            config = TerminalView::ConfigDock;
+    }
+    try
+    {
+        if (index < 0)
+        {
+            QList<QPair<QString, int> > cards = SoundCard::getCardList();
+            if (cards.isEmpty())
+                throw QString("No E-mu card found.");
+            index = cards.first().second;
+        }
+        SoundCard card(index);
+        TerminalView view(&card, config);
+        card.setupCallbacks(&view);
+        view.run();
+    }
+    catch(QString err) // catch fatal errors
+    {
+        fprintf(stderr, "%s\n", err.toLocal8Bit().constData());
+        return 1;
+    }
+    return 0;
+}
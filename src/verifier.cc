@@ -0,0 +1,142 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "verifier.h"
+#include <QSettings>
+#include <QMutexLocker>
+#include <QDebug>
+
+DriftVerifier::DriftVerifier(SoundCard * card, QObject * parent)
+    : QThread(parent), card(card), position(0), cachedSum(0), seenSum(0),
+      stopping(0), driftCount(0)
+{
+    QSettings settings;
+    interval = qMax(settings.value("verifier/interval", 100).toInt(), 1);
+    slice = qMax(settings.value("verifier/slice", 8).toInt(), 1);
+    const ElementSchema & schema = card->getSchema();
+    cached.fill(0, schema.size());
+    card->addObserver(this);
+    // Both start out as the cache; drift shows up as reads come in
+    QVector<long> state = card->getCachedState();
+    QMutexLocker locker(&mutex);
+    for (int id = 0; id < schema.size(); id++)
+    {
+        cached[id] = hash(id, state.constData() + schema.offset(id), schema.count(id));
+        cachedSum += cached.at(id);
+    }
+    seen = cached;
+    seenSum = cachedSum;
+}
+
+DriftVerifier::~DriftVerifier()
+{
+    stop();
+    wait();
+    card->removeObserver(this);
+}
+
+void DriftVerifier::stop()
+{
+    stopping = 1;
+}
+
+int DriftVerifier::drifted() const
+{
+    return driftCount;
+}
+
+quint32 DriftVerifier::hash(int id, const long * values, unsigned int n)
+{
+    // FNV-1a, seeded with the id so equal values of different elements
+    // don't cancel out in the sums
+    quint32 h = 2166136261u ^ (quint32)id;
+    for (unsigned int i = 0; i < n; i++)
+    {
+        quint32 v = (quint32)values[i];
+        for (int b = 0; b < 4; b++)
+        {
+            h ^= (v >> (b * 8)) & 0xff;
+            h *= 16777619u;
+        }
+    }
+    return h;
+}
+
+void DriftVerifier::elementChanged(const SoundCard * c, const CardChange & change)
+{
+    // The card just read or wrote the device, so both agree
+    quint32 h = hash(change.id, change.values, c->getSchema().count(change.id));
+    QMutexLocker locker(&mutex);
+    cachedSum += h - cached.at(change.id);
+    seenSum += h - seen.at(change.id);
+    cached[change.id] = h;
+    seen[change.id] = h;
+}
+
+QVector<int> DriftVerifier::nextSlice()
+{
+    // Pads are polled by the card itself (SoundCard::processEvents())
+    QVector<int> ids;
+    int size = card->getSchema().size();
+    for (int i = 0; i < slice && i < size; i++)
+    {
+        ids.append(position);
+        position = (position + 1) % size;
+    }
+    return ids;
+}
+
+void DriftVerifier::run()
+{
+    qDebug() << "Verifying card state every " << interval << " ms, "
+             << slice << " elements at a time.";
+    QVector<long> values;
+    while (!stopping)
+    {
+        msleep(interval);
+        QVector<int> ids = nextSlice();
+        for (QVector<int>::const_iterator it = ids.begin(); it != ids.end(); ++it)
+        {
+            if (!card->readDevice(*it, values))
+                continue;
+            quint32 h = hash(*it, values.constData(), values.size());
+            QMutexLocker locker(&mutex);
+            seenSum += h - seen.at(*it);
+            seen[*it] = h;
+        }
+        QVector<int> stale;
+        {
+            QMutexLocker locker(&mutex);
+            if (seenSum == cachedSum)
+                continue;
+            for (int id = 0; id < seen.size(); id++)
+                if (seen.at(id) != cached.at(id))
+                    stale.append(id);
+        }
+        // Pads are expected to change unannounced, don't count them
+        QVector<int> pads = card->unreportedElements();
+        int n = 0;
+        for (QVector<int>::const_iterator it = stale.begin(); it != stale.end(); ++it)
+            if (!pads.contains(*it))
+                n++;
+        if (n)
+        {
+            driftCount.fetchAndAddRelaxed(n);
+            qDebug() << "Warning: " << n << " elements drifted, reading them back.";
+        }
+        card->refresh(stale);
+    }
+}
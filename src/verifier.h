@@ -0,0 +1,84 @@
+/*
+ * Copyright 2010 Camilo Polymeris
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 3 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef VERIFIER_H
+#define VERIFIER_H
+
+#include <QThread>
+#include <QMutex>
+#include <QAtomicInt>
+#include <QVector>
+#include "soundcard.h"
+
+/** Checks, in the background, that the card is what we think it is.
+    The driver doesn't report every change (pads, for one), so the cache
+    and the window can silently drift away from the hardware. Every
+    interval, this thread reads a small rotating slice of the elements,
+    straight from the device. (Pads are polled by the card.)
+
+    A hash of every element's values is kept twice: as last seen on the
+    device, and as cached. Their sums are checksums of the whole control
+    set, updated incrementally. Only when those disagree are the elements
+    whose hashes differ read back through the card, which updates the
+    cache and the window.
+
+    Settings: "verifier/interval" (ms, default 100) and
+    "verifier/slice" (elements per interval, default 8).
+    */
+class DriftVerifier : public QThread, public CardObserver
+{
+    Q_OBJECT
+
+public:
+    /** Registers with the card. Call start() to begin verifying. */
+    DriftVerifier(SoundCard * card, QObject * parent = 0);
+    /** Stops the thread and unregisters. */
+    ~DriftVerifier();
+
+    /// Ask thread to finish
+    void stop();
+    /// Elements found to have drifted so far
+    int drifted() const;
+
+    void elementChanged(const SoundCard * card, const CardChange & change);
+
+protected:
+    void run();
+
+private:
+    /// Hash of an element's values
+    static quint32 hash(int id, const long * values, unsigned int n);
+    /// Elements to read in the next interval
+    QVector<int> nextSlice();
+
+    SoundCard * card;
+    int interval;
+    int slice;
+    /// Next element of the rotating slice
+    int position;
+    /// Per element hashes, as cached and as last seen on the device
+    QVector<quint32> cached;
+    QVector<quint32> seen;
+    /// Sums of the above
+    quint32 cachedSum;
+    quint32 seenSum;
+    /// Protects hashes and sums
+    QMutex mutex;
+    QAtomicInt stopping;
+    QAtomicInt driftCount;
+};
+
+#endif // VERIFIER_H